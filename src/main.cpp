@@ -76,20 +76,31 @@
 
 #include <iostream>
 #include <string>
+#include <vector>
+#include <algorithm>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 extern "C" {
 #include "jpeglib.h"
+#include "jerror.h"
 }
 #include "pcdDecode.h"
 
 #if defined(_WIN32) || defined(_WIN32_) || defined(__WIN32__) || defined(WIN32) || defined(_MSC_VER) || defined(__CYGWIN__) || defined(__MINGW32__) || defined(__BORLANDC__)
 #define pcdHaveWinOS 1
 #include <direct.h>
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <dirent.h>
+#include <glob.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #endif
 
 //////////////////////////////////////////////////////////////
@@ -420,335 +431,1196 @@ static const uint8_t ktoneCurve [] = {
 // write_JPEG_file is mostly a direct copy from the ijg's sample code, but
 // adds injecting a sRGB profile into the file. This is done without using a
 // CMM such as LittleCMS so as to minimise external dependencies
+// Rather than taking a complete RGB image, it pulls rows from the decoder a band
+// at a time, so there is never a full frame of RGB data in memory.
+// For 4:2:0 chroma (the default), the decoder is asked for YCbCr with 4:2:0 chroma,
+// which is fed straight to the JPEG library's raw data interface; that skips the 
+// decoder's chroma interpolation and the library's color conversion and 
+// downsampling. Any tone curve has already been composed into the decoder's output
+// tables, so it is in the YCbCr data too. For 4:2:2 and 4:4:4, the decoder only
+// produces 4:2:0 YCbCr, so it is asked for RGB, which the library converts.
+// Monochrome images are written as single component grayscale JPEGs; the sRGB 
+// profile is an RGB profile, so those go without it.
+// The compressor and the band buffer live in a jpegWriter, which is set up once and
+// then reused for every file that a batch worker writes.
+// How the file is encoded is set by a jpegSettings; the defaults - islow DCT, the
+// standard Huffman tables, baseline and 4:2:0 without restart markers - are the 
+// most compatible, but e.g., optimized Huffman tables make for smaller files at some
+// cost in speed, and ifast is quicker but a little less accurate.
+// Given a thread pool with more than one thread, baseline files with the standard
+// tables are compressed in horizontal stripes, one per task. Each stripe is a JPEG
+// of its own, made with the same settings, so has the same quantization and Huffman
+// tables; and as every stripe starts a restart interval, its entropy coded data 
+// doesn't depend on any other stripe. So the file is stripe 0's headers (with the 
+// full image height), then each stripe's data, with restart markers between them,
+// renumbered to run on from one stripe to the next. The result is exactly what the
+// library itself writes with a restart interval of one stripe.
 
-void write_JPEG_file (char * filename, 
-							  int quality, 
-							  JSAMPLE * image_buffer,
-							  int image_height,
-							  int image_width)
-{
+// Rows converted per call to the decoder; a multiple of the 16 row raw data groups
+#define kJPEGBandRows 64
+
+// Rows per stripe, when compressing in stripes; a multiple of all the MCU heights
+#define kJPEGStripeRows 128
+
+enum jpegSamplings {
+	kJPEG420 = 0,									// Chroma at half resolution both ways
+	kJPEG422,										// Chroma at half horizontal resolution
+	kJPEG444,										// Chroma at full resolution
+	kNumJPEGSamplings
+};
+
+static const char *kJPEGSamplingNames[kNumJPEGSamplings] = {"420", "422", "444"};
+
+#define kNumDCTMethods 3
+static const char *kDCTMethodNames[kNumDCTMethods] = {"islow", "ifast", "float"};
+static const J_DCT_METHOD kDCTMethods[kNumDCTMethods] = {JDCT_ISLOW, JDCT_IFAST, JDCT_FLOAT};
+
+struct jpegSettings {
+	int quality;
+	J_DCT_METHOD dctMethod;
+	bool optimizeCoding;							// Optimized Huffman tables; takes a second pass
+	bool progressive;
+	int sampling;									// One of jpegSamplings
+	unsigned int restartRows;						// Restart interval in MCU rows....
+	unsigned int restartBlocks;						// ....or in MCUs; 0 for none
+};
+
+// One stripe of a striped file, which is compressed into memory
+struct jpegStripe {
+	struct jpeg_compress_struct cinfo;
+	struct jpeg_error_mgr jerr;
+	struct jpeg_destination_mgr dest;
+	JOCTET * data;									// The compressed stripe; kept between files
+	size_t data_size;
+	size_t data_used;
+	
+	// What to compress; y only, unless it's raw data
+	const struct jpegSettings * settings;
+	JSAMPLE * y;
+	JSAMPLE * cb;
+	JSAMPLE * cr;
+	int row_stride;
+	int chroma_stride;
+	bool grayscale;
+	bool raw_data;
+	int image_width;
+	size_t rows;
+	unsigned int restart_rows;						// In MCU rows
+	bool write_profile;
+};
+
+struct jpegWriter {
 	// This struct contains the JPEG compression parameters and pointers to
 	// working space (which is allocated as needed by the JPEG library).
 	struct jpeg_compress_struct cinfo;
 	
 	// This struct represents a JPEG error handler.
 	struct jpeg_error_mgr jerr;
-	// The outfile and data pointers
-	FILE * outfile;
-	JSAMPROW row_pointer[1];
-	int row_stride;
 	
-	// Allocate and initialize JPEG compression object
-	cinfo.err = jpeg_std_error(&jerr);
-	jpeg_create_compress(&cinfo);
+	// Band buffer; grown as needed, and kept between files
+	JSAMPLE * band_buffer;
+	size_t band_buffer_size;
 	
-	// Specify data destination (our file)
-	if ((outfile = fopen(filename, "wb")) == NULL) {
-		fprintf(stderr, "can't open %s\n", filename);
-		exit(1);
+	// For compressing in stripes; pool may be NULL, and the stripes are made as needed
+	pcdThreadPool * pool;
+	struct jpegStripe * stripes;
+	size_t num_stripes;
+};
+
+void create_JPEG_writer (struct jpegWriter * writer, pcdThreadPool * pool)
+{
+	// Allocate and initialize JPEG compression object
+	writer->cinfo.err = jpeg_std_error(&(writer->jerr));
+	jpeg_create_compress(&(writer->cinfo));
+	writer->band_buffer = NULL;
+	writer->band_buffer_size = 0;
+	writer->pool = pool;
+	writer->stripes = NULL;
+	writer->num_stripes = 0;
+}
+
+static void destroy_JPEG_stripes (struct jpegWriter * writer)
+{
+	size_t i;
+	for (i = 0; i < writer->num_stripes; i++) {
+		jpeg_destroy_compress(&(writer->stripes[i].cinfo));
+		if (writer->stripes[i].data != NULL) free(writer->stripes[i].data);
 	}
-	jpeg_stdio_dest(&cinfo, outfile);
-	
-	// Set parameters for compression
+	if (writer->stripes != NULL) free(writer->stripes);
+	writer->stripes = NULL;
+	writer->num_stripes = 0;
+}
+
+void destroy_JPEG_writer (struct jpegWriter * writer)
+{
+	// Release JPEG compression object
+	jpeg_destroy_compress(&(writer->cinfo));
+	if (writer->band_buffer != NULL) free(writer->band_buffer);
+	writer->band_buffer = NULL;
+	writer->band_buffer_size = 0;
+	destroy_JPEG_stripes(writer);
+}
+
+// A destination manager that compresses to a stripe's memory buffer, growing it as
+// needed. The library has no way to recover from running out of memory here, so
+// that is an error exit, as it is for the library's own allocations
+static void init_stripe_destination (j_compress_ptr cinfo)
+{
+	struct jpegStripe * stripe = (struct jpegStripe *) cinfo->client_data;
+	if (stripe->data == NULL) {
+		stripe->data_size = 65536;
+		stripe->data = (JOCTET *) malloc(stripe->data_size);
+		if (stripe->data == NULL) {
+			stripe->data_size = 0;
+			ERREXIT(cinfo, JERR_OUT_OF_MEMORY);
+		}
+	}
+	stripe->dest.next_output_byte = stripe->data;
+	stripe->dest.free_in_buffer = stripe->data_size;
+	stripe->data_used = 0;
+}
+
+static boolean empty_stripe_buffer (j_compress_ptr cinfo)
+{
+	struct jpegStripe * stripe = (struct jpegStripe * ) cinfo->client_data;
+	JOCTET * new_data = (JOCTET *) realloc(stripe->data, stripe->data_size * 2);
+	if (new_data == NULL) {
+		ERREXIT(cinfo, JERR_OUT_OF_MEMORY);
+	}
+	// The buffer is always full when this is called
+	stripe->data = new_data;
+	stripe->dest.next_output_byte = new_data + stripe->data_size;
+	stripe->dest.free_in_buffer = stripe->data_size;
+	stripe->data_size *= 2;
+	return TRUE;
+}
+
+static void term_stripe_destination (j_compress_ptr cinfo)
+{
+	struct jpegStripe * stripe = (struct jpegStripe *) cinfo->client_data;
+	stripe->data_used = stripe->data_size - stripe->dest.free_in_buffer;
+}
+
+// Makes sure there are at least num_stripes stripes; returns false if there is too 
+// little memory
+static bool make_JPEG_stripes (struct jpegWriter * writer, size_t num_stripes)
+{
+	size_t i;
+	if (num_stripes <= writer->num_stripes) {
+		return true;
+	}
+	// The compression objects point into the stripes, so they can't just be moved
+	destroy_JPEG_stripes(writer);
+	writer->stripes = (struct jpegStripe *) malloc(num_stripes * sizeof(struct jpegStripe));
+	if (writer->stripes == NULL) {
+		return false;
+	}
+	for (i = 0; i < num_stripes; i++) {
+		struct jpegStripe * stripe = &(writer->stripes[i]);
+		stripe->cinfo.err = jpeg_std_error(&(stripe->jerr));
+		jpeg_create_compress(&(stripe->cinfo));
+		stripe->cinfo.client_data = (void *) stripe;
+		stripe->dest.init_destination = init_stripe_destination;
+		stripe->dest.empty_output_buffer = empty_stripe_buffer;
+		stripe->dest.term_destination = term_stripe_destination;
+		stripe->cinfo.dest = &(stripe->dest);
+		stripe->data = NULL;
+		stripe->data_size = 0;
+		stripe->data_used = 0;
+	}
+	writer->num_stripes = num_stripes;
+	return true;
+}
+
+// Sets up cinfo for compressing an image_height row image, or stripe
+static void set_JPEG_parameters (j_compress_ptr cinfo,
+								 const struct jpegSettings * settings,
+								 bool grayscale,
+								 bool raw_data,
+								 int image_height,
+								 int image_width)
+{
 	// Note that the JPEG library's "color_space" isn't actually a color space;
 	// it's really just a data format setting. The library has no knowledge of 
 	// ICC type color spaces.
-	cinfo.image_width = image_width;
-	cinfo.image_height = image_height;
-	// We will ask pcdDecoder for RGB, no alpha
-	cinfo.input_components = 3;
-	// 8-bit RGB
-	cinfo.in_color_space = JCS_RGB;
+	cinfo->image_width = image_width;
+	cinfo->image_height = image_height;
+	// We will ask pcdDecoder for YCbCr, or RGB, no alpha, or for gray
+	cinfo->input_components = grayscale ? 1 : 3;
+	// 8-bit YCbCr, RGB or gray
+	cinfo->in_color_space = grayscale ? JCS_GRAYSCALE : (raw_data ? JCS_YCbCr : JCS_RGB);
 	
-	// Now use the library's routine to set default compression parameters.
-	jpeg_set_defaults(&cinfo);
+	// Now use the library's routine to set default compression parameters. For
+	// YCbCr, that's 2x2 sampling for Y, and 1x1 for Cb and Cr - i.e., 4:2:0
+	jpeg_set_defaults(cinfo);
 	
-	// Set the quality, and specify baseline JPEG to maximise compatibility
-	jpeg_set_quality(&cinfo, quality, TRUE);
+	// Set the quality, and keep to baseline quantization tables to maximise 
+	// compatibility
+	jpeg_set_quality(cinfo, settings->quality, TRUE);
 	
-	// Start compressor, specifying a complete interchange-JPEG file
-	jpeg_start_compress(&cinfo, TRUE);
-	
-	// Write the JPEG marker header (APP2 code and marker length with its data)
-	jpeg_write_marker (&cinfo, JPEG_APP0 + 2,
-					   ksRGBProfile, sizeof(ksRGBProfile));
-	
-	// Write the actual scanlines
-	row_stride = image_width * 3;
-	while (cinfo.next_scanline < cinfo.image_height) {
-		row_pointer[0] = & image_buffer[cinfo.next_scanline * row_stride];
-		(void) jpeg_write_scanlines(&cinfo, row_pointer, 1);
+	// Then whatever the user asked for; the chroma components stay at 1x1, so Y's 
+	// factors set the subsampling
+	cinfo->dct_method = settings->dctMethod;
+	cinfo->optimize_coding = settings->optimizeCoding ? TRUE : FALSE;
+	if (!grayscale) {
+		cinfo->comp_info[0].h_samp_factor = (settings->sampling == kJPEG444) ? 1 : 2;
+		cinfo->comp_info[0].v_samp_factor = (settings->sampling == kJPEG420) ? 2 : 1;
+	}
+	cinfo->restart_interval = settings->restartBlocks;
+	cinfo->restart_in_rows = settings->restartRows;
+	if (settings->progressive) {
+		jpeg_simple_progression(cinfo);
 	}
 	
-	// Finish compression and close the file
-	jpeg_finish_compress(&cinfo);
-	fclose(outfile);
-	
-	// Release JPEG compression object
-	jpeg_destroy_compress(&cinfo);
+	// The raw data is already YCbCr, in the sampling the library expects
+	cinfo->raw_data_in = raw_data ? TRUE : FALSE;
 }
 
+// Pulls the next band of up to max_rows rows from the decoder; returns the number 
+// of rows, or 0 if the decoder failed. Raw data goes in Y rows, then half as many 
+// rows holding Cb and Cr side by side
+static size_t read_JPEG_band (pcdDecode * decoder,
+							  JSAMPLE * band_buffer,
+							  bool grayscale,
+							  bool raw_data,
+							  int row_stride,
+							  int chroma_stride,
+							  size_t max_rows)
+{
+	if (grayscale) {
+		return decoder->readUInt8GrayScanlines(band_buffer, 1, max_rows);
+	}
+	else if (raw_data) {
+		JSAMPLE * cb_band = band_buffer + max_rows * row_stride;
+		return decoder->readYCbCrScanlines(band_buffer, cb_band, cb_band + row_stride / 2, row_stride, chroma_stride, 1, max_rows);
+	}
+	return decoder->readUInt8Scanlines(&(band_buffer[0]), &(band_buffer[1]), &(band_buffer[2]), NULL, 3, max_rows);
+}
 
-//////////////////////////////////////////////////////////////
-//
-// The main program 
-//
-//////////////////////////////////////////////////////////////
-// All this does is to parse the command line, pass the file to the decoder,
-// apply brightness if requested, then write out the file as a JPEG
-
-#define kpcdtojpegVersion "1.0.11"
+// Compresses band_rows rows of RGB or gray; the whole band goes to the library in 
+// as few calls as possible
+static void write_JPEG_band (j_compress_ptr cinfo,
+							 JSAMPLE * band,
+							 size_t band_rows,
+							 int row_stride)
+{
+	JSAMPROW row_pointers[kJPEGBandRows];
+	size_t row, rows, i;
+	for (row = 0; row < band_rows; row += rows) {
+		rows = band_rows - row;
+		rows = rows > kJPEGBandRows ? kJPEGBandRows : rows;
+		for (i = 0; i < rows; i++) {
+			row_pointers[i] = & band[(row + i) * row_stride];
+		}
+		for (i = 0; i < rows; ) {
+			i += jpeg_write_scanlines(cinfo, &(row_pointers[i]), (JDIMENSION) (rows - i));
+		}
+	}
+}
 
-void printName()
+// Compresses band_rows rows of raw 4:2:0 YCbCr
+static void write_JPEG_raw_band (j_compress_ptr cinfo,
+								 JSAMPLE * y_band,
+								 JSAMPLE * cb_band,
+								 JSAMPLE * cr_band,
+								 size_t band_rows,
+								 int image_width,
+								 int row_stride,
+								 int chroma_stride)
 {
-	fprintf (stderr,
-			 "\n"
-			 "pcdtojpeg, version " kpcdtojpegVersion " "
-			 "\n"
-			 "Copyright (C) 2009-2013 Sandy McGuffog\n"
-			 "JPEG compression code Copyright (C) 1991-1998, Thomas G. Lane.\n");		
+	JSAMPROW y_rows[16], cb_rows[8], cr_rows[8];
+	JSAMPARRAY planes[3];
+	size_t padded_rows, row, col, i;
+	
+	// The library wants whole row groups, so pad out the columns and rows by
+	// repeating the last ones. Photo CD image sizes are multiples of 16, so this
+	// shouldn't actually happen
+	padded_rows = (band_rows + 15) & ~((size_t) 15);
+	for (row = 0; row < padded_rows; row++) {
+		if (row >= band_rows) {
+			memcpy(y_band + row * row_stride, y_band + (band_rows - 1) * row_stride, row_stride);
+		}
+		for (col = image_width; col < (size_t) row_stride; col++) {
+			y_band[row * row_stride + col] = y_band[row * row_stride + image_width - 1];
+		}
+	}
+	for (row = 0; row < padded_rows / 2; row++) {
+		if (row >= (band_rows / 2)) {
+			memcpy(cb_band + row * chroma_stride, cb_band + (band_rows / 2 - 1) * chroma_stride, chroma_stride);
+		}
+		for (col = image_width / 2; col < (size_t) row_stride / 2; col++) {
+			cb_band[row * chroma_stride + col] = cb_band[row * chroma_stride + image_width / 2 - 1];
+			cr_band[row * chroma_stride + col] = cr_band[row * chroma_stride + image_width / 2 - 1];
+		}
+	}
+	for (row = 0; row < padded_rows; row += 16) {
+		for (i = 0; i < 16; i++) {
+			y_rows[i] = y_band + (row + i) * row_stride;
+		}
+		for (i = 0; i < 8; i++) {
+			cb_rows[i] = cb_band + (row / 2 + i) * chroma_stride;
+			cr_rows[i] = cr_band + (row / 2 + i) * chroma_stride;
+		}
+		planes[0] = y_rows;
+		planes[1] = cb_rows;
+		planes[2] = cr_rows;
+		(void) jpeg_write_raw_data(cinfo, planes, 16);
+	}
 }
 
-void printUsage(char * const argv [], bool isVerbose)
+// A pool task; compresses one stripe as a complete JPEG
+static void compress_JPEG_stripe (void * s)
 {
-	if (!isVerbose) printName();
-	fprintf (stderr,
-			 "\n"
-			 "Usage:  %s [options] file1 [file2]\n"
-			 "\n"
-			 "Valid options:\n"
-			 "-h            Print this message\n"
-			 "-v            Verbose file information\n"
-			 "-m            Process the file as monochrome\n"
-			 "-D50          Process for a white balance of D50\n"
-			 "-D65          Process for a white balance of D65 <default>\n"
-			 "-q nnn        JPEG file quality (nnn range 1 to 100 <100>)\n"
-			 "-b n.n        Brightness adjustment (n.n range -2.0 to 2.0 <0.0>)\n"			 
-			 "-r n          Highest resolution to extract (n range 0 to 5):\n"
-			 "                 0 - Base/16 (128 x 192)\n"
-			 "                 1 - Base/4 (256 x 384)\n"
-			 "                 2 - Base (512 x 768)\n"
-			 "                 3 - 4Base (1024 x 1536)\n"
-			 "                <4 - 16Base (2048 x 3072)>\n"
-			 "                 5 - 64Base (4096 x 6144)\n"
-			 "\n",
-			 argv [0]);		
+	struct jpegStripe * stripe = (struct jpegStripe *) s;
+	j_compress_ptr cinfo = &(stripe->cinfo);
+	
+	set_JPEG_parameters(cinfo, stripe->settings, stripe->grayscale, stripe->raw_data, (int) stripe->rows, stripe->image_width);
+	cinfo->restart_interval = 0;
+	cinfo->restart_in_rows = stripe->restart_rows;
+	jpeg_start_compress(cinfo, TRUE);
+	if (stripe->write_profile) {
+		jpeg_write_marker (cinfo, JPEG_APP0 + 2,
+						   ksRGBProfile, sizeof(ksRGBProfile));
+	}
+	if (stripe->raw_data) {
+		write_JPEG_raw_band(cinfo, stripe->y, stripe->cb, stripe->cr, stripe->rows, 
+							stripe->image_width, stripe->row_stride, stripe->chroma_stride);
+	}
+	else {
+		write_JPEG_band(cinfo, stripe->y, stripe->rows, stripe->row_stride);
+	}
+	jpeg_finish_compress(cinfo);
 }
 
-int main (int argc, char * const argv[]) {
-    // parse the arguments
-	bool doneWithArguments = false;
-	int argIndex = 1;
-	bool isVerbose = false;
-	bool isMonochrome = false;
-	bool isD50White = false;
-	int jpegQuality = 100;
-	float jpegBoost = 0.0f;
-	int resolution = 4;
-	size_t width, height;
-	pcdDecode *decoder;
-	char outFile[1024];
-	char iceFile[1024];
+// Works out whether the image can be compressed in stripes, and if so, makes the 
+// stripes; returns the number of stripes to compress at a time, or 0 to compress the
+// image in one piece
+static size_t plan_JPEG_stripes (struct jpegWriter * writer,
+								 const struct jpegSettings * settings,
+								 bool grayscale,
+								 int image_height,
+								 int image_width,
+								 size_t * stripe_rows,
+								 unsigned int * restart_rows)
+{
+	unsigned int threads, mcu_height, mcu_width, mcus_per_row, stripe_mcu_rows;
+	size_t num_stripes;
 	
-	if (argc < 2) {
-		printUsage(argv, isVerbose);
-		exit(0);
+	*stripe_rows = 0;
+	*restart_rows = 0;
+	
+	// Optimized Huffman tables would be different for each stripe, and a
+	// progressive file has more than one scan; and the stripes have to line up with
+	// the restart intervals
+	if ((writer->pool == NULL) || settings->optimizeCoding || settings->progressive || (settings->restartBlocks != 0)) {
+		return 0;
 	}
-	while ((!doneWithArguments) && (argIndex < argc)) {
-		std::string thisArg(argv[argIndex]);
-		if (thisArg[0] == '-') {
-			if ((thisArg == "-h") || (thisArg == "-H")) {
-				printUsage(argv, isVerbose);
-				exit(0);
-			}
-			else if (thisArg == "-v") {
-				isVerbose = true;
-				printName();
-			}
-			else if (thisArg == "-m") {
-				isMonochrome = true;
-			}
-			else if (thisArg == "-D50") {
-				isD50White = true;
-			}
-			else if (thisArg == "-D65") {
-				isD50White = false;
-			}
-			else if (thisArg == "-q") {
-				if (argIndex > (argc - 2)) {
-					printUsage(argv, isVerbose);
-					exit(-1);
-				}
-				jpegQuality = atoi(argv[argIndex+1]);
-				jpegQuality = jpegQuality > 100 ? 100 : jpegQuality;
-				jpegQuality = jpegQuality < 0 ? 0 : jpegQuality;				
-				argIndex++;
+	threads = writer->pool->getNumThreads();
+	if (threads < 2) {
+		return 0;
+	}
+	mcu_height = (!grayscale && (settings->sampling == kJPEG420)) ? 16 : 8;
+	mcu_width = (!grayscale && (settings->sampling != kJPEG444)) ? 16 : 8;
+	mcus_per_row = (image_width + mcu_width - 1) / mcu_width;
+	
+	// A stripe is a whole number of the user's restart intervals, if there are any;
+	// and the interval, in MCUs, has to fit in the file's DRI marker
+	stripe_mcu_rows = kJPEGStripeRows / mcu_height;
+	if (settings->restartRows != 0) {
+		stripe_mcu_rows = ((stripe_mcu_rows + settings->restartRows - 1) / settings->restartRows) * settings->restartRows;
+	}
+	*restart_rows = (settings->restartRows != 0) ? settings->restartRows : stripe_mcu_rows;
+	if (((unsigned long) *restart_rows * mcus_per_row) > 65535) {
+		return 0;
+	}
+	*stripe_rows = stripe_mcu_rows * mcu_height;
+	if ((size_t) image_height <= *stripe_rows) {
+		return 0;
+	}
+	
+	// A couple of stripes per thread at a time keeps the threads busy, without 
+	// holding too much of the image in memory
+	num_stripes = (image_height + *stripe_rows - 1) / *stripe_rows;
+	num_stripes = num_stripes > (threads * 2) ? (threads * 2) : num_stripes;
+	if (!make_JPEG_stripes(writer, num_stripes)) {
+		// Just do it the slow way
+		return 0;
+	}
+	return num_stripes;
+}
+
+// Finds the start of the entropy coded data in a stripe, and the frame header, by 
+// walking the marker segments up to the end of the SOS segment
+static size_t find_JPEG_scan (const JOCTET * data, size_t size, size_t * sof)
+{
+	size_t i = 2, length;
+	*sof = 0;
+	while ((i + 4) <= size) {
+		if (data[i] != 0xFF) {
+			break;
+		}
+		length = (((size_t) data[i+2]) << 8) | data[i+3];
+		if ((data[i+1] >= 0xC0) && (data[i+1] <= 0xCF) && (data[i+1] != 0xC4) && (data[i+1] != 0xC8) && (data[i+1] != 0xCC)) {
+			*sof = i;
+		}
+		if (data[i+1] == 0xDA) {
+			return i + 2 + length;
+		}
+		i += 2 + length;
+	}
+	return 0;
+}
+
+// Appends the compressed stripes to the file. The first stripe of the file brings
+// its headers with it; every other stripe is preceded by a restart marker, and the 
+// restart markers within a stripe are renumbered to follow on
+static bool write_JPEG_stripes (FILE * outfile,
+								struct jpegStripe * stripes,
+								size_t num_stripes,
+								bool first,
+								int image_height,
+								unsigned int * restart_count)
+{
+	size_t stripe, sof, start, end, i;
+	JOCTET marker[2];
+	
+	for (stripe = 0; stripe < num_stripes; stripe++) {
+		JOCTET * data = stripes[stripe].data;
+		start = find_JPEG_scan(data, stripes[stripe].data_used, &sof);
+		// The stripe ends with an EOI marker
+		end = stripes[stripe].data_used - 2;
+		if ((start == 0) || (sof == 0) || (start > end)) {
+			fprintf(stderr, "Could not assemble the JPEG stripes\n");
+			return false;
+		}
+		if (first && (stripe == 0)) {
+			// Headers, with the image height in the frame header
+			data[sof + 5] = (JOCTET) ((image_height >> 8) & 0xFF);
+			data[sof + 6] = (JOCTET) (image_height & 0xFF);
+			if (fwrite(data, 1, start, outfile) != start) {
+				return false;
 			}
-			else if (thisArg == "-b") {
-				if (argIndex > (argc - 2)) {
-					printUsage(argv, isVerbose);
-					exit(-1);
-				}
-				jpegBoost = (float) atof(argv[argIndex+1]);
-				jpegBoost = jpegBoost > 2.0f ? 2.0f : jpegBoost;
-				jpegBoost = jpegBoost < -2.0f ? -2.0f : jpegBoost;				
-				argIndex++;
+		}
+		else {
+			marker[0] = 0xFF;
+			marker[1] = (JOCTET) (0xD0 + ((*restart_count)++ & 7));
+			if (fwrite(marker, 1, 2, outfile) != 2) {
+				return false;
 			}
-			else if (thisArg == "-r") {
-				if (argIndex > (argc - 2)) {
-					printUsage(argv, isVerbose);
-					exit(-1);
-				}
-				resolution = atoi(argv[argIndex+1]);
-				resolution = resolution > 5 ? 5 : resolution;
-				resolution = resolution < 0 ? 0 : resolution;				
-				argIndex++;				
+		}
+		for (i = start; (i + 1) < end; i++) {
+			if ((data[i] == 0xFF) && (data[i+1] >= 0xD0) && (data[i+1] <= 0xD7)) {
+				data[i+1] = (JOCTET) (0xD0 + ((*restart_count)++ & 7));
 			}
-			else {
-				fprintf (stderr, "Invalid argument\n");		
-				printUsage(argv, isVerbose);
-				exit(-1);
-				}
-			argIndex++;
 		}
-		else {
-			doneWithArguments = true;
+		if (fwrite(data + start, 1, end - start, outfile) != (end - start)) {
+			return false;
 		}
 	}
-	// Now check we have file[s]
-	if (argIndex > (argc - 1)) {
-		fprintf (stderr, "Invalid argument\n");		
-		printUsage(argv, isVerbose);
-		exit(-1);
-	}
-
-	// Let's see if we can actually find this file
-	// Of course, windows can't even have a normal stat function.....
+	return true;
+}
 
+// Returns false, having said why, if the file could not be written
+bool write_JPEG_file (struct jpegWriter * writer,
+							  const char * filename, 
+							  const struct jpegSettings * settings, 
+							  pcdDecode * decoder,
+							  int image_height,
+							  int image_width)
+{
+	struct jpeg_compress_struct & cinfo = writer->cinfo;
+	// The outfile and data pointers
+	FILE * outfile;
+	int row_stride, chroma_stride;
+	JSAMPLE * band_buffer;
+	size_t band_size, band_rows, max_rows, row, num_stripes, stripe_rows, stripe;
+	unsigned int restart_rows, restart_count;
+	bool grayscale = decoder->isMonochrome();
+	bool raw_data = !grayscale && (settings->sampling == kJPEG420);
+	bool toStdout = (strcmp(filename, "-") == 0);
+	bool success = true;
+	
+	num_stripes = plan_JPEG_stripes(writer, settings, grayscale, image_height, image_width, &stripe_rows, &restart_rows);
+	max_rows = (num_stripes > 0) ? num_stripes * stripe_rows : kJPEGBandRows;
+	if (grayscale) {
+		row_stride = image_width;
+		chroma_stride = 0;
+		band_size = max_rows * row_stride;
+	}
+	else if (raw_data) {
+		// Y, then half as many rows holding Cb and Cr side by side; rows are padded
+		// out to whole DCT blocks
+		row_stride = (image_width + 15) & ~15;
+		chroma_stride = row_stride;
+		band_size = max_rows * row_stride + (max_rows / 2) * chroma_stride;
+	}
+	else {
+		row_stride = image_width * 3;
+		chroma_stride = 0;
+		band_size = max_rows * row_stride;
+	}
+	if (band_size > writer->band_buffer_size) {
+		if (writer->band_buffer != NULL) free(writer->band_buffer);
+		writer->band_buffer = (JSAMPLE *) malloc(band_size * sizeof(JSAMPLE));
+		writer->band_buffer_size = (writer->band_buffer != NULL) ? band_size : 0;
+	}
+	band_buffer = writer->band_buffer;
+	if (band_buffer == NULL) {
+		fprintf(stderr, "Could not allocate memory for the JPEG conversion\n");
+		return false;
+	}
+	
+	// Specify data destination (our file, or stdout for "-"); the library's stdio 
+	// destination manager writes it a buffer at a time as it is compressed
+	if (toStdout) {
 #if defined(pcdHaveWinOS)
-	struct _stat stFileInfo;  
-	if (_stat(argv[argIndex], &stFileInfo) == -1) {
-#else
-	struct stat stFileInfo;  
-	if (stat(argv[argIndex], &stFileInfo) == -1) {			
+		_setmode(_fileno(stdout), _O_BINARY);
 #endif
-		fprintf (stderr, "pcdtojpeg could not find the file \"%s\" - check the name you entered\n", argv[argIndex]);		
-		exit(-1);		
+		outfile = stdout;
 	}
-	// Get us a decoder
-	decoder = new pcdDecode();
-	if (decoder == NULL) {
-		fprintf (stderr, "Could not create a decoder - probably too little memory\n");		
-		exit(-1);		
+	else if ((outfile = fopen(filename, "wb")) == NULL) {
+		fprintf(stderr, "can't open %s\n", filename);
+		return false;
 	}
-	// Set to the best possible quality interpolation; if this is the the GPL decoder,
-	// it doesn't actually have the kUpResLumaIterpolate, but will automatically fall 
-	// back to the best it has
-	decoder->setInterpolation(kUpResLumaIterpolate);
+	
+	if (num_stripes == 0) {
+		jpeg_stdio_dest(&cinfo, outfile);
 		
-	if (resolution > k16Base) {
-		size_t loc;
-		std::string pathSep;
-		// Some *nix OS's mount older CD-ROMs with a mapping that turns the path all
-		// lower case. We detect that here, and adjust how we create the paths.
-		// See mount(8) - Linux man page
-		bool useLowerCase = false;
-		// We need to generate the location of the IC file.
-		// Note this only works if the directory structure is the same as the original CD
-		// Also note that here, if there isn't a path separator in the path, we can't find 
-		// the file anyway, so this is an ok way to decide what separator to use.
-		std::string srcFile(argv[argIndex]);
-		// Make sure there is enough room in the string, because the standard
-		// C++ string implementation is too dumb to do so.....
-		srcFile.resize(srcFile.size()+25);
-
-		// What is our separator?
-		if (srcFile.find('/') != srcFile.npos) {
-			pathSep = "/";
-		}
-		else if (srcFile.find('\\') != srcFile.npos) {
-			pathSep = "\\";
+		// Set parameters for compression
+		set_JPEG_parameters(&cinfo, settings, grayscale, raw_data, image_height, image_width);
+		
+		// Start compressor, specifying a complete interchange-JPEG file
+		jpeg_start_compress(&cinfo, TRUE);
+		
+		// Write the JPEG marker header (APP2 code and marker length with its data)
+		if (!grayscale) {
+			jpeg_write_marker (&cinfo, JPEG_APP0 + 2,
+							   ksRGBProfile, sizeof(ksRGBProfile));
 		}
-		else {
-			std::string exeFile(argv[0]);
-			if (exeFile.find('/') != exeFile.npos) {
-				pathSep = "/";
+	}
+	
+	// Write the actual scanlines. Each band is converted from the decoder's YCC data
+	// (multi-threaded, if multi-threading is enabled in the decoder library) just 
+	// before it is compressed
+	restart_count = 0;
+	for (row = 0; success && (row < (size_t) image_height); row += band_rows) {
+		band_rows = read_JPEG_band(decoder, band_buffer, grayscale, raw_data, row_stride, chroma_stride, max_rows);
+		if (band_rows == 0) {
+			// Don't leave a truncated file behind
+			fprintf(stderr, "Decoder Error: %s\n", decoder->getErrorString());
+			if (num_stripes == 0) jpeg_abort_compress(&cinfo);
+			if (!toStdout) {
+				fclose(outfile);
+				remove(filename);
 			}
-			else if (exeFile.find('\\') != exeFile.npos) {
-				pathSep = "\\";
+			return false;
+		}
+		if (num_stripes == 0) {
+			if (raw_data) {
+				JSAMPLE * cb_band = band_buffer + max_rows * row_stride;
+				write_JPEG_raw_band(&cinfo, band_buffer, cb_band, cb_band + row_stride / 2, band_rows, 
+									image_width, row_stride, chroma_stride);
 			}
 			else {
-				// Default by platform. We hope.
-#if defined(pcdHaveWinOS)
-				pathSep = "\\";
-#else
-				pathSep = "/";			
-#endif
+				write_JPEG_band(&cinfo, band_buffer, band_rows, row_stride);
 			}
 		}
-		
-		// If we are using the working directory, find the full path..
-		if ((!(srcFile.find_first_of(pathSep) <= 2)) && (srcFile.find_first_of(":") != 1)) {
-			// Need the current working directory
-#if defined(pcdHaveWinOS)
-			char *workDir =  _getcwd(NULL, 0);
-#else
-			char *workDir =  getcwd(NULL, 0);			
-#endif
-			srcFile = srcFile.insert(0, pathSep);		
-			srcFile = srcFile.insert(0, workDir);
-			free(workDir);
+		else {
+			// Compress the band's stripes in parallel, then add them to the file
+			size_t band_stripes = (band_rows + stripe_rows - 1) / stripe_rows;
+			for (stripe = 0; stripe < band_stripes; stripe++) {
+				struct jpegStripe * s = &(writer->stripes[stripe]);
+				s->settings = settings;
+				s->y = band_buffer + stripe * stripe_rows * row_stride;
+				s->cb = band_buffer + max_rows * row_stride + stripe * (stripe_rows / 2) * chroma_stride;
+				s->cr = s->cb + row_stride / 2;
+				s->row_stride = row_stride;
+				s->chroma_stride = chroma_stride;
+				s->grayscale = grayscale;
+				s->raw_data = raw_data;
+				s->image_width = image_width;
+				s->rows = (band_rows - stripe * stripe_rows) > stripe_rows ? stripe_rows : (band_rows - stripe * stripe_rows);
+				s->restart_rows = restart_rows;
+				s->write_profile = !grayscale && (row == 0) && (stripe == 0);
+			}
+			writer->pool->runTasks(compress_JPEG_stripe, writer->stripes, sizeof(struct jpegStripe), band_stripes);
+			success = write_JPEG_stripes(outfile, writer->stripes, band_stripes, row == 0, image_height, &restart_count);
 		}
+	}
+	
+	// Finish compression and close the file; the compression object is left ready 
+	// for the next file
+	if (num_stripes == 0) {
+		jpeg_finish_compress(&cinfo);
+	}
+	else if (success) {
+		success = (fputc(0xFF, outfile) != EOF) && (fputc(JPEG_EOI, outfile) != EOF);
+	}
+	if (toStdout) {
+		return (fflush(outfile) == 0) && success;
+	}
+	success = (fclose(outfile) == 0) && success;
+	if (!success) {
+		fprintf(stderr, "Could not write %s\n", filename);
+		remove(filename);
+	}
+	return success;
+}
 
-		std::string nameOnly;
-		loc = srcFile.find_last_of(".");
-		if (loc != std::string::npos) {
-			nameOnly = srcFile.erase(loc);
+
+//////////////////////////////////////////////////////////////
+//
+// Raw output 
+//
+//////////////////////////////////////////////////////////////
+// Uncompressed output for feeding other tools: binary PPM (or PGM for monochrome) 
+// and PAM at 8 or 16 bits per sample, and PFM in 32-bit float. Like the JPEG 
+// writer, these pull the image from the decoder a band at a time, with the same 
+// sRGB data as goes into the JPEGs; but there is no compression stage, so a band
+// is just laid out as the format wants and written.
+// A named file is sized up front and memory-mapped, and where the layout allows,
+// the decoder writes its rows straight into the mapping. Output to stdout ("-") is
+// written row by row as it is decoded; except for PFM, which stores its rows bottom
+// to top, and so has to be held in memory until the last row is done.
+
+enum outputFormats {
+	kJPEGOutput = 0,
+	kPPMOutput,										// 8-bit PPM, or PGM if monochrome
+	kPPM16Output,									// As PPM, with 16-bit samples
+	kPAMOutput,										// 8-bit PAM
+	kPAM16Output,									// 16-bit PAM
+	kPFMOutput,										// 32-bit float PFM
+	kNumOutputFormats
+};
+
+static const char *kOutputFormatNames[kNumOutputFormats] = {"jpeg", "ppm", "ppm16", "pam", "pam16", "pfm"};
+static const char *kOutputExtensions[kNumOutputFormats] = {".jpg", ".ppm", ".ppm", ".pam", ".pam", ".pfm"};
+
+// Where raw output goes; either a mapping (of the output file, or for PFM to stdout, 
+// just memory), or a stream
+struct rawSink {
+	FILE *file;
+	size_t position;								// Of the stream
+	uint8_t *map;
+	size_t size;
+	bool mapIsFile;
+	bool toStdout;
+};
+
+static bool openRawSink(struct rawSink *sink, const char *filename, size_t size, bool sequential)
+{
+	sink->file = NULL;
+	sink->position = 0;
+	sink->map = NULL;
+	sink->size = size;
+	sink->mapIsFile = false;
+	sink->toStdout = (strcmp(filename, "-") == 0);
+	if (sink->toStdout) {
+#if defined(pcdHaveWinOS)
+		_setmode(_fileno(stdout), _O_BINARY);
+#endif
+		sink->file = stdout;
+		if (!sequential) {
+			sink->map = (uint8_t *) malloc(size);
+			return sink->map != NULL;
 		}
-		
-		loc = nameOnly.find_last_of(pathSep);
-		if (loc != std::string::npos) {
-			nameOnly = nameOnly.substr(loc+1);
+		return true;
+	}
+#if !defined(pcdHaveWinOS)
+	int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0) {
+		return false;
+	}
+	if (ftruncate(fd, (off_t) size) == 0) {
+		void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (map != MAP_FAILED) {
+			close(fd);
+			sink->map = (uint8_t *) map;
+			sink->mapIsFile = true;
+			return true;
 		}
-		
-		if (loc != std::string::npos) {
-			srcFile.erase(loc);
+	}
+	close(fd);
+#endif
+	// No mapping; just write it
+	sink->file = fopen(filename, "wb");
+	return sink->file != NULL;
+}
+
+static bool writeRawSink(struct rawSink *sink, size_t offset, const void *data, size_t bytes)
+{
+	if (sink->map != NULL) {
+		memcpy(sink->map + offset, data, bytes);
+		return true;
+	}
+	if ((offset != sink->position) && (fseek(sink->file, (long) offset, SEEK_SET) != 0)) {
+		return false;
+	}
+	sink->position = offset + bytes;
+	return fwrite(data, 1, bytes, sink->file) == bytes;
+}
+
+// Finishes off the output; or, if not success, throws away whatever there is of it
+static bool closeRawSink(struct rawSink *sink, const char *filename, bool success)
+{
+	if (sink->map != NULL) {
+		if (sink->mapIsFile) {
+#if !defined(pcdHaveWinOS)
+			munmap(sink->map, sink->size);
+#endif
 		}
-		loc = srcFile.find_last_of(pathSep);
-		if (loc != std::string::npos) {
-			srcFile.erase(loc+1);
+		else {
+			if (success) {
+				success = fwrite(sink->map, 1, sink->size, sink->file) == sink->size;
+			}
+			free(sink->map);
+		}
+		sink->map = NULL;
+	}
+	if (sink->toStdout) {
+		success = (fflush(stdout) == 0) && success;
+	}
+	else {
+		if (sink->file != NULL) {
+			success = (fclose(sink->file) == 0) && success;
 		}
+		if (!success) {
+			remove(filename);
+		}
+	}
+	sink->file = NULL;
+	return success;
+}
 
+// Returns false, having said why, if the file couldn't be written
+bool write_raw_file (const char * filename,
+					 int format,
+					 pcdDecode * decoder,
+					 int image_height,
+					 int image_width)
+{
+	bool grayscale = decoder->isMonochrome();
+	size_t channels = grayscale ? 1 : 3;
+	size_t sampleSize = (format == kPFMOutput) ? sizeof(float) : (((format == kPPM16Output) || (format == kPAM16Output)) ? 2 : 1);
+	size_t rowBytes = image_width * channels * sampleSize;
+	size_t samples, band_rows, row, i, done;
+	char header[256];
+	size_t headerSize;
+	struct rawSink sink;
+	uint8_t *band_buffer, *band;
+	bool success = true;
+	uint16_t one = 1;
+	bool littleEndian = (*((uint8_t *) &one) == 1);
+	
+	switch (format) {
+		case kPPMOutput:
+		case kPPM16Output:
+			sprintf(header, "P%c\n%d %d\n%d\n", grayscale ? '5' : '6', image_width, image_height, 
+					(format == kPPMOutput) ? 255 : 65535);
+			break;
+		case kPAMOutput:
+		case kPAM16Output:
+			sprintf(header, "P7\nWIDTH %d\nHEIGHT %d\nDEPTH %d\nMAXVAL %d\nTUPLTYPE %s\nENDHDR\n", 
+					image_width, image_height, (int) channels, (format == kPAMOutput) ? 255 : 65535,
+					grayscale ? "GRAYSCALE" : "RGB");
+			break;
+		default:
+			// PFM's scale is negative for little endian data
+			sprintf(header, "P%c\n%d %d\n%s\n", grayscale ? 'f' : 'F', image_width, image_height, 
+					littleEndian ? "-1.0" : "1.0");
+			break;
+	}
+	headerSize = strlen(header);
+	
+	// The decoder always produces RGB at the deeper sample sizes, so bands are 
+	// big enough for that even if monochrome
+	band_buffer = (uint8_t *) malloc(kJPEGBandRows * image_width * 3 * sampleSize);
+	if (band_buffer == NULL) {
+		fprintf(stderr, "Could not allocate memory for the output conversion\n");
+		return false;
+	}
+	if (!openRawSink(&sink, filename, headerSize + rowBytes * image_height, format != kPFMOutput)) {
+		fprintf(stderr, "can't open %s\n", filename);
+		free(band_buffer);
+		return false;
+	}
+	success = writeRawSink(&sink, 0, header, headerSize);
+	if (!success) {
+		fprintf(stderr, "Could not write %s\n", filename);
+	}
+	
+	done = 0;
+	while (success && (done < (size_t) image_height)) {
+		// When the band can go straight into the file as laid out, have the decoder 
+		// write it there; 16-bit samples only if the header leaves them aligned
+		band = ((sink.map != NULL) && (format != kPFMOutput) && ((sampleSize == 1) || !grayscale) &&
+				((headerSize % sampleSize) == 0)) ? 
+					sink.map + headerSize + done * rowBytes : band_buffer;
+		if (sampleSize == 1) {
+			if (grayscale) {
+				band_rows = decoder->readUInt8GrayScanlines(band, 1, kJPEGBandRows);
+			}
+			else {
+				band_rows = decoder->readUInt8Scanlines(&(band[0]), &(band[1]), &(band[2]), NULL, 3, kJPEGBandRows);
+			}
+		}
+		else if (format == kPFMOutput) {
+			float *fband = (float *) band;
+			band_rows = decoder->readFloatScanlines(&(fband[0]), &(fband[1]), &(fband[2]), NULL, 3, kJPEGBandRows);
+		}
+		else {
+			uint16_t *sband = (uint16_t *) band;
+			band_rows = decoder->readUInt16Scanlines(&(sband[0]), &(sband[1]), &(sband[2]), NULL, 3, kJPEGBandRows);
+		}
+		if (band_rows == 0) {
+			fprintf(stderr, "Decoder Error: %s\n", decoder->getErrorString());
+			success = false;
+			break;
+		}
+		samples = band_rows * image_width * channels;
 		
-		useLowerCase = (nameOnly.find_last_of("img") != std::string::npos);
+		if (format == kPFMOutput) {
+			float *fband = (float *) band;
+			for (i = 0; i < samples; i++) {
+				// The decoder's RGB is all the same for monochrome; just keep the green
+				if (grayscale) fband[i] = fband[i*3 + 1];
+			}
+		}
+		else if (sampleSize == 2) {
+			uint16_t *sband = (uint16_t *) band;
+			for (i = 0; i < samples; i++) {
+				uint16_t value = grayscale ? sband[i*3 + 1] : sband[i];
+				// P[PA]M samples are big endian
+				if (littleEndian) value = (uint16_t) ((value << 8) | (value >> 8));
+				sband[i] = value;
+			}
+		}
 		
-		srcFile.append(useLowerCase ? "ipe" : "IPE");
-		srcFile.append(pathSep);
-		srcFile.append(nameOnly);
-		srcFile.append(pathSep);
-		srcFile.append(useLowerCase ? "64base" : "64BASE");
-		srcFile.append(pathSep);
-		srcFile.append(useLowerCase ? "info.ic" : "INFO.IC");
-		strncpy(iceFile, srcFile.c_str(), 1024);
+		// Unless it is already in place, write it out
+		if ((band == band_buffer) && (format == kPFMOutput)) {
+			for (row = 0; success && (row < band_rows); row++) {
+				success = writeRawSink(&sink, headerSize + (image_height - 1 - (done + row)) * rowBytes, 
+									   band + row * rowBytes, rowBytes);
+			}
+		}
+		else if (band == band_buffer) {
+			success = writeRawSink(&sink, headerSize + done * rowBytes, band, band_rows * rowBytes);
+		}
+		if (!success) {
+			fprintf(stderr, "Could not write %s\n", filename);
+		}
+		done += band_rows;
+	}
+	
+	free(band_buffer);
+	if (!closeRawSink(&sink, filename, success) && success) {
+		fprintf(stderr, "Could not write %s\n", filename);
+		success = false;
+	}
+	return success;
+}
+
+
+//////////////////////////////////////////////////////////////
+//
+// File conversion 
+//
+//////////////////////////////////////////////////////////////
+// Everything needed to take one PCD file through to a JPEG. In batch mode, several
+// workers run this at the same time, each with its own decoder and JPEG writer,
+// so the only shared state is the options, and the lock that keeps their console 
+// output from interleaving.
+
+// Batch workers need a lock for the console, and threads of their own; mirrors the 
+// decoder library's mutexes and threads. Without threads, the workers just run one
+// after the other
+#ifdef mNoPThreads
+#define batchMutex int
+#define batchMutexInit(theMutex) {}
+#define batchMutexDestroy(theMutex) {}
+#define batchMutexLock(theMutex) {}
+#define batchMutexUnlock(theMutex) {}
+#define batchThread int
+#define batchThreadFunction void *
+#define batchStartThread(theThread, theFunction, theData) ((theThread = 0), (void) theFunction(theData), 0)
+#define batchThreadJoin(theThread) {}
+#else
+#ifdef _MSC_VER
+#include <windows.h>
+#include <process.h>
+#define batchThread HANDLE
+#define batchThreadFunction unsigned __stdcall
+#define batchStartThread(theThread, theFunction, theData) ((theThread = (HANDLE)_beginthreadex(NULL, 0, theFunction, theData, 0, NULL)) == NULL ? -1 : 0)
+#define batchThreadJoin(theThread) {WaitForSingleObject(theThread, INFINITE); CloseHandle(theThread);}
+#define batchMutex CRITICAL_SECTION
+#define batchMutexInit(theMutex) InitializeCriticalSection(&(theMutex))
+#define batchMutexDestroy(theMutex) DeleteCriticalSection(&(theMutex))
+#define batchMutexLock(theMutex) EnterCriticalSection(&(theMutex))
+#define batchMutexUnlock(theMutex) LeaveCriticalSection(&(theMutex))
+#else
+#include <pthread.h>
+#define batchThread pthread_t
+#define batchThreadFunction void *
+#define batchStartThread(theThread, theFunction, theData) pthread_create(&(theThread), NULL, theFunction, theData)
+#define batchThreadJoin(theThread) pthread_join(theThread, NULL)
+#define batchMutex pthread_mutex_t
+#define batchMutexInit(theMutex) pthread_mutex_init(&(theMutex), NULL)
+#define batchMutexDestroy(theMutex) pthread_mutex_destroy(&(theMutex))
+#define batchMutexLock(theMutex) pthread_mutex_lock(&(theMutex))
+#define batchMutexUnlock(theMutex) pthread_mutex_unlock(&(theMutex))
+#endif
+#endif
+
+struct conversionOptions {
+	const char *exeName;
+	bool isVerbose;
+	bool isMonochrome;
+	bool isD50White;
+	struct jpegSettings jpeg;
+	int resolution;
+	int format;										// One of outputFormats
+	const float *toneCurve;							// 256 points, or NULL for none
+	bool isBatch;									// Write via a .part file (see convertFile)
+	FILE *messages;									// Verbose output; stderr if the image goes to stdout
+	batchMutex outputLock;
+};
+
+// The bigger planes go on huge pages, which saves a lot of TLB misses at 64Base
+static pcdHugePageAllocator hugePages;
+
+// Works out where the 64Base IPE file for pcdFile should be
+void findIPEFile(const char *pcdFile, const char *exeName, char *iceFile)
+{
+	size_t loc;
+	std::string pathSep;
+	// Some *nix OS's mount older CD-ROMs with a mapping that turns the path all
+	// lower case. We detect that here, and adjust how we create the paths.
+	// See mount(8) - Linux man page
+	bool useLowerCase = false;
+	// We need to generate the location of the IC file.
+	// Note this only works if the directory structure is the same as the original CD
+	// Also note that here, if there isn't a path separator in the path, we can't find 
+	// the file anyway, so this is an ok way to decide what separator to use.
+	std::string srcFile(pcdFile);
+	// Make sure there is enough room in the string, because the standard
+	// C++ string implementation is too dumb to do so.....
+	srcFile.resize(srcFile.size()+25);
+
+	// What is our separator?
+	if (srcFile.find('/') != srcFile.npos) {
+		pathSep = "/";
+	}
+	else if (srcFile.find('\\') != srcFile.npos) {
+		pathSep = "\\";
+	}
+	else {
+		std::string exeFile(exeName);
+		if (exeFile.find('/') != exeFile.npos) {
+			pathSep = "/";
+		}
+		else if (exeFile.find('\\') != exeFile.npos) {
+			pathSep = "\\";
+		}
+		else {
+			// Default by platform. We hope.
+#if defined(pcdHaveWinOS)
+			pathSep = "\\";
+#else
+			pathSep = "/";			
+#endif
+		}
+	}
+	
+	// If we are using the working directory, find the full path..
+	if ((!(srcFile.find_first_of(pathSep) <= 2)) && (srcFile.find_first_of(":") != 1)) {
+		// Need the current working directory
+#if defined(pcdHaveWinOS)
+		char *workDir =  _getcwd(NULL, 0);
+#else
+		char *workDir =  getcwd(NULL, 0);			
+#endif
+		srcFile = srcFile.insert(0, pathSep);		
+		srcFile = srcFile.insert(0, workDir);
+		free(workDir);
+	}
+
+	std::string nameOnly;
+	loc = srcFile.find_last_of(".");
+	if (loc != std::string::npos) {
+		nameOnly = srcFile.erase(loc);
+	}
+	
+	loc = nameOnly.find_last_of(pathSep);
+	if (loc != std::string::npos) {
+		nameOnly = nameOnly.substr(loc+1);
+	}
+	
+	if (loc != std::string::npos) {
+		srcFile.erase(loc);
+	}
+	loc = srcFile.find_last_of(pathSep);
+	if (loc != std::string::npos) {
+		srcFile.erase(loc+1);
+	}
+
+	
+	useLowerCase = (nameOnly.find_last_of("img") != std::string::npos);
+	
+	srcFile.append(useLowerCase ? "ipe" : "IPE");
+	srcFile.append(pathSep);
+	srcFile.append(nameOnly);
+	srcFile.append(pathSep);
+	srcFile.append(useLowerCase ? "64base" : "64BASE");
+	srcFile.append(pathSep);
+	srcFile.append(useLowerCase ? "info.ic" : "INFO.IC");
+	strncpy(iceFile, srcFile.c_str(), 1024);
+	iceFile[1023] = 0x0;
+}
+
+// Reads all of stdin into a malloc'ed buffer
+bool readStdin(uint8_t **data, size_t *size)
+{
+	size_t capacity = 1 << 20, count;
+	uint8_t *buffer = (uint8_t *) malloc(capacity), *newBuffer;
+#if defined(pcdHaveWinOS)
+	_setmode(_fileno(stdin), _O_BINARY);
+#endif
+	*size = 0;
+	while (buffer != NULL) {
+		if (*size == capacity) {
+			capacity *= 2;
+			newBuffer = (uint8_t *) realloc(buffer, capacity);
+			if (newBuffer == NULL) {
+				break;
+			}
+			buffer = newBuffer;
+		}
+		count = fread(buffer + *size, 1, capacity - *size, stdin);
+		*size += count;
+		if (count == 0) {
+			if (ferror(stdin)) {
+				break;
+			}
+			*data = buffer;
+			return true;
+		}
+	}
+	if (buffer != NULL) free(buffer);
+	return false;
+}
+
+// True if name doesn't exist, or is a regular file; symlinks aren't followed
+static bool isRegularOrMissing(const char *name)
+{
+#if defined(pcdHaveWinOS)
+	struct _stat stFileInfo;  
+	return (_stat(name, &stFileInfo) != 0) || ((stFileInfo.st_mode & _S_IFREG) != 0);
+#else
+	struct stat stFileInfo;  
+	return (lstat(name, &stFileInfo) != 0) || S_ISREG(stFileInfo.st_mode);
+#endif
+}
+
+// Converts inFile to outFile using the given decoder and writer; returns false, 
+// having said why, if that didn't work. For a file found on a disc (see addDiscFiles),
+// discIceFile is its 64Base IPE file, or empty if it doesn't have one; otherwise it
+// is NULL, and the IPE file is worked out from the path.
+// In a batch, the image is written to outFile.part, and only renamed to outFile 
+// once it is complete, so an interrupted conversion never leaves a truncated outFile
+// behind (which a --disc run would then take to be up to date). That's only done if
+// outFile doesn't exist yet, or is a regular file; anything else - a symlink, a 
+// FIFO, a device - is written through, as it would be replaced by the rename.
+bool convertFile(const char *inFile, const char *discIceFile, const char *outFile, 
+				 struct conversionOptions *options, pcdDecode *decoder, struct jpegWriter *writer)
+{
+	size_t width, height;
+	char iceFile[1024];
+	int resolution = options->resolution;
+	bool result;
+	bool fromStdin = (strcmp(inFile, "-") == 0);
+	uint8_t *inData = NULL;
+	size_t inDataSize = 0;
+	
+	if (fromStdin) {
+		// The whole file is read in, so the decoder can seek around it
+		if (!readStdin(&inData, &inDataSize)) {
+			fprintf (stderr, "pcdtojpeg could not read the PCD file from stdin\n");		
+			return false;		
+		}
+	}
+	else {
+		// Let's see if we can actually find this file
+		// Of course, windows can't even have a normal stat function.....
+
+#if defined(pcdHaveWinOS)
+		struct _stat stFileInfo;  
+		if (_stat(inFile, &stFileInfo) == -1) {
+#else
+		struct stat stFileInfo;  
+		if (stat(inFile, &stFileInfo) == -1) {			
+#endif
+			fprintf (stderr, "pcdtojpeg could not find the file \"%s\" - check the name you entered\n", inFile);		
+			return false;		
+		}
+	}
+	
+	iceFile[0] = 0x0;
+	if (resolution > k16Base) {
+		if (fromStdin) {
+			// There's nowhere to look for an IPE set, so 16Base is as far as it goes
+			resolution = k16Base;
+		}
+		else if (discIceFile == NULL) {
+			findIPEFile(inFile, options->exeName, iceFile);
+		}
+		else if (discIceFile[0] == 0x0) {
+			// There is no IPE set for this image, so 16Base is as far as it goes
+			resolution = k16Base;
+		}
+		else {
+			strncpy(iceFile, discIceFile, 1024);
+			iceFile[1023] = 0x0;
+		}
 	}
 
 	// If we want monochrome, now is the time to ask for it
-	decoder->setIsMonoChrome(isMonochrome);
+	decoder->setIsMonoChrome(options->isMonochrome);
 
 	// If we want D50, now is the time to ask for it
-	decoder->setWhiteBalance(isD50White ? kPCDD50White : kPCDD65White);
+	decoder->setWhiteBalance(options->isD50White ? kPCDD50White : kPCDD65White);
+	
+	// And the tone curve; a decoder reused from an earlier file may still have one
+	if (!decoder->setOutputCurve(options->toneCurve, 256)) {
+		fprintf (stderr, "Could not allocate memory for the tone curve\n");
+		if (fromStdin) free(inData);
+		return false;
+	}
 	
 	// Parse the file
-	if (!decoder->parseFile(argv[argIndex], iceFile, resolution)) {
+	if (fromStdin) {
+		result = decoder->parseData(inData, inDataSize, NULL, resolution);
+		free(inData);
+	}
+	else {
+		result = decoder->parseFile(inFile, (resolution > k16Base) ? iceFile : NULL, resolution);
+	}
+	if (!result) {
 		// false here means there isn't any kind of a valid image
+		batchMutexLock(options->outputLock);
 		fprintf (stderr, "Decoder Error: %s\n", decoder->getErrorString());		
-		delete (decoder);
 		if (resolution > k16Base) {
 			fprintf (stderr, " while trying to process ICE file \"%s\"\n", iceFile);	
 		}
-		exit(-1);		
+		batchMutexUnlock(options->outputLock);
+		return false;		
 	}
 	
+	// We might not actually have gotten an image at the resolution we asked for,
+	// so get the size of what we have got.....
+	width = decoder->getWidth();
+	height = decoder->getHeight();
+
+	batchMutexLock(options->outputLock);
 	// Even if we got a valid image back, there may be warnings - let's print those:
 	if (decoder->getErrorString()[0] != 0x0) {
 		fprintf (stderr, "Warning: %s\n", decoder->getErrorString());		
@@ -761,104 +1633,940 @@ int main (int argc, char * const argv[]) {
 	// (e.g., resolution, original medium) if that's what we want
 	// But the data is still in its component pieces as in the original file, so we can't  
 	// call any of the populateBuffer routines
-	if (isVerbose) {
+	if (options->isVerbose) {
 		int i;
 		char descrip[kPCDMaxStringLength], val[kPCDMaxStringLength];
-		printf("Image metadata:\n");
+		fprintf(options->messages, "Image metadata for %s:\n", inFile);
 		for (i = 0; i < kMaxPCDMetadata; i++) {
 			decoder->getMetadata(i, descrip, val);
-			printf("  %s: %s\n", descrip, val);
+			fprintf(options->messages, "  %s: %s\n", descrip, val);
 		}
+		fprintf(options->messages, "Image size: %d x %d\n", (int) width, (int) height);
 	}
-	
-	// We might not actually have gotten an image at the resolution we asked for,
-	// so get the size of what we have got.....
-	width = decoder->getWidth();
-	height = decoder->getHeight();
-	if (isVerbose) {
-		printf("Image size: %d x %d\n", (int) decoder->getWidth(), (int) decoder->getHeight());
-	}
+	batchMutexUnlock(options->outputLock);
 	
 	// Now we post parse. This assembles all the various pieces of base and residual 
 	// image data into a single YCC format image. This operation is multi-threaded, 
 	// if multi-threading is enabled in the decoder library
 	decoder->postParse();
 
-	size_t nBytes = width * height * 3 * sizeof(uint8_t);
-	uint8_t *table = (uint8_t *) malloc(nBytes);
-	
 	// sRGB is by far the most widely accepted color space, so set up for that
 	decoder->setColorSpace(kPCDsRGBColorSpace);
 	
-	if (table != NULL) {
-		// Now we call populateBuffers. This converts the YCC data (that postParse assembled) 
-		// into RGB in the choice of formats. This operation is multi-threaded, if 
-		// multi-threading is enabled in the decoder library
-		decoder->populateUInt8Buffers(&(table[0]), &(table[1]), &(table[2]), NULL, 3);
+	std::string partFile(outFile);
+	bool usePartFile = options->isBatch && (partFile != "-") && isRegularOrMissing(outFile);
+	if (usePartFile) {
+		partFile.append(".part");
+	}
+	if (options->format != kJPEGOutput) {
+		result = write_raw_file (partFile.c_str(),
+								 options->format,
+								 decoder,
+								 (int) height,
+								 (int) width);
 	}
 	else {
-		fprintf (stderr, "Could not allocate memory for the JPEG conversion\n");		
-		delete (decoder);
-		exit(-1);			
+		// Now we just compress the image into a JPEG format file, courtesy of Thomas G. 
+		// Lane's JPEG library, and also add the sRGB profile. The RGB data is converted
+		// from the decoder's YCC data a band at a time as the JPEG library consumes it.
+		// If we don't add the profile, then all our hard work in the decoder to keep the 
+		// color space straight goes to waste.....
+		result = write_JPEG_file (writer,
+								  partFile.c_str(), 
+								  &(options->jpeg), 
+								  decoder,
+								  (int) height,
+								  (int) width);
 	}
-	// We can free the decoder's memory now, as we have the buffer full of RGB data
-	delete (decoder);
-	decoder = NULL;
+	if (result && usePartFile) {
+#if defined(pcdHaveWinOS)
+		// Windows won't rename over an existing file
+		remove(outFile);
+#endif
+		if (rename(partFile.c_str(), outFile) != 0) {
+			fprintf (stderr, "Could not rename \"%s\" to \"%s\"\n", partFile.c_str(), outFile);
+			remove(partFile.c_str());
+			result = false;
+		}
+	}
+	if (!result) {
+		fprintf (stderr, " while writing \"%s\"\n", outFile);
+	}
+	return result;
+}
+
+
+//////////////////////////////////////////////////////////////
+//
+// Batch conversion 
+//
+//////////////////////////////////////////////////////////////
+// A batch has a number of file workers, each on a thread of its own; each worker
+// keeps a decoder and a JPEG writer for the whole batch, and takes the next file
+// from the job list whenever it finishes one. The decoders all run their up-res
+// and color conversion work, and the JPEG stripes, on one thread pool, so while 
+// there are more files than workers, the workers' own threads do most of the work,
+// and when the batch is down to its last few files, the pool's threads help decode
+// those instead. The workers aren't pool tasks, as a pool thread waiting on its own
+// work helps with any queued task, and could end up running a whole worker nested
+// on its stack.
+
+struct batchJob {
+	std::string inFile;
+	std::string outFile;
+	bool onDisc;										// Found by addDiscFiles
+	std::string iceFile;								// If onDisc; may be empty
+};
+
+struct batchWorker {
+	struct conversionOptions *options;
+	std::vector<batchJob> *jobs;
+	size_t *nextJob;
+	batchMutex *jobLock;
+	pcdThreadPool *pool;
+	int failures;
+};
+
+batchThreadFunction runBatchWorker(void *w)
+{
+	struct batchWorker *worker = (struct batchWorker *) w;
+	struct jpegWriter writer;
+	size_t job;
+	pcdDecode *decoder = new pcdDecode();
+	if (decoder == NULL) {
+		fprintf (stderr, "Could not create a decoder - probably too little memory\n");
+		return 0;		
+	}
+	decoder->setAllocator(&hugePages);
+	// Set to the best possible quality interpolation; if this is the the GPL decoder,
+	// it doesn't actually have the kUpResLumaIterpolate, but will automatically fall 
+	// back to the best it has
+	decoder->setInterpolation(kUpResLumaIterpolate);
+	decoder->setExecutor(worker->pool);
+	create_JPEG_writer(&writer, worker->pool);
 	
-	// Apply a tone curve if that's what the user asked for...
-	// In combination with the sRGB tone curve, this results in a sigmoidal (s-shaped) 
-	// tone curve, similar to, e.g., the default ACR tone curve.
-	// For more information, see "General-Purpose Gamut-Mapping Algorithms: Evaluation of 
-	// Contrast-Preserving Rescaling Functions for Color Gamut Mapping", Gustav J. Braun 
-	// and Mark D. Fairchild
-	if ((jpegBoost > 0.005f) || (jpegBoost < -.005f)) {
-		uint8_t *ptr = table;
-		uint8_t ourCurve[sizeof(ktoneCurve)];
-		int i;
-		float f;
-		// First we build the curve as a look-up table for speed
-		for (i = 0; i < sizeof(ktoneCurve); i++) {
-			f = ((((float) ktoneCurve[i]) - ((float) i)) * jpegBoost + ((float) i));
-			f = f > 255.0f ? 255.0f : (f < 0.0f ? 0.0f : f);
-			ourCurve[i] = (int8_t) f;
+	for (;;) {
+		batchMutexLock(*(worker->jobLock));
+		job = (*(worker->nextJob))++;
+		batchMutexUnlock(*(worker->jobLock));
+		if (job >= worker->jobs->size()) {
+			break;
 		}
-		// Then just iterate the image real fast
-		while (nBytes-- > 0) {
-			*ptr = ourCurve[*ptr];
-			ptr++;
+		struct batchJob &thisJob = (*(worker->jobs))[job];
+		if (!convertFile(thisJob.inFile.c_str(), thisJob.onDisc ? thisJob.iceFile.c_str() : NULL, 
+						 thisJob.outFile.c_str(), worker->options, decoder, &writer)) {
+			worker->failures++;
 		}
 	}
 	
-	// If an output file wasn't specified, synthesize a filename
-	if (argIndex < (argc-1)) {
-		strncpy(outFile, argv[argIndex+1], 1024);
+	destroy_JPEG_writer(&writer);
+	delete (decoder);
+	return 0;
+}
+
+// True if name ends in .pcd, in any case
+bool hasPCDExtension(const std::string &name)
+{
+	size_t i;
+	if (name.size() < 4) {
+		return false;
+	}
+	for (i = 0; i < 4; i++) {
+		if (tolower(name[name.size() - 4 + i]) != ".pcd"[i]) {
+			return false;
 		}
-	else {
-		// Create a new filename
-		std::string baseFile(argv[argIndex]);
-		size_t loc = baseFile.find_last_of(".");
-		// Make sure there is enough room in the string, because the standard
-		// C++ string implementation is too dumb to do so.....
-		baseFile.resize(baseFile.size()+3);
-		if (loc != std::string::npos) {
-			baseFile = baseFile.erase(loc);
+	}
+	return true;
+}
+
+bool isDirectory(const char *name)
+{
+#if defined(pcdHaveWinOS)
+	struct _stat stFileInfo;  
+	return (_stat(name, &stFileInfo) == 0) && ((stFileInfo.st_mode & _S_IFDIR) != 0);
+#else
+	struct stat stFileInfo;  
+	return (stat(name, &stFileInfo) == 0) && S_ISDIR(stFileInfo.st_mode);
+#endif
+}
+
+bool hasWildcard(const std::string &name)
+{
+	return name.find_first_of("*?[") != std::string::npos;
+}
+
+// dir, with a path separator on the end
+std::string directoryPrefix(const std::string &dir)
+{
+	std::string prefix(dir);
+	if (prefix.empty() || ((prefix[prefix.size() - 1] != '/') && (prefix[prefix.size() - 1] != '\\'))) {
+#if defined(pcdHaveWinOS)
+		prefix.append("\\");
+#else
+		prefix.append("/");
+#endif
+	}
+	return prefix;
+}
+
+// The names of everything in a directory, other than . and ..
+void listDirectory(const std::string &dir, std::vector<std::string> &names)
+{
+#if defined(pcdHaveWinOS)
+	struct _finddata_t fileInfo;
+	std::string pattern = directoryPrefix(dir) + "*";
+	intptr_t handle = _findfirst(pattern.c_str(), &fileInfo);
+	if (handle != -1) {
+		do {
+			if ((strcmp(fileInfo.name, ".") != 0) && (strcmp(fileInfo.name, "..") != 0)) {
+				names.push_back(fileInfo.name);
+			}
+		} while (_findnext(handle, &fileInfo) == 0);
+		_findclose(handle);
+	}
+#else
+	DIR *dirp = opendir(dir.c_str());
+	struct dirent *entry;
+	if (dirp != NULL) {
+		while ((entry = readdir(dirp)) != NULL) {
+			if ((strcmp(entry->d_name, ".") != 0) && (strcmp(entry->d_name, "..") != 0)) {
+				names.push_back(entry->d_name);
+			}
 		}
-		baseFile = baseFile.append(".jpg");
-		strncpy(outFile, baseFile.c_str(), 1024);
+		closedir(dirp);
 	}
+#endif
+}
+
+// Adds the files that an input argument stands for; that's the .pcd files in a 
+// directory (not recursively), the matches of a wildcard, or otherwise just the 
+// file itself. A wildcard that doesn't match is added as it stands, so that it 
+// gets reported as not found.
+void addInputFiles(const std::string &input, std::vector<std::string> &files)
+{
+	std::vector<std::string> found;
+	size_t i;
+	bool directory = isDirectory(input.c_str());
+	
+	if (!directory && !hasWildcard(input)) {
+		files.push_back(input);
+		return;
+	}
+	
+	if (directory) {
+		std::vector<std::string> names;
+		std::string prefix = directoryPrefix(input);
+		listDirectory(input, names);
+		for (i = 0; i < names.size(); i++) {
+			std::string name(prefix + names[i]);
+			if (hasPCDExtension(name) && !isDirectory(name.c_str())) {
+				found.push_back(name);
+			}
+		}
+	}
+	else {
+		std::string prefix;
+		size_t loc = input.find_last_of("/\\");
+		if (loc != std::string::npos) {
+			prefix = input.substr(0, loc + 1);
+		}
+#if defined(pcdHaveWinOS)
+		struct _finddata_t fileInfo;
+		intptr_t handle = _findfirst(input.c_str(), &fileInfo);
+		if (handle != -1) {
+			do {
+				if ((fileInfo.attrib & _A_SUBDIR) == 0) {
+					found.push_back(prefix + fileInfo.name);
+				}
+			} while (_findnext(handle, &fileInfo) == 0);
+			_findclose(handle);
+		}
+#else
+		glob_t matches;
+		if (glob(input.c_str(), 0, NULL, &matches) == 0) {
+			for (i = 0; i < matches.gl_pathc; i++) {
+				found.push_back(matches.gl_pathv[i]);
+			}
+		}
+		globfree(&matches);
+#endif
+	}
+	
+	if (found.empty() && !directory) {
+		files.push_back(input);
+		return;
+	}
+	std::sort(found.begin(), found.end());
+	for (i = 0; i < found.size(); i++) {
+		files.push_back(found[i]);
+	}
+}
+
+// Finds name in a directory listing, ignoring case, as CD-ROMs can be mounted 
+// either way; returns the name as it appears in the listing, or an empty string
+std::string findEntry(const std::vector<std::string> &names, const char *name)
+{
+	size_t i, j, length = strlen(name);
+	for (i = 0; i < names.size(); i++) {
+		if (names[i].size() != length) {
+			continue;
+		}
+		for (j = 0; (j < length) && (toupper(names[i][j]) == toupper(name[j])); j++) {
+		}
+		if (j == length) {
+			return names[i];
+		}
+	}
+	return std::string();
+}
+
+// As findEntry, but lists dir first, and returns the full path
+std::string findPath(const std::string &dir, const char *name)
+{
+	std::vector<std::string> names;
+	std::string entry;
+	listDirectory(dir, names);
+	entry = findEntry(names, name);
+	return entry.empty() ? entry : directoryPrefix(dir) + entry;
+}
+
+// Modification time of a file; false if it doesn't exist
+bool fileTime(const char *name, time_t *modified)
+{
+#if defined(pcdHaveWinOS)
+	struct _stat stFileInfo;  
+	if (_stat(name, &stFileInfo) == -1) return false;
+#else
+	struct stat stFileInfo;  
+	if (stat(name, &stFileInfo) == -1) return false;
+#endif
+	*modified = stFileInfo.st_mtime;
+	return true;
+}
+
+// Newest modification time of the files in a directory; false if there are none
+bool newestFileTime(const std::string &dir, time_t *modified)
+{
+	std::vector<std::string> names;
+	time_t fileModified;
+	bool found = false;
+	size_t i;
+	listDirectory(dir, names);
+	for (i = 0; i < names.size(); i++) {
+		if (fileTime((directoryPrefix(dir) + names[i]).c_str(), &fileModified) &&
+			(!found || (fileModified > *modified))) {
+			*modified = fileModified;
+			found = true;
+		}
+	}
+	return found;
+}
+
+// Adds the images of a Photo CD; root is either the disc (or a copy of it), or its
+// PHOTO_CD directory. Each IMAGES/IMGnnnn.PCD is paired with IPE/IMGnnnn/64BASE/INFO.IC,
+// if there is one, and the resolution is above 16Base. The directories are each 
+// listed once, ignoring case, rather than trying the possible paths for every 
+// file. Returns false if there isn't a disc at root.
+bool addDiscFiles(const std::string &root, int resolution, std::vector<batchJob> &jobs)
+{
+	std::vector<std::string> images, ipeSets;
+	std::string base, imagesDir, ipeDir;
+	size_t i;
+	
+	base = findPath(root, "PHOTO_CD");
+	if (base.empty()) {
+		base = root;
+	}
+	imagesDir = findPath(base, "IMAGES");
+	if (imagesDir.empty()) {
+		return false;
+	}
+	listDirectory(imagesDir, images);
+	std::sort(images.begin(), images.end());
+	if (resolution > k16Base) {
+		ipeDir = findPath(base, "IPE");
+		if (!ipeDir.empty()) {
+			listDirectory(ipeDir, ipeSets);
+		}
+	}
+	
+	for (i = 0; i < images.size(); i++) {
+		batchJob job;
+		std::string stem(images[i]);
+		if (!hasPCDExtension(stem) || (toupper(stem[0]) != 'I') || (toupper(stem[1]) != 'M') || (toupper(stem[2]) != 'G')) {
+			// Only the IMGnnnn.PCD image packs
+			continue;
+		}
+		stem.erase(stem.size() - 4);
+		job.inFile = directoryPrefix(imagesDir) + images[i];
+		job.onDisc = true;
+		std::string ipeSet = findEntry(ipeSets, stem.c_str());
+		if (!ipeSet.empty()) {
+			std::string set64Base = findPath(directoryPrefix(ipeDir) + ipeSet, "64BASE");
+			if (!set64Base.empty()) {
+				job.iceFile = findPath(set64Base, "INFO.IC");
+			}
+		}
+		jobs.push_back(job);
+	}
+	return true;
+}
+
+// Adds the inputs listed in a file, one per line; blank lines, and lines starting 
+// with #, are skipped
+bool addListedFiles(const char *listFile, std::vector<std::string> &files)
+{
+	char line[1024];
+	FILE *list = fopen(listFile, "r");
+	if (list == NULL) {
+		return false;
+	}
+	while (fgets(line, sizeof(line), list) != NULL) {
+		std::string entry(line);
+		size_t end = entry.find_last_not_of(" \t\r\n");
+		if (end == std::string::npos) {
+			continue;
+		}
+		entry.erase(end + 1);
+		if (entry[0] == '#') {
+			continue;
+		}
+		addInputFiles(entry, files);
+	}
+	fclose(list);
+	return true;
+}
+
+// The output file for inFile, with the given extension; in outDir if there is 
+// one, or else next to inFile. Stdin goes to stdout.
+std::string outputFileFor(const std::string &inFile, const std::string &outDir, const char *extension)
+{
+	if (inFile == "-") {
+		return inFile;
+	}
+	std::string baseFile(inFile);
+	size_t loc = baseFile.find_last_of(".");
+	size_t sepLoc = baseFile.find_last_of("/\\");
+	if ((loc != std::string::npos) && ((sepLoc == std::string::npos) || (loc > sepLoc))) {
+		baseFile = baseFile.erase(loc);
+	}
+	baseFile = baseFile.append(extension);
+	if (!outDir.empty()) {
+		if (sepLoc != std::string::npos) {
+			baseFile = baseFile.substr(sepLoc + 1);
+		}
+		std::string dirFile(outDir);
+		if ((dirFile[dirFile.size() - 1] != '/') && (dirFile[dirFile.size() - 1] != '\\')) {
+#if defined(pcdHaveWinOS)
+			dirFile.append("\\");
+#else
+			dirFile.append("/");
+#endif
+		}
+		baseFile = dirFile.append(baseFile);
+	}
+	return baseFile;
+}
+
+
+//////////////////////////////////////////////////////////////
+//
+// The main program 
+//
+//////////////////////////////////////////////////////////////
+// All this does is to parse the command line, pass the file(s) to the decoder,
+// apply brightness if requested, then write out the file(s) as JPEGs
+
+#define kpcdtojpegVersion "1.0.11"
+
+void printName()
+{
+	fprintf (stderr,
+			 "\n"
+			 "pcdtojpeg, version " kpcdtojpegVersion " "
+			 "\n"
+			 "Copyright (C) 2009-2013 Sandy McGuffog\n"
+			 "JPEG compression code Copyright (C) 1991-1998, Thomas G. Lane.\n");		
+}
+
+void printUsage(char * const argv [], bool isVerbose)
+{
+	if (!isVerbose) printName();
+	fprintf (stderr,
+			 "\n"
+			 "Usage:  %s [options] file1 [file2]\n"
+			 "        %s [options] [-o dir] [-l listfile] [-j n] file|dir|pattern ...\n"
+			 "        %s [options] [-o dir] [-j n] --disc root\n"
+			 "\n"
+			 "Valid options:\n"
+			 "-h            Print this message\n"
+			 "-v            Verbose file information\n"
+			 "-m            Process the file as monochrome, and write a grayscale JPEG\n"
+			 "-D50          Process for a white balance of D50\n"
+			 "-D65          Process for a white balance of D65 <default>\n"
+			 "-q nnn        JPEG file quality (nnn range 1 to 100 <100>)\n"
+			 "--dct method  JPEG DCT method:\n"
+			 "                <islow - accurate integer>\n"
+			 "                 ifast - fast integer, slightly less accurate\n"
+			 "                 float - floating point\n"
+			 "--optimize    Optimize the JPEG Huffman tables; smaller, but slower <off>\n"
+			 "--progressive Write progressive JPEGs <baseline>\n"
+			 "--sample s    JPEG chroma subsampling (s one of 420, 422, 444 <420>)\n"
+			 "--restart n   JPEG restart interval, in MCU rows, or in MCUs as nB <none>\n"
+			 "              With more than one CPU, baseline JPEGs with the standard Huffman\n"
+			 "              tables are compressed in parallel stripes, and get a restart\n"
+			 "              marker at least every stripe\n"
+			 "-b n.n        Brightness adjustment (n.n range -2.0 to 2.0 <0.0>)\n"			 
+			 "-r n          Highest resolution to extract (n range 0 to 5):\n"
+			 "                 0 - Base/16 (128 x 192)\n"
+			 "                 1 - Base/4 (256 x 384)\n"
+			 "                 2 - Base (512 x 768)\n"
+			 "                 3 - 4Base (1024 x 1536)\n"
+			 "                <4 - 16Base (2048 x 3072)>\n"
+			 "                 5 - 64Base (4096 x 6144)\n"
+			 "-o dir        Write the JPEGs to dir <next to each input file>\n"
+			 "-l listfile   Also convert the files listed in listfile, one per line\n"
+			 "-j n          Number of files to convert at once <one per CPU>\n"
+			 "-f format     Output format:\n"
+			 "                <jpeg - JPEG>\n"
+			 "                 ppm - 8-bit binary PPM (PGM if monochrome)\n"
+			 "                 ppm16 - 16-bit binary PPM (PGM if monochrome)\n"
+			 "                 pam - 8-bit PAM\n"
+			 "                 pam16 - 16-bit PAM\n"
+			 "                 pfm - 32-bit float PFM\n"
+			 "--disc root   Convert every image on the Photo CD at root, with its 64Base\n"
+			 "              IPE set if it has one; images whose JPEGs are newer than the\n"
+			 "              image pack and its IPE files are skipped, even if the options\n"
+			 "              (e.g., -r, -b, -q) have changed, so delete the JPEGs to redo\n"
+			 "              them. The JPEGs go to -o dir <the working directory>\n"
+			 "\n"
+			 "Given more than one input, a directory (all the .pcd files in it), a pattern\n"
+			 "such as *.pcd, or any of -o, -l and -j, each input is converted to a .jpg of\n"
+			 "the same name.\n"
+			 "\n"
+			 "file1 can be - to read the PCD file from stdin (up to 16Base), and file2 can\n"
+			 "be - to write the image to stdout; with file1 -, that's the default.\n"
+			 "\n",
+			 argv [0], argv [0], argv [0]);		
+}
+
+int main (int argc, char * const argv[]) {
+    // parse the arguments
+	bool doneWithArguments = false;
+	int argIndex = 1;
+	bool isVerbose = false;
+	bool isMonochrome = false;
+	bool isD50White = false;
+	struct jpegSettings jpeg;
+	float jpegBoost = 0.0f;
+	int resolution = 4;
+	int numWorkers = 0;
+	int format = kJPEGOutput;
+	bool isBatch = false;
+	std::string outDir;
+	std::vector<std::string> listFiles;
+	std::vector<std::string> discs;
+	std::vector<std::string> inFiles;
+	std::vector<batchJob> jobs;
+	struct conversionOptions options;
+	size_t i;
 	
-	// Now we just compress the buffer into a JPEG format file, courtesy of Thomas G. 
-	// Lane's JPEG library, and also add the sRGB profile.
-	// If we don't add the profile, then all our hard work in the decoder to keep the 
-	// color space straight goes to waste.....
-	write_JPEG_file (outFile, 
-					 jpegQuality, 
-					 table,
-					 (int) height,
-					 (int) width);
-	
-	free(table);
-	table = NULL;
+	jpeg.quality = 100;
+	jpeg.dctMethod = JDCT_ISLOW;
+	jpeg.optimizeCoding = false;
+	jpeg.progressive = false;
+	jpeg.sampling = kJPEG420;
+	jpeg.restartRows = 0;
+	jpeg.restartBlocks = 0;
+	
+	if (argc < 2) {
+		printUsage(argv, isVerbose);
+		exit(0);
+	}
+	while ((!doneWithArguments) && (argIndex < argc)) {
+		std::string thisArg(argv[argIndex]);
+		// A lone - is stdin, not an option
+		if ((thisArg[0] == '-') && (thisArg.size() > 1)) {
+			if ((thisArg == "-h") || (thisArg == "-H")) {
+				printUsage(argv, isVerbose);
+				exit(0);
+			}
+			else if (thisArg == "-v") {
+				isVerbose = true;
+				printName();
+			}
+			else if (thisArg == "-m") {
+				isMonochrome = true;
+			}
+			else if (thisArg == "-D50") {
+				isD50White = true;
+			}
+			else if (thisArg == "-D65") {
+				isD50White = false;
+			}
+			else if (thisArg == "-q") {
+				if (argIndex > (argc - 2)) {
+					printUsage(argv, isVerbose);
+					exit(-1);
+				}
+				jpeg.quality = atoi(argv[argIndex+1]);
+				jpeg.quality = jpeg.quality > 100 ? 100 : jpeg.quality;
+				jpeg.quality = jpeg.quality < 0 ? 0 : jpeg.quality;				
+				argIndex++;
+			}
+			else if (thisArg == "--dct") {
+				if (argIndex > (argc - 2)) {
+					printUsage(argv, isVerbose);
+					exit(-1);
+				}
+				for (i = 0; i < kNumDCTMethods; i++) {
+					if (strcmp(argv[argIndex+1], kDCTMethodNames[i]) == 0) break;
+				}
+				if (i == kNumDCTMethods) {
+					fprintf (stderr, "Invalid DCT method\n");		
+					printUsage(argv, isVerbose);
+					exit(-1);
+				}
+				jpeg.dctMethod = kDCTMethods[i];
+				argIndex++;
+			}
+			else if (thisArg == "--optimize") {
+				jpeg.optimizeCoding = true;
+			}
+			else if (thisArg == "--progressive") {
+				jpeg.progressive = true;
+			}
+			else if (thisArg == "--sample") {
+				if (argIndex > (argc - 2)) {
+					printUsage(argv, isVerbose);
+					exit(-1);
+				}
+				for (jpeg.sampling = 0; jpeg.sampling < kNumJPEGSamplings; jpeg.sampling++) {
+					if (strcmp(argv[argIndex+1], kJPEGSamplingNames[jpeg.sampling]) == 0) break;
+				}
+				if (jpeg.sampling == kNumJPEGSamplings) {
+					fprintf (stderr, "Invalid chroma subsampling\n");		
+					printUsage(argv, isVerbose);
+					exit(-1);
+				}
+				argIndex++;
+			}
+			else if (thisArg == "--restart") {
+				char *end;
+				long interval;
+				if (argIndex > (argc - 2)) {
+					printUsage(argv, isVerbose);
+					exit(-1);
+				}
+				// As cjpeg; the JPEG format limits the interval to 65535 MCUs
+				interval = strtol(argv[argIndex+1], &end, 10);
+				if ((end == argv[argIndex+1]) || (interval < 0) || (interval > 65535) ||
+					((*end != 0x0) && (((*end != 'b') && (*end != 'B')) || (end[1] != 0x0)))) {
+					fprintf (stderr, "Invalid restart interval\n");		
+					printUsage(argv, isVerbose);
+					exit(-1);
+				}
+				jpeg.restartRows = (*end == 0x0) ? (unsigned int) interval : 0;
+				jpeg.restartBlocks = (*end == 0x0) ? 0 : (unsigned int) interval;
+				argIndex++;
+			}
+			else if (thisArg == "-b") {
+				if (argIndex > (argc - 2)) {
+					printUsage(argv, isVerbose);
+					exit(-1);
+				}
+				jpegBoost = (float) atof(argv[argIndex+1]);
+				jpegBoost = jpegBoost > 2.0f ? 2.0f : jpegBoost;
+				jpegBoost = jpegBoost < -2.0f ? -2.0f : jpegBoost;				
+				argIndex++;
+			}
+			else if (thisArg == "-r") {
+				if (argIndex > (argc - 2)) {
+					printUsage(argv, isVerbose);
+					exit(-1);
+				}
+				resolution = atoi(argv[argIndex+1]);
+				resolution = resolution > 5 ? 5 : resolution;
+				resolution = resolution < 0 ? 0 : resolution;				
+				argIndex++;				
+			}
+			else if (thisArg == "-o") {
+				if (argIndex > (argc - 2)) {
+					printUsage(argv, isVerbose);
+					exit(-1);
+				}
+				outDir = argv[argIndex+1];
+				isBatch = true;
+				argIndex++;				
+			}
+			else if (thisArg == "-l") {
+				if (argIndex > (argc - 2)) {
+					printUsage(argv, isVerbose);
+					exit(-1);
+				}
+				listFiles.push_back(argv[argIndex+1]);
+				isBatch = true;
+				argIndex++;				
+			}
+			else if (thisArg == "-j") {
+				if (argIndex > (argc - 2)) {
+					printUsage(argv, isVerbose);
+					exit(-1);
+				}
+				numWorkers = atoi(argv[argIndex+1]);
+				numWorkers = numWorkers < 1 ? 1 : numWorkers;
+				isBatch = true;
+				argIndex++;				
+			}
+			else if (thisArg == "-f") {
+				if (argIndex > (argc - 2)) {
+					printUsage(argv, isVerbose);
+					exit(-1);
+				}
+				for (format = 0; format < kNumOutputFormats; format++) {
+					if (strcmp(argv[argIndex+1], kOutputFormatNames[format]) == 0) break;
+				}
+				if (format == kNumOutputFormats) {
+					fprintf (stderr, "Invalid output format\n");		
+					printUsage(argv, isVerbose);
+					exit(-1);
+				}
+				argIndex++;				
+			}
+			else if (thisArg == "--disc") {
+				if (argIndex > (argc - 2)) {
+					printUsage(argv, isVerbose);
+					exit(-1);
+				}
+				discs.push_back(argv[argIndex+1]);
+				isBatch = true;
+				argIndex++;				
+			}
+			else {
+				fprintf (stderr, "Invalid argument\n");		
+				printUsage(argv, isVerbose);
+				exit(-1);
+				}
+			argIndex++;
+		}
+		else {
+			doneWithArguments = true;
+		}
+	}
+	// Now check we have file[s]
+	if ((argIndex > (argc - 1)) && listFiles.empty() && discs.empty()) {
+		fprintf (stderr, "Invalid argument\n");		
+		printUsage(argv, isVerbose);
+		exit(-1);
+	}
+	
+	// The original form is an input file, and optionally the JPEG to write it to; 
+	// anything else is a batch
+	isBatch = isBatch || ((argc - argIndex) > 2);
+	for (i = argIndex; !isBatch && (i < (size_t) argc); i++) {
+		isBatch = isDirectory(argv[i]) || hasWildcard(argv[i]);
+	}
+	if (!isBatch && ((argc - argIndex) == 2)) {
+		isBatch = hasPCDExtension(argv[argIndex+1]);
+	}
+	
+	if (isBatch) {
+		for (i = argIndex; i < (size_t) argc; i++) {
+			addInputFiles(argv[i], inFiles);
+		}
+		for (i = 0; i < listFiles.size(); i++) {
+			if (!addListedFiles(listFiles[i].c_str(), inFiles)) {
+				fprintf (stderr, "pcdtojpeg could not read the list file \"%s\"\n", listFiles[i].c_str());		
+				exit(-1);		
+			}
+		}
+		std::vector<batchJob> found;
+		for (i = 0; i < inFiles.size(); i++) {
+			batchJob job;
+			job.inFile = inFiles[i];
+			job.onDisc = false;
+			found.push_back(job);
+		}
+		for (i = 0; i < discs.size(); i++) {
+			if (!addDiscFiles(discs[i], resolution, found)) {
+				fprintf (stderr, "pcdtojpeg could not find a Photo CD at \"%s\"\n", discs[i].c_str());		
+				exit(-1);		
+			}
+		}
+		if (found.empty()) {
+			fprintf (stderr, "No files to convert\n");		
+			exit(-1);		
+		}
+		size_t upToDate = 0;
+		for (i = 0; i < found.size(); i++) {
+			batchJob &job = found[i];
+			bool duplicate = false;
+			size_t j;
+			time_t outTime, inTime;
+			// Images on a disc go to the working directory if there isn't an output
+			// directory; they can't go next to the original
+			job.outFile = outputFileFor(job.inFile, (job.onDisc && outDir.empty()) ? std::string(".") : outDir,
+									  kOutputExtensions[format]);
+			// A file given twice (e.g., by a pattern and in a list) is converted once; 
+			// but two inputs of the same name in different directories would overwrite 
+			// each other in the output directory
+			for (j = 0; j < jobs.size(); j++) {
+				if (jobs[j].inFile == job.inFile) {
+					duplicate = true;
+				}
+				else if (jobs[j].outFile == job.outFile) {
+					fprintf (stderr, "\"%s\" and \"%s\" would both be written to \"%s\"\n", 
+							 jobs[j].inFile.c_str(), job.inFile.c_str(), job.outFile.c_str());		
+					exit(-1);		
+				}
+			}
+			if (job.inFile == "-") {
+				fprintf (stderr, "stdin can only be used to convert a single file\n");		
+				exit(-1);		
+			}
+			if (duplicate) {
+				continue;
+			}
+			// Disc images that were converted since the disc's files last changed are 
+			// left as they are, so an interrupted conversion can just be run again. The
+			// IPE set is INFO.IC and its data files, which are all in the 64BASE directory
+			if (job.onDisc && fileTime(job.outFile.c_str(), &outTime) && 
+				fileTime(job.inFile.c_str(), &inTime) && (outTime >= inTime) &&
+				(job.iceFile.empty() || 
+				 (newestFileTime(job.iceFile.substr(0, job.iceFile.find_last_of("/\\")), &inTime) && (outTime >= inTime)))) {
+				if (isVerbose) {
+					fprintf (stderr, "%s is up to date\n", job.outFile.c_str());
+				}
+				upToDate++;
+				continue;
+			}
+			jobs.push_back(job);
+		}
+		if (jobs.empty()) {
+			fprintf (stderr, "All %d files are up to date\n", (int) upToDate);		
+			exit(0);		
+		}
+		if (!outDir.empty() && !isDirectory(outDir.c_str())) {
+#if defined(pcdHaveWinOS)
+			if (_mkdir(outDir.c_str()) != 0) {
+#else
+			if (mkdir(outDir.c_str(), 0777) != 0) {
+#endif
+				fprintf (stderr, "pcdtojpeg could not create the directory \"%s\"\n", outDir.c_str());		
+				exit(-1);		
+			}
+		}
+	}
+	else {
+		// If an output file wasn't specified, synthesize a filename
+		batchJob job;
+		job.inFile = argv[argIndex];
+		job.onDisc = false;
+		job.outFile = (argIndex < (argc-1)) ? std::string(argv[argIndex+1]) : outputFileFor(job.inFile, outDir, kOutputExtensions[format]);
+		jobs.push_back(job);
+	}
+	
+	// Build a tone curve if that's what the user asked for...
+	// In combination with the sRGB tone curve, this results in a sigmoidal (s-shaped) 
+	// tone curve, similar to, e.g., the default ACR tone curve.
+	// For more information, see "General-Purpose Gamut-Mapping Algorithms: Evaluation of 
+	// Contrast-Preserving Rescaling Functions for Color Gamut Mapping", Gustav J. Braun 
+	// and Mark D. Fairchild
+	float ourCurve[sizeof(ktoneCurve)];
+	bool useCurve = (jpegBoost > 0.005f) || (jpegBoost < -.005f);
+	if (useCurve) {
+		float f;
+		// The curve goes to the decoder, which composes it into its output look-up 
+		// tables, so it costs nothing per pixel, and deeper output formats get it at
+		// their full precision
+		for (i = 0; i < sizeof(ktoneCurve); i++) {
+			f = ((((float) ktoneCurve[i]) - ((float) i)) * jpegBoost + ((float) i));
+			f = f > 255.0f ? 255.0f : (f < 0.0f ? 0.0f : f);
+			ourCurve[i] = f / 255.0f;
+		}
+	}
+	
+	options.exeName = argv[0];
+	options.isVerbose = isVerbose;
+	options.isMonochrome = isMonochrome;
+	options.isD50White = isD50White;
+	options.jpeg = jpeg;
+	options.resolution = resolution;
+	options.format = format;
+	options.isBatch = isBatch;
+	options.toneCurve = useCurve ? ourCurve : NULL;
+	// Don't mix the metadata into an image going to stdout
+	options.messages = ((jobs.size() == 1) && (jobs[0].outFile == "-")) ? stderr : stdout;
+	batchMutexInit(options.outputLock);
+	
+	int failures = 0;
+	if (jobs.size() == 1) {
+		// Just the one file; that gets the decoder's own executor, which spreads its 
+		// work over all the CPUs, and the JPEG compression goes on the same pool
+		struct jpegWriter writer;
+		pcdDecode *decoder = new pcdDecode();
+		if (decoder == NULL) {
+			fprintf (stderr, "Could not create a decoder - probably too little memory\n");		
+			exit(-1);		
+		}
+		decoder->setAllocator(&hugePages);
+		// Set to the best possible quality interpolation; if this is the the GPL decoder,
+		// it doesn't actually have the kUpResLumaIterpolate, but will automatically fall 
+		// back to the best it has
+		decoder->setInterpolation(kUpResLumaIterpolate);
+		create_JPEG_writer(&writer, pcdThreadPool::getSharedPool());
+		if (!convertFile(jobs[0].inFile.c_str(), jobs[0].onDisc ? jobs[0].iceFile.c_str() : NULL, 
+						 jobs[0].outFile.c_str(), &options, decoder, &writer)) {
+			failures++;
+		}
+		destroy_JPEG_writer(&writer);
+		delete (decoder);
+		decoder = NULL;
+	}
+	else {
+		unsigned int cpus = pcdThreadPool::getAvailableCPUs();
+		size_t nextJob = 0;
+		batchMutex jobLock;
+		if (numWorkers == 0) {
+			numWorkers = cpus;
+		}
+		if ((size_t) numWorkers > jobs.size()) {
+			numWorkers = (int) jobs.size();
+		}
+		// One thread per CPU for the decoders' work; the workers have their own threads
+		pcdThreadPool pool(cpus);
+		std::vector<batchWorker> workers(numWorkers);
+		std::vector<batchThread> threads(numWorkers);
+		std::vector<bool> started(numWorkers, false);
+		batchMutexInit(jobLock);
+		for (i = 0; i < workers.size(); i++) {
+			workers[i].options = &options;
+			workers[i].jobs = &jobs;
+			workers[i].nextJob = &nextJob;
+			workers[i].jobLock = &jobLock;
+			workers[i].pool = &pool;
+			workers[i].failures = 0;
+		}
+		for (i = 0; i < workers.size(); i++) {
+			started[i] = (batchStartThread(threads[i], runBatchWorker, (void *) &(workers[i])) == 0);
+		}
+		if (!started[0]) {
+			// Too many threads already.....; the other workers will get through the 
+			// list, but there has to be at least one
+			runBatchWorker((void *) &(workers[0]));
+		}
+		for (i = 0; i < workers.size(); i++) {
+			if (started[i]) {
+				batchThreadJoin(threads[i]);
+			}
+			failures += workers[i].failures;
+		}
+		batchMutexDestroy(jobLock);
+		if (failures > 0) {
+			fprintf (stderr, "%d of %d files could not be converted\n", failures, (int) jobs.size());
+		}
+	}
+	batchMutexDestroy(options.outputLock);
 
-    return 0;
+    return (failures > 0) ? -1 : 0;
 }
@@ -100,6 +100,9 @@
 #include <string.h>
 #include <sys/types.h>
 #include <time.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
 
 //////////////////////////////////////////////////////////////
 //
@@ -141,12 +144,39 @@
 //////////////////////////////////////////////////////////////
 // Undefine this to disable threading
 
-// Typically you want about threads = cores
+// The number of threads is set by the executor that the decoder uses; by default that is
+// the shared pcdThreadPool, with one thread per CPU available to the process.
+// Planes with fewer pixels than this are processed inline on the calling thread;
+// for anything that small, handing the work to other threads costs more than it saves
+#define kInlinePixelThreshold (256*384)
+// Planes are split into row tiles of about this many rows, which are load balanced
+// across the pool's threads
+#define kTileRows 32
+#define kMaxTiles 256
+// Pool threads run arbitrary decoder tasks, so give them a normal sized stack
+#define kPoolThreadStackSize (1024*1024)
+// RGB conversion works along each row in runs of this many pixels; each run is converted
+// once, then copied out to every output
+#define kConvertRun 256
+// Residual rows are reported to the progress callback in batches of this many
+#define kProgressSequences 64
+
 #ifdef mNoPThreads
-#define kNumThreads 1
 #define pcdThreadFunction static void *
+typedef void *(*pcdTaskFunction)(void *);
+// Without threads, the pool has no workers and locking is a no-op
+#define pcdThreadDescriptor int
+#define pcdMutex int
+#define pcdMutexInit(theMutex) {}
+#define pcdMutexDestroy(theMutex) {}
+#define pcdMutexLock(theMutex) {}
+#define pcdMutexUnlock(theMutex) {}
+#define pcdCondition int
+#define pcdConditionInit(theCondition) {}
+#define pcdConditionDestroy(theCondition) {}
+#define pcdConditionWait(theCondition, theMutex) {}
+#define pcdConditionBroadcast(theCondition) {}
 #else
-#define kNumThreads 8
 #ifdef _MSC_VER
 // This defines a set of macros that make the WIN32 multithread
 // API look somewhat like pthreads - at least enough for our
@@ -158,6 +188,7 @@
 #define PTHREAD_STACK_MIN 65536
 #define pcdThreadDescriptor HANDLE
 #define pcdThreadFunction static unsigned __stdcall
+typedef unsigned (__stdcall *pcdTaskFunction)(void *);
 // Under Win32 we use pthread_attr_t just to hold the stack size
 #define pthread_attr_t unsigned
 #define pthread_attr_init(threadAttr) {(*threadAttr)=PTHREAD_STACK_MIN<<1;}
@@ -166,13 +197,40 @@
 #define pthread_attr_destroy(threadAttr) {}
 #define pcdStartThread(theThread, theThreadAttr, theFunction, theData) ((theThread = (HANDLE)_beginthreadex(NULL, theThreadAttr, theFunction, theData, 0, NULL)) == NULL ? -1 : 0)
 #define pcdThreadJoin(theThread, result) ((WaitForSingleObject(theThread,INFINITE) != WAIT_OBJECT_0) || !CloseHandle(theThread))
+// Critical sections and condition variables (Vista and later) stand in for
+// pthread mutexes and conditions
+#define pcdMutex CRITICAL_SECTION
+#define pcdMutexInit(theMutex) InitializeCriticalSection(&(theMutex))
+#define pcdMutexDestroy(theMutex) DeleteCriticalSection(&(theMutex))
+#define pcdMutexLock(theMutex) EnterCriticalSection(&(theMutex))
+#define pcdMutexUnlock(theMutex) LeaveCriticalSection(&(theMutex))
+#define pcdCondition CONDITION_VARIABLE
+#define pcdConditionInit(theCondition) InitializeConditionVariable(&(theCondition))
+#define pcdConditionDestroy(theCondition) {}
+#define pcdConditionWait(theCondition, theMutex) SleepConditionVariableCS(&(theCondition), &(theMutex), INFINITE)
+#define pcdConditionBroadcast(theCondition) WakeAllConditionVariable(&(theCondition))
 #else
 #include <pthread.h>
 #include <limits.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
 #define pcdThreadDescriptor pthread_t
 #define pcdThreadFunction static void *
+typedef void *(*pcdTaskFunction)(void *);
 #define pcdStartThread(theThread, theThreadAttr, theFunction, theData) pthread_create(&theThread, &theThreadAttr, theFunction, theData)
 #define pcdThreadJoin(theThread, result) pthread_join(theThread,result)
+#define pcdMutex pthread_mutex_t
+#define pcdMutexInit(theMutex) pthread_mutex_init(&(theMutex), NULL)
+#define pcdMutexDestroy(theMutex) pthread_mutex_destroy(&(theMutex))
+#define pcdMutexLock(theMutex) pthread_mutex_lock(&(theMutex))
+#define pcdMutexUnlock(theMutex) pthread_mutex_unlock(&(theMutex))
+#define pcdCondition pthread_cond_t
+#define pcdConditionInit(theCondition) pthread_cond_init(&(theCondition), NULL)
+#define pcdConditionDestroy(theCondition) pthread_cond_destroy(&(theCondition))
+#define pcdConditionWait(theCondition, theMutex) pthread_cond_wait(&(theCondition), &(theMutex))
+#define pcdConditionBroadcast(theCondition) pthread_cond_broadcast(&(theCondition))
 #endif
 #endif
 
@@ -226,25 +284,19 @@
 
 #define kSceneSectorSize KSectorSize
 
-static unsigned int PCDLumaWidth[kMaxScenes]			= {192, 192<<1, 192<<2, 192<<3, 192<<4, 192<<5};
-static unsigned int PCDLumaHeight[kMaxScenes]			= {128, 128<<1, 128<<2, 128<<3, 128<<4, 128<<5};
-static unsigned int PCDChromaWidth[kMaxScenes]			= {96, 96<<1, 96<<2, 96<<2, 96<<4, 96<<5};
-static unsigned int PCDChromaHeight[kMaxScenes]			= {64, 64<<1, 64<<2, 64<<2, 64<<4, 64<<5};
-static unsigned int PCDChromaResFactor[kMaxScenes]		= {1, 1, 1, 1, 1, 1};
-static uint32_t RowShift[kMaxScenes]					= {0, 0, 0, 9, 9, 6};
-static uint32_t RowMask[kMaxScenes]						= {0, 0, 0, 0x1fff, 0x1fff, 0x3fff};
-static uint32_t RowSubSample[kMaxScenes]				= {1, 1, 1, 1, 1, 2};
-static uint32_t SequenceShift[kMaxScenes]				= {0, 0, 0, 0, 0, 1};
-static uint32_t SequenceMask[kMaxScenes]				= {0, 0, 0, 0, 0x0, 0xf};
-static uint32_t PlaneShift[kMaxScenes]					= {0, 0, 0, 22, 22, 19};
-static uint32_t PlaneMask[kMaxScenes]					= {0, 0, 0, 0x3, 0x3, 0x6};
-static uint32_t HuffmanHeaderSize[kMaxScenes]			= {0, 0, 0, 3, 3, 4};
-
-enum PCDOutputDataSize {
-	pcdByteSize = 0,
-	pcdInt16Size,
-	pcdFloatSize
-};
+static const unsigned int PCDLumaWidth[kMaxScenes]			= {192, 192<<1, 192<<2, 192<<3, 192<<4, 192<<5};
+static const unsigned int PCDLumaHeight[kMaxScenes]			= {128, 128<<1, 128<<2, 128<<3, 128<<4, 128<<5};
+static const unsigned int PCDChromaWidth[kMaxScenes]			= {96, 96<<1, 96<<2, 96<<2, 96<<4, 96<<5};
+static const unsigned int PCDChromaHeight[kMaxScenes]			= {64, 64<<1, 64<<2, 64<<2, 64<<4, 64<<5};
+static const unsigned int PCDChromaResFactor[kMaxScenes]		= {1, 1, 1, 1, 1, 1};
+static const uint32_t RowShift[kMaxScenes]					= {0, 0, 0, 9, 9, 6};
+static const uint32_t RowMask[kMaxScenes]						= {0, 0, 0, 0x1fff, 0x1fff, 0x3fff};
+static const uint32_t RowSubSample[kMaxScenes]				= {1, 1, 1, 1, 1, 2};
+static const uint32_t SequenceShift[kMaxScenes]				= {0, 0, 0, 0, 0, 1};
+static const uint32_t SequenceMask[kMaxScenes]				= {0, 0, 0, 0, 0x0, 0xf};
+static const uint32_t PlaneShift[kMaxScenes]					= {0, 0, 0, 22, 22, 19};
+static const uint32_t PlaneMask[kMaxScenes]					= {0, 0, 0, 0x3, 0x3, 0x6};
+static const uint32_t HuffmanHeaderSize[kMaxScenes]			= {0, 0, 0, 3, 3, 4};
 
 
 //////////////////////////////////////////////////////////////
@@ -894,6 +946,8 @@ enum LUTValues {
 //static  uint8_t	uint8Output[numLUTItems];
 //static  uint16_t	uint16Output[numLUTItems];
 //static  float	floatOutput[numLUTItems];
+//static  uint16_t	uint10Output[numLUTItems];
+//static  uint16_t	halfOutput[numLUTItems];
 
 static const uint16_t toLinearLight[numLUTItems] = {
 	0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0001, 0x0001, 0x0001, 0x0001, 0x0001, 
@@ -1485,6 +1539,242 @@ static const float	floatOutput[numLUTItems] = {
 	 0.985591f, 0.986311f, 0.987032f, 0.987752f, 0.988473f, 0.989193f, 0.989914f, 0.990634f, 0.991354f, 0.992075f, 0.992795f, 0.993516f, 
 	 0.994236f, 0.994957f, 0.995677f, 0.996398f, 0.997118f, 0.997839f, 0.998559f, 0.999280f, 1.000000f
 };
+static const uint16_t	uint10Output[numLUTItems] = {
+	 0x0000, 0x0000, 0x0001, 0x0002, 0x0002, 0x0003, 0x0004, 0x0005, 0x0005, 0x0006, 0x0007, 0x0008, 
+	 0x0008, 0x0009, 0x000a, 0x000b, 0x000b, 0x000c, 0x000d, 0x000e, 0x000e, 0x000f, 0x0010, 0x0010, 
+	 0x0011, 0x0012, 0x0013, 0x0013, 0x0014, 0x0015, 0x0016, 0x0016, 0x0017, 0x0018, 0x0019, 0x0019, 
+	 0x001a, 0x001b, 0x001c, 0x001c, 0x001d, 0x001e, 0x001e, 0x001f, 0x0020, 0x0021, 0x0021, 0x0022, 
+	 0x0023, 0x0024, 0x0024, 0x0025, 0x0026, 0x0027, 0x0027, 0x0028, 0x0029, 0x002a, 0x002a, 0x002b, 
+	 0x002c, 0x002c, 0x002d, 0x002e, 0x002f, 0x002f, 0x0030, 0x0031, 0x0032, 0x0032, 0x0033, 0x0034, 
+	 0x0035, 0x0035, 0x0036, 0x0037, 0x0038, 0x0038, 0x0039, 0x003a, 0x003a, 0x003b, 0x003c, 0x003d, 
+	 0x003d, 0x003e, 0x003f, 0x0040, 0x0040, 0x0041, 0x0042, 0x0043, 0x0043, 0x0044, 0x0045, 0x0046, 
+	 0x0046, 0x0047, 0x0048, 0x0048, 0x0049, 0x004a, 0x004b, 0x004b, 0x004c, 0x004d, 0x004e, 0x004e, 
+	 0x004f, 0x0050, 0x0051, 0x0051, 0x0052, 0x0053, 0x0054, 0x0054, 0x0055, 0x0056, 0x0056, 0x0057, 
+	 0x0058, 0x0059, 0x0059, 0x005a, 0x005b, 0x005c, 0x005c, 0x005d, 0x005e, 0x005f, 0x005f, 0x0060, 
+	 0x0061, 0x0062, 0x0062, 0x0063, 0x0064, 0x0064, 0x0065, 0x0066, 0x0067, 0x0067, 0x0068, 0x0069, 
+	 0x006a, 0x006a, 0x006b, 0x006c, 0x006d, 0x006d, 0x006e, 0x006f, 0x0070, 0x0070, 0x0071, 0x0072, 
+	 0x0072, 0x0073, 0x0074, 0x0075, 0x0075, 0x0076, 0x0077, 0x0078, 0x0078, 0x0079, 0x007a, 0x007b, 
+	 0x007b, 0x007c, 0x007d, 0x007e, 0x007e, 0x007f, 0x0080, 0x0080, 0x0081, 0x0082, 0x0083, 0x0083, 
+	 0x0084, 0x0085, 0x0086, 0x0086, 0x0087, 0x0088, 0x0089, 0x0089, 0x008a, 0x008b, 0x008c, 0x008c, 
+	 0x008d, 0x008e, 0x008e, 0x008f, 0x0090, 0x0091, 0x0091, 0x0092, 0x0093, 0x0094, 0x0094, 0x0095, 
+	 0x0096, 0x0097, 0x0097, 0x0098, 0x0099, 0x009a, 0x009a, 0x009b, 0x009c, 0x009c, 0x009d, 0x009e, 
+	 0x009f, 0x009f, 0x00a0, 0x00a1, 0x00a2, 0x00a2, 0x00a3, 0x00a4, 0x00a5, 0x00a5, 0x00a6, 0x00a7, 
+	 0x00a8, 0x00a8, 0x00a9, 0x00aa, 0x00aa, 0x00ab, 0x00ac, 0x00ad, 0x00ad, 0x00ae, 0x00af, 0x00b0, 
+	 0x00b0, 0x00b1, 0x00b2, 0x00b3, 0x00b3, 0x00b4, 0x00b5, 0x00b6, 0x00b6, 0x00b7, 0x00b8, 0x00b8, 
+	 0x00b9, 0x00ba, 0x00bb, 0x00bb, 0x00bc, 0x00bd, 0x00be, 0x00be, 0x00bf, 0x00c0, 0x00c1, 0x00c1, 
+	 0x00c2, 0x00c3, 0x00c4, 0x00c4, 0x00c5, 0x00c6, 0x00c6, 0x00c7, 0x00c8, 0x00c9, 0x00c9, 0x00ca, 
+	 0x00cb, 0x00cc, 0x00cc, 0x00cd, 0x00ce, 0x00cf, 0x00cf, 0x00d0, 0x00d1, 0x00d2, 0x00d2, 0x00d3, 
+	 0x00d4, 0x00d5, 0x00d5, 0x00d6, 0x00d7, 0x00d7, 0x00d8, 0x00d9, 0x00da, 0x00da, 0x00db, 0x00dc, 
+	 0x00dd, 0x00dd, 0x00de, 0x00df, 0x00e0, 0x00e0, 0x00e1, 0x00e2, 0x00e3, 0x00e3, 0x00e4, 0x00e5, 
+	 0x00e5, 0x00e6, 0x00e7, 0x00e8, 0x00e8, 0x00e9, 0x00ea, 0x00eb, 0x00eb, 0x00ec, 0x00ed, 0x00ee, 
+	 0x00ee, 0x00ef, 0x00f0, 0x00f1, 0x00f1, 0x00f2, 0x00f3, 0x00f3, 0x00f4, 0x00f5, 0x00f6, 0x00f6, 
+	 0x00f7, 0x00f8, 0x00f9, 0x00f9, 0x00fa, 0x00fb, 0x00fc, 0x00fc, 0x00fd, 0x00fe, 0x00ff, 0x00ff, 
+	 0x0100, 0x0101, 0x0101, 0x0102, 0x0103, 0x0104, 0x0104, 0x0105, 0x0106, 0x0107, 0x0107, 0x0108, 
+	 0x0109, 0x010a, 0x010a, 0x010b, 0x010c, 0x010d, 0x010d, 0x010e, 0x010f, 0x010f, 0x0110, 0x0111, 
+	 0x0112, 0x0112, 0x0113, 0x0114, 0x0115, 0x0115, 0x0116, 0x0117, 0x0118, 0x0118, 0x0119, 0x011a, 
+	 0x011b, 0x011b, 0x011c, 0x011d, 0x011d, 0x011e, 0x011f, 0x0120, 0x0120, 0x0121, 0x0122, 0x0123, 
+	 0x0123, 0x0124, 0x0125, 0x0126, 0x0126, 0x0127, 0x0128, 0x0129, 0x0129, 0x012a, 0x012b, 0x012b, 
+	 0x012c, 0x012d, 0x012e, 0x012e, 0x012f, 0x0130, 0x0131, 0x0131, 0x0132, 0x0133, 0x0134, 0x0134, 
+	 0x0135, 0x0136, 0x0137, 0x0137, 0x0138, 0x0139, 0x0139, 0x013a, 0x013b, 0x013c, 0x013c, 0x013d, 
+	 0x013e, 0x013f, 0x013f, 0x0140, 0x0141, 0x0142, 0x0142, 0x0143, 0x0144, 0x0145, 0x0145, 0x0146, 
+	 0x0147, 0x0147, 0x0148, 0x0149, 0x014a, 0x014a, 0x014b, 0x014c, 0x014d, 0x014d, 0x014e, 0x014f, 
+	 0x0150, 0x0150, 0x0151, 0x0152, 0x0153, 0x0153, 0x0154, 0x0155, 0x0155, 0x0156, 0x0157, 0x0158, 
+	 0x0158, 0x0159, 0x015a, 0x015b, 0x015b, 0x015c, 0x015d, 0x015e, 0x015e, 0x015f, 0x0160, 0x0161, 
+	 0x0161, 0x0162, 0x0163, 0x0163, 0x0164, 0x0165, 0x0166, 0x0166, 0x0167, 0x0168, 0x0169, 0x0169, 
+	 0x016a, 0x016b, 0x016c, 0x016c, 0x016d, 0x016e, 0x016f, 0x016f, 0x0170, 0x0171, 0x0171, 0x0172, 
+	 0x0173, 0x0174, 0x0174, 0x0175, 0x0176, 0x0177, 0x0177, 0x0178, 0x0179, 0x017a, 0x017a, 0x017b, 
+	 0x017c, 0x017d, 0x017d, 0x017e, 0x017f, 0x017f, 0x0180, 0x0181, 0x0182, 0x0182, 0x0183, 0x0184, 
+	 0x0185, 0x0185, 0x0186, 0x0187, 0x0188, 0x0188, 0x0189, 0x018a, 0x018b, 0x018b, 0x018c, 0x018d, 
+	 0x018d, 0x018e, 0x018f, 0x0190, 0x0190, 0x0191, 0x0192, 0x0193, 0x0193, 0x0194, 0x0195, 0x0196, 
+	 0x0196, 0x0197, 0x0198, 0x0199, 0x0199, 0x019a, 0x019b, 0x019c, 0x019c, 0x019d, 0x019e, 0x019e, 
+	 0x019f, 0x01a0, 0x01a1, 0x01a1, 0x01a2, 0x01a3, 0x01a4, 0x01a4, 0x01a5, 0x01a6, 0x01a7, 0x01a7, 
+	 0x01a8, 0x01a9, 0x01aa, 0x01aa, 0x01ab, 0x01ac, 0x01ac, 0x01ad, 0x01ae, 0x01af, 0x01af, 0x01b0, 
+	 0x01b1, 0x01b2, 0x01b2, 0x01b3, 0x01b4, 0x01b5, 0x01b5, 0x01b6, 0x01b7, 0x01b8, 0x01b8, 0x01b9, 
+	 0x01ba, 0x01ba, 0x01bb, 0x01bc, 0x01bd, 0x01bd, 0x01be, 0x01bf, 0x01c0, 0x01c0, 0x01c1, 0x01c2, 
+	 0x01c3, 0x01c3, 0x01c4, 0x01c5, 0x01c6, 0x01c6, 0x01c7, 0x01c8, 0x01c8, 0x01c9, 0x01ca, 0x01cb, 
+	 0x01cb, 0x01cc, 0x01cd, 0x01ce, 0x01ce, 0x01cf, 0x01d0, 0x01d1, 0x01d1, 0x01d2, 0x01d3, 0x01d4, 
+	 0x01d4, 0x01d5, 0x01d6, 0x01d6, 0x01d7, 0x01d8, 0x01d9, 0x01d9, 0x01da, 0x01db, 0x01dc, 0x01dc, 
+	 0x01dd, 0x01de, 0x01df, 0x01df, 0x01e0, 0x01e1, 0x01e2, 0x01e2, 0x01e3, 0x01e4, 0x01e4, 0x01e5, 
+	 0x01e6, 0x01e7, 0x01e7, 0x01e8, 0x01e9, 0x01ea, 0x01ea, 0x01eb, 0x01ec, 0x01ed, 0x01ed, 0x01ee, 
+	 0x01ef, 0x01f0, 0x01f0, 0x01f1, 0x01f2, 0x01f2, 0x01f3, 0x01f4, 0x01f5, 0x01f5, 0x01f6, 0x01f7, 
+	 0x01f8, 0x01f8, 0x01f9, 0x01fa, 0x01fb, 0x01fb, 0x01fc, 0x01fd, 0x01fe, 0x01fe, 0x01ff, 0x0200, 
+	 0x0200, 0x0201, 0x0202, 0x0203, 0x0203, 0x0204, 0x0205, 0x0206, 0x0206, 0x0207, 0x0208, 0x0209, 
+	 0x0209, 0x020a, 0x020b, 0x020c, 0x020c, 0x020d, 0x020e, 0x020e, 0x020f, 0x0210, 0x0211, 0x0211, 
+	 0x0212, 0x0213, 0x0214, 0x0214, 0x0215, 0x0216, 0x0217, 0x0217, 0x0218, 0x0219, 0x021a, 0x021a, 
+	 0x021b, 0x021c, 0x021c, 0x021d, 0x021e, 0x021f, 0x021f, 0x0220, 0x0221, 0x0222, 0x0222, 0x0223, 
+	 0x0224, 0x0225, 0x0225, 0x0226, 0x0227, 0x0228, 0x0228, 0x0229, 0x022a, 0x022a, 0x022b, 0x022c, 
+	 0x022d, 0x022d, 0x022e, 0x022f, 0x0230, 0x0230, 0x0231, 0x0232, 0x0233, 0x0233, 0x0234, 0x0235, 
+	 0x0236, 0x0236, 0x0237, 0x0238, 0x0238, 0x0239, 0x023a, 0x023b, 0x023b, 0x023c, 0x023d, 0x023e, 
+	 0x023e, 0x023f, 0x0240, 0x0241, 0x0241, 0x0242, 0x0243, 0x0244, 0x0244, 0x0245, 0x0246, 0x0246, 
+	 0x0247, 0x0248, 0x0249, 0x0249, 0x024a, 0x024b, 0x024c, 0x024c, 0x024d, 0x024e, 0x024f, 0x024f, 
+	 0x0250, 0x0251, 0x0252, 0x0252, 0x0253, 0x0254, 0x0254, 0x0255, 0x0256, 0x0257, 0x0257, 0x0258, 
+	 0x0259, 0x025a, 0x025a, 0x025b, 0x025c, 0x025d, 0x025d, 0x025e, 0x025f, 0x0260, 0x0260, 0x0261, 
+	 0x0262, 0x0262, 0x0263, 0x0264, 0x0265, 0x0265, 0x0266, 0x0267, 0x0268, 0x0268, 0x0269, 0x026a, 
+	 0x026b, 0x026b, 0x026c, 0x026d, 0x026e, 0x026e, 0x026f, 0x0270, 0x0271, 0x0271, 0x0272, 0x0273, 
+	 0x0273, 0x0274, 0x0275, 0x0276, 0x0276, 0x0277, 0x0278, 0x0279, 0x0279, 0x027a, 0x027b, 0x027c, 
+	 0x027c, 0x027d, 0x027e, 0x027f, 0x027f, 0x0280, 0x0281, 0x0281, 0x0282, 0x0283, 0x0284, 0x0284, 
+	 0x0285, 0x0286, 0x0287, 0x0287, 0x0288, 0x0289, 0x028a, 0x028a, 0x028b, 0x028c, 0x028d, 0x028d, 
+	 0x028e, 0x028f, 0x028f, 0x0290, 0x0291, 0x0292, 0x0292, 0x0293, 0x0294, 0x0295, 0x0295, 0x0296, 
+	 0x0297, 0x0298, 0x0298, 0x0299, 0x029a, 0x029b, 0x029b, 0x029c, 0x029d, 0x029d, 0x029e, 0x029f, 
+	 0x02a0, 0x02a0, 0x02a1, 0x02a2, 0x02a3, 0x02a3, 0x02a4, 0x02a5, 0x02a6, 0x02a6, 0x02a7, 0x02a8, 
+	 0x02a9, 0x02a9, 0x02aa, 0x02ab, 0x02ab, 0x02ac, 0x02ad, 0x02ae, 0x02ae, 0x02af, 0x02b0, 0x02b1, 
+	 0x02b1, 0x02b2, 0x02b3, 0x02b4, 0x02b4, 0x02b5, 0x02b6, 0x02b7, 0x02b7, 0x02b8, 0x02b9, 0x02b9, 
+	 0x02ba, 0x02bb, 0x02bc, 0x02bc, 0x02bd, 0x02be, 0x02bf, 0x02bf, 0x02c0, 0x02c1, 0x02c2, 0x02c2, 
+	 0x02c3, 0x02c4, 0x02c5, 0x02c5, 0x02c6, 0x02c7, 0x02c7, 0x02c8, 0x02c9, 0x02ca, 0x02ca, 0x02cb, 
+	 0x02cc, 0x02cd, 0x02cd, 0x02ce, 0x02cf, 0x02d0, 0x02d0, 0x02d1, 0x02d2, 0x02d3, 0x02d3, 0x02d4, 
+	 0x02d5, 0x02d5, 0x02d6, 0x02d7, 0x02d8, 0x02d8, 0x02d9, 0x02da, 0x02db, 0x02db, 0x02dc, 0x02dd, 
+	 0x02de, 0x02de, 0x02df, 0x02e0, 0x02e1, 0x02e1, 0x02e2, 0x02e3, 0x02e3, 0x02e4, 0x02e5, 0x02e6, 
+	 0x02e6, 0x02e7, 0x02e8, 0x02e9, 0x02e9, 0x02ea, 0x02eb, 0x02ec, 0x02ec, 0x02ed, 0x02ee, 0x02ef, 
+	 0x02ef, 0x02f0, 0x02f1, 0x02f1, 0x02f2, 0x02f3, 0x02f4, 0x02f4, 0x02f5, 0x02f6, 0x02f7, 0x02f7, 
+	 0x02f8, 0x02f9, 0x02fa, 0x02fa, 0x02fb, 0x02fc, 0x02fd, 0x02fd, 0x02fe, 0x02ff, 0x02ff, 0x0300, 
+	 0x0301, 0x0302, 0x0302, 0x0303, 0x0304, 0x0305, 0x0305, 0x0306, 0x0307, 0x0308, 0x0308, 0x0309, 
+	 0x030a, 0x030b, 0x030b, 0x030c, 0x030d, 0x030d, 0x030e, 0x030f, 0x0310, 0x0310, 0x0311, 0x0312, 
+	 0x0313, 0x0313, 0x0314, 0x0315, 0x0316, 0x0316, 0x0317, 0x0318, 0x0319, 0x0319, 0x031a, 0x031b, 
+	 0x031b, 0x031c, 0x031d, 0x031e, 0x031e, 0x031f, 0x0320, 0x0321, 0x0321, 0x0322, 0x0323, 0x0324, 
+	 0x0324, 0x0325, 0x0326, 0x0327, 0x0327, 0x0328, 0x0329, 0x0329, 0x032a, 0x032b, 0x032c, 0x032c, 
+	 0x032d, 0x032e, 0x032f, 0x032f, 0x0330, 0x0331, 0x0332, 0x0332, 0x0333, 0x0334, 0x0335, 0x0335, 
+	 0x0336, 0x0337, 0x0338, 0x0338, 0x0339, 0x033a, 0x033a, 0x033b, 0x033c, 0x033d, 0x033d, 0x033e, 
+	 0x033f, 0x0340, 0x0340, 0x0341, 0x0342, 0x0343, 0x0343, 0x0344, 0x0345, 0x0346, 0x0346, 0x0347, 
+	 0x0348, 0x0348, 0x0349, 0x034a, 0x034b, 0x034b, 0x034c, 0x034d, 0x034e, 0x034e, 0x034f, 0x0350, 
+	 0x0351, 0x0351, 0x0352, 0x0353, 0x0354, 0x0354, 0x0355, 0x0356, 0x0356, 0x0357, 0x0358, 0x0359, 
+	 0x0359, 0x035a, 0x035b, 0x035c, 0x035c, 0x035d, 0x035e, 0x035f, 0x035f, 0x0360, 0x0361, 0x0362, 
+	 0x0362, 0x0363, 0x0364, 0x0364, 0x0365, 0x0366, 0x0367, 0x0367, 0x0368, 0x0369, 0x036a, 0x036a, 
+	 0x036b, 0x036c, 0x036d, 0x036d, 0x036e, 0x036f, 0x0370, 0x0370, 0x0371, 0x0372, 0x0372, 0x0373, 
+	 0x0374, 0x0375, 0x0375, 0x0376, 0x0377, 0x0378, 0x0378, 0x0379, 0x037a, 0x037b, 0x037b, 0x037c, 
+	 0x037d, 0x037e, 0x037e, 0x037f, 0x0380, 0x0380, 0x0381, 0x0382, 0x0383, 0x0383, 0x0384, 0x0385, 
+	 0x0386, 0x0386, 0x0387, 0x0388, 0x0389, 0x0389, 0x038a, 0x038b, 0x038c, 0x038c, 0x038d, 0x038e, 
+	 0x038e, 0x038f, 0x0390, 0x0391, 0x0391, 0x0392, 0x0393, 0x0394, 0x0394, 0x0395, 0x0396, 0x0397, 
+	 0x0397, 0x0398, 0x0399, 0x039a, 0x039a, 0x039b, 0x039c, 0x039c, 0x039d, 0x039e, 0x039f, 0x039f, 
+	 0x03a0, 0x03a1, 0x03a2, 0x03a2, 0x03a3, 0x03a4, 0x03a5, 0x03a5, 0x03a6, 0x03a7, 0x03a8, 0x03a8, 
+	 0x03a9, 0x03aa, 0x03aa, 0x03ab, 0x03ac, 0x03ad, 0x03ad, 0x03ae, 0x03af, 0x03b0, 0x03b0, 0x03b1, 
+	 0x03b2, 0x03b3, 0x03b3, 0x03b4, 0x03b5, 0x03b6, 0x03b6, 0x03b7, 0x03b8, 0x03b8, 0x03b9, 0x03ba, 
+	 0x03bb, 0x03bb, 0x03bc, 0x03bd, 0x03be, 0x03be, 0x03bf, 0x03c0, 0x03c1, 0x03c1, 0x03c2, 0x03c3, 
+	 0x03c4, 0x03c4, 0x03c5, 0x03c6, 0x03c6, 0x03c7, 0x03c8, 0x03c9, 0x03c9, 0x03ca, 0x03cb, 0x03cc, 
+	 0x03cc, 0x03cd, 0x03ce, 0x03cf, 0x03cf, 0x03d0, 0x03d1, 0x03d2, 0x03d2, 0x03d3, 0x03d4, 0x03d4, 
+	 0x03d5, 0x03d6, 0x03d7, 0x03d7, 0x03d8, 0x03d9, 0x03da, 0x03da, 0x03db, 0x03dc, 0x03dd, 0x03dd, 
+	 0x03de, 0x03df, 0x03e0, 0x03e0, 0x03e1, 0x03e2, 0x03e2, 0x03e3, 0x03e4, 0x03e5, 0x03e5, 0x03e6, 
+	 0x03e7, 0x03e8, 0x03e8, 0x03e9, 0x03ea, 0x03eb, 0x03eb, 0x03ec, 0x03ed, 0x03ee, 0x03ee, 0x03ef, 
+	 0x03f0, 0x03f0, 0x03f1, 0x03f2, 0x03f3, 0x03f3, 0x03f4, 0x03f5, 0x03f6, 0x03f6, 0x03f7, 0x03f8, 
+	 0x03f9, 0x03f9, 0x03fa, 0x03fb, 0x03fc, 0x03fc, 0x03fd, 0x03fe, 0x03ff
+};
+static const uint16_t	halfOutput[numLUTItems] = {
+	 0x0000, 0x11e7, 0x15e7, 0x186d, 0x19e7, 0x1b61, 0x1c6d, 0x1d2a, 0x1de7, 0x1ea4, 0x1f61, 0x200f, 
+	 0x206d, 0x20cc, 0x212a, 0x2188, 0x21e7, 0x2245, 0x22a4, 0x2302, 0x2361, 0x23bf, 0x240f, 0x243e, 
+	 0x246d, 0x249c, 0x24cc, 0x24fb, 0x252a, 0x2559, 0x2588, 0x25b8, 0x25e7, 0x2616, 0x2645, 0x2675, 
+	 0x26a4, 0x26d3, 0x2702, 0x2731, 0x2761, 0x2790, 0x27bf, 0x27ee, 0x280f, 0x2826, 0x283e, 0x2856, 
+	 0x286d, 0x2885, 0x289c, 0x28b4, 0x28cc, 0x28e3, 0x28fb, 0x2912, 0x292a, 0x2942, 0x2959, 0x2971, 
+	 0x2988, 0x29a0, 0x29b8, 0x29cf, 0x29e7, 0x29ff, 0x2a16, 0x2a2e, 0x2a45, 0x2a5d, 0x2a75, 0x2a8c, 
+	 0x2aa4, 0x2abb, 0x2ad3, 0x2aeb, 0x2b02, 0x2b1a, 0x2b31, 0x2b49, 0x2b61, 0x2b78, 0x2b90, 0x2ba7, 
+	 0x2bbf, 0x2bd7, 0x2bee, 0x2c03, 0x2c0f, 0x2c1b, 0x2c26, 0x2c32, 0x2c3e, 0x2c4a, 0x2c56, 0x2c61, 
+	 0x2c6d, 0x2c79, 0x2c85, 0x2c91, 0x2c9c, 0x2ca8, 0x2cb4, 0x2cc0, 0x2ccc, 0x2cd7, 0x2ce3, 0x2cef, 
+	 0x2cfb, 0x2d07, 0x2d12, 0x2d1e, 0x2d2a, 0x2d36, 0x2d42, 0x2d4d, 0x2d59, 0x2d65, 0x2d71, 0x2d7d, 
+	 0x2d88, 0x2d94, 0x2da0, 0x2dac, 0x2db8, 0x2dc4, 0x2dcf, 0x2ddb, 0x2de7, 0x2df3, 0x2dff, 0x2e0a, 
+	 0x2e16, 0x2e22, 0x2e2e, 0x2e3a, 0x2e45, 0x2e51, 0x2e5d, 0x2e69, 0x2e75, 0x2e80, 0x2e8c, 0x2e98, 
+	 0x2ea4, 0x2eb0, 0x2ebb, 0x2ec7, 0x2ed3, 0x2edf, 0x2eeb, 0x2ef6, 0x2f02, 0x2f0e, 0x2f1a, 0x2f26, 
+	 0x2f31, 0x2f3d, 0x2f49, 0x2f55, 0x2f61, 0x2f6c, 0x2f78, 0x2f84, 0x2f90, 0x2f9c, 0x2fa7, 0x2fb3, 
+	 0x2fbf, 0x2fcb, 0x2fd7, 0x2fe2, 0x2fee, 0x2ffa, 0x3003, 0x3009, 0x300f, 0x3015, 0x301b, 0x3020, 
+	 0x3026, 0x302c, 0x3032, 0x3038, 0x303e, 0x3044, 0x304a, 0x3050, 0x3056, 0x305b, 0x3061, 0x3067, 
+	 0x306d, 0x3073, 0x3079, 0x307f, 0x3085, 0x308b, 0x3091, 0x3097, 0x309c, 0x30a2, 0x30a8, 0x30ae, 
+	 0x30b4, 0x30ba, 0x30c0, 0x30c6, 0x30cc, 0x30d2, 0x30d7, 0x30dd, 0x30e3, 0x30e9, 0x30ef, 0x30f5, 
+	 0x30fb, 0x3101, 0x3107, 0x310d, 0x3112, 0x3118, 0x311e, 0x3124, 0x312a, 0x3130, 0x3136, 0x313c, 
+	 0x3142, 0x3148, 0x314d, 0x3153, 0x3159, 0x315f, 0x3165, 0x316b, 0x3171, 0x3177, 0x317d, 0x3183, 
+	 0x3188, 0x318e, 0x3194, 0x319a, 0x31a0, 0x31a6, 0x31ac, 0x31b2, 0x31b8, 0x31be, 0x31c4, 0x31c9, 
+	 0x31cf, 0x31d5, 0x31db, 0x31e1, 0x31e7, 0x31ed, 0x31f3, 0x31f9, 0x31ff, 0x3204, 0x320a, 0x3210, 
+	 0x3216, 0x321c, 0x3222, 0x3228, 0x322e, 0x3234, 0x323a, 0x323f, 0x3245, 0x324b, 0x3251, 0x3257, 
+	 0x325d, 0x3263, 0x3269, 0x326f, 0x3275, 0x327a, 0x3280, 0x3286, 0x328c, 0x3292, 0x3298, 0x329e, 
+	 0x32a4, 0x32aa, 0x32b0, 0x32b5, 0x32bb, 0x32c1, 0x32c7, 0x32cd, 0x32d3, 0x32d9, 0x32df, 0x32e5, 
+	 0x32eb, 0x32f1, 0x32f6, 0x32fc, 0x3302, 0x3308, 0x330e, 0x3314, 0x331a, 0x3320, 0x3326, 0x332c, 
+	 0x3331, 0x3337, 0x333d, 0x3343, 0x3349, 0x334f, 0x3355, 0x335b, 0x3361, 0x3367, 0x336c, 0x3372, 
+	 0x3378, 0x337e, 0x3384, 0x338a, 0x3390, 0x3396, 0x339c, 0x33a2, 0x33a7, 0x33ad, 0x33b3, 0x33b9, 
+	 0x33bf, 0x33c5, 0x33cb, 0x33d1, 0x33d7, 0x33dd, 0x33e2, 0x33e8, 0x33ee, 0x33f4, 0x33fa, 0x3400, 
+	 0x3403, 0x3406, 0x3409, 0x340c, 0x340f, 0x3412, 0x3415, 0x3418, 0x341b, 0x341e, 0x3420, 0x3423, 
+	 0x3426, 0x3429, 0x342c, 0x342f, 0x3432, 0x3435, 0x3438, 0x343b, 0x343e, 0x3441, 0x3444, 0x3447, 
+	 0x344a, 0x344d, 0x3450, 0x3453, 0x3456, 0x3459, 0x345b, 0x345e, 0x3461, 0x3464, 0x3467, 0x346a, 
+	 0x346d, 0x3470, 0x3473, 0x3476, 0x3479, 0x347c, 0x347f, 0x3482, 0x3485, 0x3488, 0x348b, 0x348e, 
+	 0x3491, 0x3494, 0x3497, 0x3499, 0x349c, 0x349f, 0x34a2, 0x34a5, 0x34a8, 0x34ab, 0x34ae, 0x34b1, 
+	 0x34b4, 0x34b7, 0x34ba, 0x34bd, 0x34c0, 0x34c3, 0x34c6, 0x34c9, 0x34cc, 0x34cf, 0x34d2, 0x34d4, 
+	 0x34d7, 0x34da, 0x34dd, 0x34e0, 0x34e3, 0x34e6, 0x34e9, 0x34ec, 0x34ef, 0x34f2, 0x34f5, 0x34f8, 
+	 0x34fb, 0x34fe, 0x3501, 0x3504, 0x3507, 0x350a, 0x350d, 0x350f, 0x3512, 0x3515, 0x3518, 0x351b, 
+	 0x351e, 0x3521, 0x3524, 0x3527, 0x352a, 0x352d, 0x3530, 0x3533, 0x3536, 0x3539, 0x353c, 0x353f, 
+	 0x3542, 0x3545, 0x3548, 0x354b, 0x354d, 0x3550, 0x3553, 0x3556, 0x3559, 0x355c, 0x355f, 0x3562, 
+	 0x3565, 0x3568, 0x356b, 0x356e, 0x3571, 0x3574, 0x3577, 0x357a, 0x357d, 0x3580, 0x3583, 0x3586, 
+	 0x3588, 0x358b, 0x358e, 0x3591, 0x3594, 0x3597, 0x359a, 0x359d, 0x35a0, 0x35a3, 0x35a6, 0x35a9, 
+	 0x35ac, 0x35af, 0x35b2, 0x35b5, 0x35b8, 0x35bb, 0x35be, 0x35c1, 0x35c4, 0x35c6, 0x35c9, 0x35cc, 
+	 0x35cf, 0x35d2, 0x35d5, 0x35d8, 0x35db, 0x35de, 0x35e1, 0x35e4, 0x35e7, 0x35ea, 0x35ed, 0x35f0, 
+	 0x35f3, 0x35f6, 0x35f9, 0x35fc, 0x35ff, 0x3601, 0x3604, 0x3607, 0x360a, 0x360d, 0x3610, 0x3613, 
+	 0x3616, 0x3619, 0x361c, 0x361f, 0x3622, 0x3625, 0x3628, 0x362b, 0x362e, 0x3631, 0x3634, 0x3637, 
+	 0x363a, 0x363c, 0x363f, 0x3642, 0x3645, 0x3648, 0x364b, 0x364e, 0x3651, 0x3654, 0x3657, 0x365a, 
+	 0x365d, 0x3660, 0x3663, 0x3666, 0x3669, 0x366c, 0x366f, 0x3672, 0x3675, 0x3678, 0x367a, 0x367d, 
+	 0x3680, 0x3683, 0x3686, 0x3689, 0x368c, 0x368f, 0x3692, 0x3695, 0x3698, 0x369b, 0x369e, 0x36a1, 
+	 0x36a4, 0x36a7, 0x36aa, 0x36ad, 0x36b0, 0x36b3, 0x36b5, 0x36b8, 0x36bb, 0x36be, 0x36c1, 0x36c4, 
+	 0x36c7, 0x36ca, 0x36cd, 0x36d0, 0x36d3, 0x36d6, 0x36d9, 0x36dc, 0x36df, 0x36e2, 0x36e5, 0x36e8, 
+	 0x36eb, 0x36ee, 0x36f1, 0x36f3, 0x36f6, 0x36f9, 0x36fc, 0x36ff, 0x3702, 0x3705, 0x3708, 0x370b, 
+	 0x370e, 0x3711, 0x3714, 0x3717, 0x371a, 0x371d, 0x3720, 0x3723, 0x3726, 0x3729, 0x372c, 0x372e, 
+	 0x3731, 0x3734, 0x3737, 0x373a, 0x373d, 0x3740, 0x3743, 0x3746, 0x3749, 0x374c, 0x374f, 0x3752, 
+	 0x3755, 0x3758, 0x375b, 0x375e, 0x3761, 0x3764, 0x3767, 0x3769, 0x376c, 0x376f, 0x3772, 0x3775, 
+	 0x3778, 0x377b, 0x377e, 0x3781, 0x3784, 0x3787, 0x378a, 0x378d, 0x3790, 0x3793, 0x3796, 0x3799, 
+	 0x379c, 0x379f, 0x37a2, 0x37a5, 0x37a7, 0x37aa, 0x37ad, 0x37b0, 0x37b3, 0x37b6, 0x37b9, 0x37bc, 
+	 0x37bf, 0x37c2, 0x37c5, 0x37c8, 0x37cb, 0x37ce, 0x37d1, 0x37d4, 0x37d7, 0x37da, 0x37dd, 0x37e0, 
+	 0x37e2, 0x37e5, 0x37e8, 0x37eb, 0x37ee, 0x37f1, 0x37f4, 0x37f7, 0x37fa, 0x37fd, 0x3800, 0x3801, 
+	 0x3803, 0x3804, 0x3806, 0x3807, 0x3809, 0x380a, 0x380c, 0x380d, 0x380f, 0x3810, 0x3812, 0x3813, 
+	 0x3815, 0x3816, 0x3818, 0x3819, 0x381b, 0x381c, 0x381e, 0x381f, 0x3820, 0x3822, 0x3823, 0x3825, 
+	 0x3826, 0x3828, 0x3829, 0x382b, 0x382c, 0x382e, 0x382f, 0x3831, 0x3832, 0x3834, 0x3835, 0x3837, 
+	 0x3838, 0x383a, 0x383b, 0x383c, 0x383e, 0x383f, 0x3841, 0x3842, 0x3844, 0x3845, 0x3847, 0x3848, 
+	 0x384a, 0x384b, 0x384d, 0x384e, 0x3850, 0x3851, 0x3853, 0x3854, 0x3856, 0x3857, 0x3859, 0x385a, 
+	 0x385b, 0x385d, 0x385e, 0x3860, 0x3861, 0x3863, 0x3864, 0x3866, 0x3867, 0x3869, 0x386a, 0x386c, 
+	 0x386d, 0x386f, 0x3870, 0x3872, 0x3873, 0x3875, 0x3876, 0x3878, 0x3879, 0x387a, 0x387c, 0x387d, 
+	 0x387f, 0x3880, 0x3882, 0x3883, 0x3885, 0x3886, 0x3888, 0x3889, 0x388b, 0x388c, 0x388e, 0x388f, 
+	 0x3891, 0x3892, 0x3894, 0x3895, 0x3897, 0x3898, 0x3899, 0x389b, 0x389c, 0x389e, 0x389f, 0x38a1, 
+	 0x38a2, 0x38a4, 0x38a5, 0x38a7, 0x38a8, 0x38aa, 0x38ab, 0x38ad, 0x38ae, 0x38b0, 0x38b1, 0x38b3, 
+	 0x38b4, 0x38b5, 0x38b7, 0x38b8, 0x38ba, 0x38bb, 0x38bd, 0x38be, 0x38c0, 0x38c1, 0x38c3, 0x38c4, 
+	 0x38c6, 0x38c7, 0x38c9, 0x38ca, 0x38cc, 0x38cd, 0x38cf, 0x38d0, 0x38d2, 0x38d3, 0x38d4, 0x38d6, 
+	 0x38d7, 0x38d9, 0x38da, 0x38dc, 0x38dd, 0x38df, 0x38e0, 0x38e2, 0x38e3, 0x38e5, 0x38e6, 0x38e8, 
+	 0x38e9, 0x38eb, 0x38ec, 0x38ee, 0x38ef, 0x38f1, 0x38f2, 0x38f3, 0x38f5, 0x38f6, 0x38f8, 0x38f9, 
+	 0x38fb, 0x38fc, 0x38fe, 0x38ff, 0x3901, 0x3902, 0x3904, 0x3905, 0x3907, 0x3908, 0x390a, 0x390b, 
+	 0x390d, 0x390e, 0x390f, 0x3911, 0x3912, 0x3914, 0x3915, 0x3917, 0x3918, 0x391a, 0x391b, 0x391d, 
+	 0x391e, 0x3920, 0x3921, 0x3923, 0x3924, 0x3926, 0x3927, 0x3929, 0x392a, 0x392c, 0x392d, 0x392e, 
+	 0x3930, 0x3931, 0x3933, 0x3934, 0x3936, 0x3937, 0x3939, 0x393a, 0x393c, 0x393d, 0x393f, 0x3940, 
+	 0x3942, 0x3943, 0x3945, 0x3946, 0x3948, 0x3949, 0x394b, 0x394c, 0x394d, 0x394f, 0x3950, 0x3952, 
+	 0x3953, 0x3955, 0x3956, 0x3958, 0x3959, 0x395b, 0x395c, 0x395e, 0x395f, 0x3961, 0x3962, 0x3964, 
+	 0x3965, 0x3967, 0x3968, 0x3969, 0x396b, 0x396c, 0x396e, 0x396f, 0x3971, 0x3972, 0x3974, 0x3975, 
+	 0x3977, 0x3978, 0x397a, 0x397b, 0x397d, 0x397e, 0x3980, 0x3981, 0x3983, 0x3984, 0x3986, 0x3987, 
+	 0x3988, 0x398a, 0x398b, 0x398d, 0x398e, 0x3990, 0x3991, 0x3993, 0x3994, 0x3996, 0x3997, 0x3999, 
+	 0x399a, 0x399c, 0x399d, 0x399f, 0x39a0, 0x39a2, 0x39a3, 0x39a5, 0x39a6, 0x39a7, 0x39a9, 0x39aa, 
+	 0x39ac, 0x39ad, 0x39af, 0x39b0, 0x39b2, 0x39b3, 0x39b5, 0x39b6, 0x39b8, 0x39b9, 0x39bb, 0x39bc, 
+	 0x39be, 0x39bf, 0x39c1, 0x39c2, 0x39c4, 0x39c5, 0x39c6, 0x39c8, 0x39c9, 0x39cb, 0x39cc, 0x39ce, 
+	 0x39cf, 0x39d1, 0x39d2, 0x39d4, 0x39d5, 0x39d7, 0x39d8, 0x39da, 0x39db, 0x39dd, 0x39de, 0x39e0, 
+	 0x39e1, 0x39e2, 0x39e4, 0x39e5, 0x39e7, 0x39e8, 0x39ea, 0x39eb, 0x39ed, 0x39ee, 0x39f0, 0x39f1, 
+	 0x39f3, 0x39f4, 0x39f6, 0x39f7, 0x39f9, 0x39fa, 0x39fc, 0x39fd, 0x39ff, 0x3a00, 0x3a01, 0x3a03, 
+	 0x3a04, 0x3a06, 0x3a07, 0x3a09, 0x3a0a, 0x3a0c, 0x3a0d, 0x3a0f, 0x3a10, 0x3a12, 0x3a13, 0x3a15, 
+	 0x3a16, 0x3a18, 0x3a19, 0x3a1b, 0x3a1c, 0x3a1e, 0x3a1f, 0x3a20, 0x3a22, 0x3a23, 0x3a25, 0x3a26, 
+	 0x3a28, 0x3a29, 0x3a2b, 0x3a2c, 0x3a2e, 0x3a2f, 0x3a31, 0x3a32, 0x3a34, 0x3a35, 0x3a37, 0x3a38, 
+	 0x3a3a, 0x3a3b, 0x3a3c, 0x3a3e, 0x3a3f, 0x3a41, 0x3a42, 0x3a44, 0x3a45, 0x3a47, 0x3a48, 0x3a4a, 
+	 0x3a4b, 0x3a4d, 0x3a4e, 0x3a50, 0x3a51, 0x3a53, 0x3a54, 0x3a56, 0x3a57, 0x3a59, 0x3a5a, 0x3a5b, 
+	 0x3a5d, 0x3a5e, 0x3a60, 0x3a61, 0x3a63, 0x3a64, 0x3a66, 0x3a67, 0x3a69, 0x3a6a, 0x3a6c, 0x3a6d, 
+	 0x3a6f, 0x3a70, 0x3a72, 0x3a73, 0x3a75, 0x3a76, 0x3a78, 0x3a79, 0x3a7a, 0x3a7c, 0x3a7d, 0x3a7f, 
+	 0x3a80, 0x3a82, 0x3a83, 0x3a85, 0x3a86, 0x3a88, 0x3a89, 0x3a8b, 0x3a8c, 0x3a8e, 0x3a8f, 0x3a91, 
+	 0x3a92, 0x3a94, 0x3a95, 0x3a97, 0x3a98, 0x3a99, 0x3a9b, 0x3a9c, 0x3a9e, 0x3a9f, 0x3aa1, 0x3aa2, 
+	 0x3aa4, 0x3aa5, 0x3aa7, 0x3aa8, 0x3aaa, 0x3aab, 0x3aad, 0x3aae, 0x3ab0, 0x3ab1, 0x3ab3, 0x3ab4, 
+	 0x3ab5, 0x3ab7, 0x3ab8, 0x3aba, 0x3abb, 0x3abd, 0x3abe, 0x3ac0, 0x3ac1, 0x3ac3, 0x3ac4, 0x3ac6, 
+	 0x3ac7, 0x3ac9, 0x3aca, 0x3acc, 0x3acd, 0x3acf, 0x3ad0, 0x3ad2, 0x3ad3, 0x3ad4, 0x3ad6, 0x3ad7, 
+	 0x3ad9, 0x3ada, 0x3adc, 0x3add, 0x3adf, 0x3ae0, 0x3ae2, 0x3ae3, 0x3ae5, 0x3ae6, 0x3ae8, 0x3ae9, 
+	 0x3aeb, 0x3aec, 0x3aee, 0x3aef, 0x3af1, 0x3af2, 0x3af3, 0x3af5, 0x3af6, 0x3af8, 0x3af9, 0x3afb, 
+	 0x3afc, 0x3afe, 0x3aff, 0x3b01, 0x3b02, 0x3b04, 0x3b05, 0x3b07, 0x3b08, 0x3b0a, 0x3b0b, 0x3b0d, 
+	 0x3b0e, 0x3b0f, 0x3b11, 0x3b12, 0x3b14, 0x3b15, 0x3b17, 0x3b18, 0x3b1a, 0x3b1b, 0x3b1d, 0x3b1e, 
+	 0x3b20, 0x3b21, 0x3b23, 0x3b24, 0x3b26, 0x3b27, 0x3b29, 0x3b2a, 0x3b2c, 0x3b2d, 0x3b2e, 0x3b30, 
+	 0x3b31, 0x3b33, 0x3b34, 0x3b36, 0x3b37, 0x3b39, 0x3b3a, 0x3b3c, 0x3b3d, 0x3b3f, 0x3b40, 0x3b42, 
+	 0x3b43, 0x3b45, 0x3b46, 0x3b48, 0x3b49, 0x3b4b, 0x3b4c, 0x3b4d, 0x3b4f, 0x3b50, 0x3b52, 0x3b53, 
+	 0x3b55, 0x3b56, 0x3b58, 0x3b59, 0x3b5b, 0x3b5c, 0x3b5e, 0x3b5f, 0x3b61, 0x3b62, 0x3b64, 0x3b65, 
+	 0x3b67, 0x3b68, 0x3b69, 0x3b6b, 0x3b6c, 0x3b6e, 0x3b6f, 0x3b71, 0x3b72, 0x3b74, 0x3b75, 0x3b77, 
+	 0x3b78, 0x3b7a, 0x3b7b, 0x3b7d, 0x3b7e, 0x3b80, 0x3b81, 0x3b83, 0x3b84, 0x3b86, 0x3b87, 0x3b88, 
+	 0x3b8a, 0x3b8b, 0x3b8d, 0x3b8e, 0x3b90, 0x3b91, 0x3b93, 0x3b94, 0x3b96, 0x3b97, 0x3b99, 0x3b9a, 
+	 0x3b9c, 0x3b9d, 0x3b9f, 0x3ba0, 0x3ba2, 0x3ba3, 0x3ba5, 0x3ba6, 0x3ba7, 0x3ba9, 0x3baa, 0x3bac, 
+	 0x3bad, 0x3baf, 0x3bb0, 0x3bb2, 0x3bb3, 0x3bb5, 0x3bb6, 0x3bb8, 0x3bb9, 0x3bbb, 0x3bbc, 0x3bbe, 
+	 0x3bbf, 0x3bc1, 0x3bc2, 0x3bc4, 0x3bc5, 0x3bc6, 0x3bc8, 0x3bc9, 0x3bcb, 0x3bcc, 0x3bce, 0x3bcf, 
+	 0x3bd1, 0x3bd2, 0x3bd4, 0x3bd5, 0x3bd7, 0x3bd8, 0x3bda, 0x3bdb, 0x3bdd, 0x3bde, 0x3be0, 0x3be1, 
+	 0x3be2, 0x3be4, 0x3be5, 0x3be7, 0x3be8, 0x3bea, 0x3beb, 0x3bed, 0x3bee, 0x3bf0, 0x3bf1, 0x3bf3, 
+	 0x3bf4, 0x3bf6, 0x3bf7, 0x3bf9, 0x3bfa, 0x3bfc, 0x3bfd, 0x3bff, 0x3c00
+};
 
 //////////////////////////////////////////////////////////////
 //
@@ -1572,6 +1862,26 @@ void copyWithoutPadding(char *dest, const char *src, int length)
 	}	
 }
 
+// Formats t as asctime does, less the newline. localtime and asctime share static 
+// buffers between all threads, so we use the reentrant versions and do our own formatting
+void copyTime(char *dest, time_t t)
+{
+	static const char *days[7] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+	static const char *months[12] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+	struct tm brokentime;
+#ifdef _MSC_VER
+	bool valid = (localtime_s(&brokentime, &t) == 0);
+#else
+	bool valid = (localtime_r(&t, &brokentime) != NULL);
+#endif
+	if (!valid || (brokentime.tm_wday < 0) || (brokentime.tm_wday > 6) || (brokentime.tm_mon < 0) || (brokentime.tm_mon > 11)) {
+		strcpy(dest, "-");
+		return;
+	}
+	sprintf(dest, "%.3s %.3s%3d %.2d:%.2d:%.2d %d", days[brokentime.tm_wday], months[brokentime.tm_mon], 
+			brokentime.tm_mday, brokentime.tm_hour, brokentime.tm_min, brokentime.tm_sec, 1900 + brokentime.tm_year);
+}
+
 
 //////////////////////////////////////////////////////////////
 //
@@ -1789,6 +2099,121 @@ void readAllHuffmanTables(FILE *fp, off_t offset, huffTables *tables, int numTab
 }
 
 
+//////////////////////////////////////////////////////////////
+//
+// Progress and cancellation
+//
+//////////////////////////////////////////////////////////////
+// Each stage of a decode that has a progress callback or a cancel token gets a 
+// pcdProgress, which its tasks share; without either, the stage just passes NULL,
+// and there is no checking or locking at all.
+
+struct pcdTokenData {
+	pcdMutex lock;
+	bool cancelled;
+};
+
+pcdCancelToken::pcdCancelToken()
+{
+	struct pcdTokenData *td = new pcdTokenData;
+	pcdMutexInit(td->lock);
+	td->cancelled = false;
+	tokenData = td;
+}
+
+pcdCancelToken::~pcdCancelToken()
+{
+	struct pcdTokenData *td = (struct pcdTokenData *) tokenData;
+	pcdMutexDestroy(td->lock);
+	delete td;
+	tokenData = NULL;
+}
+
+void pcdCancelToken::cancel()
+{
+	struct pcdTokenData *td = (struct pcdTokenData *) tokenData;
+	pcdMutexLock(td->lock);
+	td->cancelled = true;
+	pcdMutexUnlock(td->lock);
+}
+
+bool pcdCancelToken::isCancelled()
+{
+	struct pcdTokenData *td = (struct pcdTokenData *) tokenData;
+	bool cancelled;
+	pcdMutexLock(td->lock);
+	cancelled = td->cancelled;
+	pcdMutexUnlock(td->lock);
+	return cancelled;
+}
+
+void pcdCancelToken::reset()
+{
+	struct pcdTokenData *td = (struct pcdTokenData *) tokenData;
+	pcdMutexLock(td->lock);
+	td->cancelled = false;
+	pcdMutexUnlock(td->lock);
+}
+
+struct pcdProgress {
+	pcdDecode *decoder;
+	pcdProgressCallback callback;
+	void *context;
+	pcdCancelToken *token;
+	int stage;
+	size_t done;
+	size_t total;
+	pcdMutex lock;
+};
+
+// Returns progress, set up for the stage, or NULL if there is nothing to report to
+static struct pcdProgress *pcdBeginProgress(struct pcdProgress *progress, pcdDecode *decoder, pcdProgressCallback callback, 
+											void *context, pcdCancelToken *token, int stage, size_t done, size_t total)
+{
+	if ((callback == NULL) && (token == NULL)) {
+		return NULL;
+	}
+	progress->decoder = decoder;
+	progress->callback = callback;
+	progress->context = context;
+	progress->token = token;
+	progress->stage = stage;
+	progress->done = done;
+	progress->total = total;
+	pcdMutexInit(progress->lock);
+	return progress;
+}
+
+static bool pcdProgressCancelled(struct pcdProgress *progress)
+{
+	return (progress != NULL) && (progress->token != NULL) && progress->token->isCancelled();
+}
+
+// Adds to the rows done, and to the total; the callback is made under the lock,
+// so that calls don't overlap, and done never goes backwards
+static void pcdAddProgress(struct pcdProgress *progress, size_t done, size_t total)
+{
+	if (progress == NULL) return;
+	pcdMutexLock(progress->lock);
+	progress->done += done;
+	progress->total += total;
+	if (progress->callback != NULL) {
+		progress->callback(progress->decoder, progress->stage, progress->done, progress->total, progress->context);
+	}
+	pcdMutexUnlock(progress->lock);
+}
+
+// complete is true if the stage finished; the last call then always has done equal
+// to total, whatever the rows were counted as on the way
+static void pcdEndProgress(struct pcdProgress *progress, bool complete)
+{
+	if (progress == NULL) return;
+	if (complete && (progress->done < progress->total) && !pcdProgressCancelled(progress)) {
+		pcdAddProgress(progress, progress->total - progress->done, 0);
+	}
+	pcdMutexDestroy(progress->lock);
+}
+
 //////////////////////////////////////////////////////////////
 //
 // Reader for the delta tables - this supports base, 16 base 
@@ -1796,12 +2221,17 @@ void readAllHuffmanTables(FILE *fp, off_t offset, huffTables *tables, int numTab
 //
 //////////////////////////////////////////////////////////////
 
-static bool readPCDDeltas(ReadBuffer *buf, struct huffTables *huf, int sceneSelect, int sequenceSize, int sequencesToProcess, uint8_t *data[3], off_t colOffset)
+static bool readPCDDeltas(ReadBuffer *buf, struct huffTables *huf, int sceneSelect, int sequenceSize, int sequencesToProcess, uint8_t *data[3], off_t colOffset,
+						  struct pcdProgress *progress)
 {		
-	size_t count;
+	size_t count, decoded = 0;
 	unsigned long plane, row;
 	unsigned int sequence;
 	int planeTrack = ((data[0] != NULL) ? 0x1 : 0) | ((data[1] != NULL) ? 0x2 : 0) | ((data[2] != NULL) ? 0x4 : 0);
+	// Without chroma planes to fill, we can stop as soon as every luma row is in, 
+	// rather than searching through the chroma sequences for the end of the data
+	bool lumaOnly = (data[1] == NULL) && (data[2] == NULL) && (sequenceSize == 0);
+	unsigned long lumaRows = 0;
 	
 	if (sequencesToProcess == 0) {
 		// for anything less than 64base, one sequence per row
@@ -1812,6 +2242,15 @@ static bool readPCDDeltas(ReadBuffer *buf, struct huffTables *huf, int sceneSele
 	row = 0;
 	sequence = 0;
 	while (((planeTrack != 0x0) || (row < PCDLumaHeight[sceneSelect])) && (sequencesToProcess > 0)) {
+		if (progress != NULL) {
+			if (pcdProgressCancelled(progress)) {
+				throw "Decode cancelled";
+			}
+			if (decoded >= kProgressSequences) {
+				pcdAddProgress(progress, decoded, 0);
+				decoded = 0;
+			}
+		}
 		// First check we're at the start of a sequence
 		syncHuffman(buf);
 		// Get the first 24 bits into the shift register - these have the plane, row and sequence numbers
@@ -1843,6 +2282,8 @@ static bool readPCDDeltas(ReadBuffer *buf, struct huffTables *huf, int sceneSele
 									 data[0] + row*PCDLumaWidth[sceneSelect] + sequence*sequenceSize + colOffset, 
 									 sequenceSize == 0 ? PCDLumaWidth[sceneSelect] : sequenceSize);
 					planeTrack &= 0x6;
+					lumaRows++;
+					decoded++;
 					break;
 				}
 				case 2:
@@ -1852,6 +2293,7 @@ static bool readPCDDeltas(ReadBuffer *buf, struct huffTables *huf, int sceneSele
 									 &(huf->ht[1]), 
 									 data[1]+(row>>1)*PCDChromaWidth[sceneSelect] + sequence*sequenceSize + (colOffset>>1), 
 									 sequenceSize == 0 ? PCDChromaWidth[sceneSelect] : sequenceSize);
+						decoded++;
 					}
 					planeTrack &= 0x5;
 					break;
@@ -1865,6 +2307,7 @@ static bool readPCDDeltas(ReadBuffer *buf, struct huffTables *huf, int sceneSele
 									 &(huf->ht[2]), 
 									 data[2]+(row>>1)*PCDChromaWidth[sceneSelect] + sequence*sequenceSize + (colOffset>>1), 
 									 sequenceSize == 0 ? PCDChromaWidth[sceneSelect] : sequenceSize);
+						decoded++;
 					}
 					planeTrack &= 0x3;
 					break;
@@ -1881,257 +2324,1042 @@ static bool readPCDDeltas(ReadBuffer *buf, struct huffTables *huf, int sceneSele
 #endif
 		}
 		sequencesToProcess--;
+		if (lumaOnly && (lumaRows >= PCDLumaHeight[sceneSelect])) {
+			break;
+		}
 	}
+	pcdAddProgress(progress, decoded, 0);
 	return(true);		
 }
 
 //////////////////////////////////////////////////////////////
 //
-// Interpolation routines 
+// Thread pool
 //
 //////////////////////////////////////////////////////////////
-#define pcdMin(x,y) (((x) < (y)) ? x : y)
-#define pcdMax(x,y) (((x) < (y)) ? y : x)
-#define pcdPin(low, x, high) (((x) < (low)) ? (low) : (((x) > (high)) ? (high) : (x)))
+// Work is submitted to the pool as a batch of tasks - typically a few dozen row
+// tiles of one plane - that all use the same task function. Each worker thread has
+// its own queue of tasks; a batch is dealt out across the queues in contiguous runs,
+// so neighbouring tiles tend to run on the same thread. A worker takes tasks from
+// the back of its own queue, and when that is empty steals from the front of the
+// others. So a thread that is slowed down (page faults, another process on the
+// same core, etc) just ends up doing fewer tiles, rather than holding up the batch.
+// The thread that submits a batch steals tasks until the batch is complete, so
+// nested use of a pool - e.g., a decoder that is itself running on a pool thread -
+// cannot deadlock.
+
+struct pcdTaskBatch {
+	pcdTaskFunction function;
+	uint8_t *tasks;
+	size_t taskSize;
+	size_t pending;									// Tasks not yet finished
+	bool detached;									// Single task from execute; freed when done
+	// Only for task graphs; see pcdRunTaskGraph
+	size_t *waitCounts;
+	size_t *successorStart;
+	size_t *successors;
+};
 
-// Data structure to be passed to each thread - effectively a tile description
-struct upResInterpolateData {
-	uint8_t *base;
-	uint8_t *dest;
-	uint8_t *luma;
-	unsigned int width;
-	unsigned int height;
-	bool hasDeltas;
-	unsigned int startRow;
-	unsigned int endRow;
+// A task that is ready, but couldn't be queued
+#define kTaskUnqueued ((size_t) -1)
+
+struct pcdTaskRef {
+	struct pcdTaskBatch *batch;
+	size_t index;
 };
 
-//////////////////////////////////////////////////////////////
-//
-// basic "Kodak standard" bilinear upres interpolator
-//
-//////////////////////////////////////////////////////////////
-//////////////////////////////////////////////////////////////
-//
-// basic "Kodak standard" bilinear upres interpolator
-//
-//////////////////////////////////////////////////////////////
-pcdThreadFunction upResInterpolate(void *t)
+// A simple locked deque, held as a ring buffer
+struct pcdWorkQueue {
+	pcdMutex lock;
+	struct pcdTaskRef *items;
+	size_t capacity;
+	size_t front;
+	size_t count;
+};
+
+struct pcdPoolData;
+
+struct pcdWorkerData {
+	struct pcdPoolData *pd;
+	unsigned int index;
+};
+
+struct pcdPoolData {
+	unsigned int numWorkers;
+	pcdThreadDescriptor *workers;
+	struct pcdWorkerData *workerData;
+	struct pcdWorkQueue *queues;					// One per worker
+	unsigned int numQueues;
+	pcdMutex lock;
+	pcdCondition workAvailable;
+	pcdCondition workDone;
+	unsigned long generation;						// Incremented whenever work is queued
+	unsigned int nextQueue;							// For tasks from execute
+	bool shutdown;
+};
+
+// Returns the pool data if the executor is a pcdThreadPool, else NULL
+struct pcdPoolData *pcdGetPoolData(pcdExecutor *executor);
+
+static bool pcdQueuePush(struct pcdWorkQueue *q, struct pcdTaskRef *ref)
 {
-	struct upResInterpolateData *rd = (struct upResInterpolateData *) t;
-	unsigned int row, column; 
-	ptrdiff_t indexDelta;
-	int sum;
-	int8_t *deltaBase = (int8_t *) rd->dest;
-	
-	// This is as intended by Kodak - linear interpolation
-	uint8_t *basePix, *basePix01, *basePix10, *basePix11;
-	unsigned int rowPlus, columnPlus;
-	for (row = rd->startRow>>1; row < rd->endRow>>1; row++) {
-		for (column = 0; column < rd->width>>1; column++) {
-			// When upresing, the factor is always two
-			// Note here we're iterating in rd->base coordinates
-			columnPlus = pcdMin(column + 1, (rd->width>>1)-1);
-			rowPlus = pcdMin(row + 1, (rd->height>>1)-1);
-			basePix = rd->base + column + row * (rd->width>>1);
-			basePix01 = rd->base + columnPlus + row * (rd->width>>1);					
-			basePix10 = rd->base + column + rowPlus * (rd->width>>1);		
-			basePix11 = rd->base + columnPlus + rowPlus * (rd->width>>1);	
-			
-			// base Pixel
-			indexDelta = (column<<1) + (row<<1) * rd->width;
-			sum = (int) (*basePix);
-			if (rd->hasDeltas) sum += (int) (*(deltaBase + indexDelta));
-			sum = sum < 0 ? 0 : (sum > 255 ? 255 : sum);
-			*(rd->dest + indexDelta) = (uint8_t) sum;
-			
-			// 01 Pixel
-			indexDelta = (column<<1) + 1 + (row<<1) * rd->width;
-			sum = ((int) (*basePix) + (int) (*basePix01) + 1) >> 1;
-			if (rd->hasDeltas) sum += (int) (*(deltaBase + indexDelta));
-			sum = sum < 0 ? 0 : (sum > 255 ? 255 : sum);
-			*(rd->dest + indexDelta) = (uint8_t) sum;
-			
-			// 10 Pixel		
-			indexDelta = (column<<1) + ((row<<1) + 1) * rd->width;
-			sum = ((int) (*basePix) + (int) (*basePix10) + 1) >> 1;
-			if (rd->hasDeltas) sum += (int) (*(deltaBase + indexDelta));
-			sum = sum < 0 ? 0 : (sum > 255 ? 255 : sum);
-			*(rd->dest + indexDelta) = (uint8_t) sum;
-			
-			// 11 Pixel
-			indexDelta = (column<<1) + 1 + ((row<<1) + 1) * rd->width;
-#ifdef UseFourPixels
-			sum = ((int) (*basePix) + (int) (*basePix01) + (int) (*basePix10) + (int) (*basePix11) + 2) >> 2;
-#else
-			sum = ((int) (*basePix) + (int) (*basePix11) + 1) >> 1;
-#endif
-			if (rd->hasDeltas) sum += (int) (*(deltaBase + indexDelta));
-			sum = sum < 0 ? 0 : (sum > 255 ? 255 : sum);
-			*(rd->dest + indexDelta) = (uint8_t) sum;
-			
+	pcdMutexLock(q->lock);
+	if (q->count >= q->capacity) {
+		size_t newCapacity = q->capacity < 16 ? 16 : q->capacity * 2;
+		struct pcdTaskRef *newItems = (struct pcdTaskRef *) malloc(newCapacity * sizeof(struct pcdTaskRef));
+		size_t i;
+		if (newItems == NULL) {
+			pcdMutexUnlock(q->lock);
+			return false;
 		}
-	}			
-	return NULL;
+		for (i = 0; i < q->count; i++) {
+			newItems[i] = q->items[(q->front + i) % q->capacity];
+		}
+		if (q->items != NULL) free(q->items);
+		q->items = newItems;
+		q->capacity = newCapacity;
+		q->front = 0;
+	}
+	q->items[(q->front + q->count) % q->capacity] = *ref;
+	q->count++;
+	pcdMutexUnlock(q->lock);
+	return true;
 }
 
-#ifdef mUseNonGPLCode
-#include "PCDLumaInterpolate.hpp"
-#endif
+// The owner of a queue takes from the back....
+static bool pcdQueuePop(struct pcdWorkQueue *q, struct pcdTaskRef *ref)
+{
+	bool found = false;
+	pcdMutexLock(q->lock);
+	if (q->count > 0) {
+		q->count--;
+		*ref = q->items[(q->front + q->count) % q->capacity];
+		found = true;
+	}
+	pcdMutexUnlock(q->lock);
+	return found;
+}
 
+// ....and everyone else steals from the front
+static bool pcdQueueSteal(struct pcdWorkQueue *q, struct pcdTaskRef *ref)
+{
+	bool found = false;
+	pcdMutexLock(q->lock);
+	if (q->count > 0) {
+		*ref = q->items[q->front];
+		q->front = (q->front + 1) % q->capacity;
+		q->count--;
+		found = true;
+	}
+	pcdMutexUnlock(q->lock);
+	return found;
+}
 
-void upResBuffer(uint8_t *base, uint8_t *dest, uint8_t *luma, unsigned int width, unsigned int height, int upResMethod, bool hasDeltas)
+// self is the index of the calling worker, or numQueues for any other thread.
+// numQueues is fixed before any worker starts, so (unlike numWorkers) is safe to
+// read here; the queues of any workers that failed to start are always empty
+static bool pcdFindTask(struct pcdPoolData *pd, unsigned int self, struct pcdTaskRef *ref)
 {
-	unsigned int row, column;
-	ptrdiff_t indexBase, indexDelta;
-	int sum, thread;
-	int previousRow = 0;
-#ifndef mNoPThreads
-	int rc;
-	void *status;
-	pcdThreadDescriptor threadDescriptors[kNumThreads];
-	pthread_attr_t threadAttr;
-	
-	/* Initialize and set thread detached attribute */
-	pthread_attr_init(&threadAttr);
-	pthread_attr_setdetachstate(&threadAttr, PTHREAD_CREATE_JOINABLE);
-	// Use minimum stacksize times two; we have only a few stack variables
-	pthread_attr_setstacksize(&threadAttr, PTHREAD_STACK_MIN<<1);
-#endif
-#ifdef __PerformanceAnalysis
-#ifdef qMacOS
-	AbsoluteTime nowTime, bgnTime;
-    bgnTime = UpTime();
-#endif
-#endif
-	
-	if (dest != NULL) {
-#ifdef mUseNonGPLCode
-		if ((upResMethod >= kUpResLumaIterpolate) && !hasDeltas && (luma != NULL)) {
+	unsigned int i;
+	if ((self < pd->numQueues) && pcdQueuePop(&(pd->queues[self]), ref)) {
+		return true;
+	}
+	for (i = 1; i <= pd->numQueues; i++) {
+		if (pcdQueueSteal(&(pd->queues[(self + i) % pd->numQueues]), ref)) {
+			return true;
+		}
+	}
+	return false;
+}
 
-			// This does a homogeniety minimisation routine.
-			// We should only ever(!) use this for chroma interpolation
-			struct upResInterpolateData rd[kNumThreads];
-			for (thread = 0; thread < kNumThreads; thread++) {
-				rd[thread].base = base;
-				rd[thread].dest = dest;
-				rd[thread].luma = luma;
-				rd[thread].width = width;
-				rd[thread].height = height;
-				rd[thread].hasDeltas = hasDeltas;
-				rd[thread].startRow = previousRow;
-				rd[thread].endRow =height/kNumThreads*(thread+1);
-				previousRow = rd[thread].endRow;
-#ifndef mNoPThreads
-				if (thread == (kNumThreads - 1)) {
-					upResLumaInterpolatePassI(&(rd[thread]));
-				}
-				else {
-					if (pcdStartThread(threadDescriptors[thread], threadAttr, upResLumaInterpolatePassI, (void *)&(rd[thread])) != 0) {
-						// Too many threads already.....
-						upResLumaInterpolatePassI(&(rd[thread]));
-						// Don't try to join
-						rd[thread].endRow = 0;
-					}
-				}
-#else
-				upResLumaInterpolatePassI(&(rd[thread]));
-#endif
-			}
-#ifndef mNoPThreads
-			pthread_attr_destroy(&threadAttr);
-			for (thread = 0; thread < (kNumThreads-1); thread++) {
-				if (rd[thread].endRow > 0) {
-					rc = pcdThreadJoin(threadDescriptors[thread], &status);
-				}
-			}
-#endif
-			
-			// For this algorithm, the easist thing is to prep the last rows and columns separately.....
-			for (row = height-1; row < height; row++) {
-				for (column = 0; column < width; column++) {
-					*(dest + column + row * (width)) = *(base + (column>>1) + (row>>1) * (width>>1));
-				}
-			}
-			for (row = 0; row < height; row++) {
-				for (column = column-1; column < width; column++) {
-					*(dest + column + row * (width)) = *(base + (column>>1) + (row>>1) * (width>>1));
-				}
-			}
-			
-			
-			for (thread = 0; thread < kNumThreads; thread++) {
-#ifndef mNoPThreads
-				if (thread == (kNumThreads - 1)) {
-					upResLumaInterpolatePassII(&(rd[thread]));
+// Called with the pool locked, after tasks have been queued
+static void pcdSignalWork(struct pcdPoolData *pd)
+{
+	pd->generation++;
+	pcdConditionBroadcast(pd->workAvailable);
+	// Threads waiting on a task graph can help with newly ready tasks
+	pcdConditionBroadcast(pd->workDone);
+}
+
+// self is the index of the calling worker, or numQueues for any other thread
+static void pcdRunTask(struct pcdPoolData *pd, struct pcdTaskRef *ref, unsigned int self)
+{
+	struct pcdTaskBatch *batch = ref->batch;
+	struct pcdTaskRef next;
+	size_t i, successor;
+	bool queued = false, unqueued = false;
+	// Once the batch is finished, the submitter may free it, so read this first
+	bool detached = batch->detached;
+	batch->function(batch->tasks + ref->index*batch->taskSize);
+	pcdMutexLock(pd->lock);
+	if (batch->waitCounts != NULL) {
+		// Release any tasks that were waiting on this one; they go on our own queue,
+		// as they will usually need the data this task just produced
+		next.batch = batch;
+		for (i = batch->successorStart[ref->index]; i < batch->successorStart[ref->index+1]; i++) {
+			successor = batch->successors[i];
+			if (--batch->waitCounts[successor] == 0) {
+				next.index = successor;
+				if (pcdQueuePush(&(pd->queues[self < pd->numQueues ? self : successor % pd->numQueues]), &next)) {
+					queued = true;
 				}
 				else {
-					if (pcdStartThread(threadDescriptors[thread], threadAttr, upResLumaInterpolatePassII, (void *)&(rd[thread])) != 0) {
-						// Too many threads already.....
-						upResLumaInterpolatePassII(&(rd[thread]));
-						// Don't try to join
-						rd[thread].endRow = 0;
-					}
+					batch->waitCounts[successor] = kTaskUnqueued;
+					unqueued = true;
 				}
-#else
-				upResLumaInterpolatePassII(&(rd[thread]));
-#endif
 			}
-#ifndef mNoPThreads
-			pthread_attr_destroy(&threadAttr);
-			for (thread = 0; thread < (kNumThreads-1); thread++) {
-				if (rd[thread].endRow > 0) {
-					rc = pcdThreadJoin(threadDescriptors[thread], &status);
-				}
+		}
+		if (queued) {
+			pcdSignalWork(pd);
+		}
+	}
+	bool finished = (--batch->pending == 0);
+	if (finished) {
+		pcdConditionBroadcast(pd->workDone);
+	}
+	pcdMutexUnlock(pd->lock);
+	if (finished && detached) {
+		free(batch);
+		return;
+	}
+	if (unqueued) {
+		// No memory to queue them; just do them here
+		for (i = batch->successorStart[ref->index]; i < batch->successorStart[ref->index+1]; i++) {
+			successor = batch->successors[i];
+			pcdMutexLock(pd->lock);
+			queued = (batch->waitCounts[successor] == kTaskUnqueued);
+			if (queued) batch->waitCounts[successor] = 0;
+			pcdMutexUnlock(pd->lock);
+			if (queued) {
+				next.batch = batch;
+				next.index = successor;
+				pcdRunTask(pd, &next, self);
 			}
-#endif
-#ifdef __PerformanceAnalysis
-#ifdef qMacOS
-			nowTime = UpTime();
-			float uSec  = HowLong(nowTime, bgnTime);
-			fprintf(stderr, " upResInterpolate: %.3f usec \n", uSec);
-#endif
-#endif
 		}
-		else
-#endif
-		if (upResMethod >= kUpResIterpolate) {
-			struct upResInterpolateData rd[kNumThreads];
-			for (thread = 0; thread < kNumThreads; thread++) {
-				rd[thread].base = base;
-				rd[thread].dest = dest;
-				rd[thread].luma = luma;
-				rd[thread].width = width;
-				rd[thread].height = height;
-				rd[thread].hasDeltas = hasDeltas;
-				rd[thread].startRow = previousRow;
-				rd[thread].endRow =height/kNumThreads*(thread+1);
-				previousRow = rd[thread].endRow;
+	}
+}
+
 #ifndef mNoPThreads
-				if (thread == (kNumThreads - 1)) {
-					upResInterpolate(&(rd[thread]));
-				}
-				else {
-					if (pcdStartThread(threadDescriptors[thread], threadAttr, upResInterpolate, (void *)&(rd[thread])) != 0) {
-						// Too many threads already.....
-						upResInterpolate(&(rd[thread]));
-						// Don't try to join
-						rd[thread].endRow = 0;
-					}
-				}
-#else
-				upResInterpolate(&(rd[thread]));
+pcdThreadFunction pcdPoolWorker(void *t)
+{
+	struct pcdWorkerData *wd = (struct pcdWorkerData *) t;
+	struct pcdPoolData *pd = wd->pd;
+	struct pcdTaskRef ref;
+	unsigned long seen;
+	
+	for (;;) {
+		pcdMutexLock(pd->lock);
+		if (pd->shutdown) {
+			pcdMutexUnlock(pd->lock);
+			break;
+		}
+		seen = pd->generation;
+		pcdMutexUnlock(pd->lock);
+		
+		if (pcdFindTask(pd, wd->index, &ref)) {
+			pcdRunTask(pd, &ref, wd->index);
+			continue;
+		}
+		
+		// Nothing anywhere; sleep until something new is queued
+		pcdMutexLock(pd->lock);
+		while ((pd->generation == seen) && !pd->shutdown) {
+			pcdConditionWait(pd->workAvailable, pd->lock);
+		}
+		pcdMutexUnlock(pd->lock);
+	}
+	return 0;
+}
 #endif
+
+// Queues the tasks of a batch that are ready to run, then works on the pool until
+// the whole batch has completed
+static void pcdRunBatch(struct pcdPoolData *pd, struct pcdTaskBatch *batch, size_t numTasks)
+{
+	size_t index, ready, numReady;
+	bool queued = false;
+	struct pcdTaskRef ref;
+	
+	numReady = 0;
+	for (index = 0; index < numTasks; index++) {
+		if ((batch->waitCounts == NULL) || (batch->waitCounts[index] == 0)) numReady++;
+	}
+	
+	// Deal the ready tasks out in contiguous runs
+	ref.batch = batch;
+	ready = 0;
+	for (index = 0; index < numTasks; index++) {
+		if ((batch->waitCounts != NULL) && (batch->waitCounts[index] != 0)) continue;
+		ref.index = index;
+		if (pcdQueuePush(&(pd->queues[ready * pd->numWorkers / numReady]), &ref)) {
+			queued = true;
+		}
+		else {
+			// No memory to queue it; just do it here
+			pcdRunTask(pd, &ref, pd->numQueues);
+		}
+		ready++;
+	}
+	if (queued) {
+		pcdMutexLock(pd->lock);
+		pcdSignalWork(pd);
+		pcdMutexUnlock(pd->lock);
+	}
+	
+	for (;;) {
+		if (pcdFindTask(pd, pd->numQueues, &ref)) {
+			pcdRunTask(pd, &ref, pd->numQueues);
+			continue;
+		}
+		// Nothing to help with; wait for the batch to finish, or for more work
+		pcdMutexLock(pd->lock);
+		if (batch->pending == 0) {
+			pcdMutexUnlock(pd->lock);
+			break;
+		}
+		pcdConditionWait(pd->workDone, pd->lock);
+		pcdMutexUnlock(pd->lock);
+	}
+}
+
+// Number of threads, including this one, to spread work over. Without pThreads there
+// is no locking, so other executors' threads can't be used.
+static unsigned int pcdConcurrency(pcdExecutor *executor)
+{
+#ifdef mNoPThreads
+	if (pcdGetPoolData(executor) == NULL) {
+		return 1;
+	}
+#endif
+	return executor == NULL ? 1 : executor->getConcurrency();
+}
+
+// Task groups run task batches and graphs on any other executor. The group hands
+// the executor up to getConcurrency()-1 runners, each of which takes ready tasks
+// from the group until there are none left; the calling thread does the same. 
+// So the calling thread alone can complete the group, whatever the executor does.
+// Runners may start after the group is complete, so the group is reference 
+// counted, and freed by whichever of the caller or the runners finishes with it last.
+struct pcdTaskGroup {
+	pcdMutex lock;
+	pcdCondition changed;
+	pcdExecutor *executor;
+	pcdTaskFunction function;
+	uint8_t *tasks;
+	size_t taskSize;
+	size_t *waitCounts;
+	size_t *successorStart;
+	size_t *successors;
+	size_t *ready;									// Stack of tasks that can run now
+	size_t numReady;
+	size_t pending;									// Tasks not yet finished
+	unsigned int runners;							// Runners that may still take tasks
+	unsigned int maxRunners;
+	unsigned int references;
+};
+
+static void pcdReleaseTaskGroup(struct pcdTaskGroup *group)
+{
+	bool last;
+	pcdMutexLock(group->lock);
+	last = (--group->references == 0);
+	pcdMutexUnlock(group->lock);
+	if (last) {
+		pcdConditionDestroy(group->changed);
+		pcdMutexDestroy(group->lock);
+		free(group->ready);
+		free(group);
+	}
+}
+
+static void pcdTaskGroupRunner(void *t);
+
+// Called with the group locked; returns with it locked
+static void pcdStartRunners(struct pcdTaskGroup *group)
+{
+	unsigned int start = 0;
+	while ((group->runners < group->maxRunners) && (group->runners < group->numReady)) {
+		group->runners++;
+		group->references++;
+		start++;
+	}
+	if (start > 0) {
+		// The executor may run the runner before execute returns
+		pcdMutexUnlock(group->lock);
+		while (start-- > 0) {
+			group->executor->execute(pcdTaskGroupRunner, group);
+		}
+		pcdMutexLock(group->lock);
+	}
+}
+
+// Called with the group locked, and a ready task available; returns with it locked
+static void pcdRunGroupTask(struct pcdTaskGroup *group)
+{
+	size_t i, index = group->ready[--group->numReady];
+	pcdMutexUnlock(group->lock);
+	group->function(group->tasks + index*group->taskSize);
+	pcdMutexLock(group->lock);
+	if (group->waitCounts != NULL) {
+		for (i = group->successorStart[index]; i < group->successorStart[index+1]; i++) {
+			if (--group->waitCounts[group->successors[i]] == 0) {
+				group->ready[group->numReady++] = group->successors[i];
+			}
+		}
+	}
+	group->pending--;
+	pcdConditionBroadcast(group->changed);
+}
+
+static void pcdTaskGroupRunner(void *t)
+{
+	struct pcdTaskGroup *group = (struct pcdTaskGroup *) t;
+	pcdMutexLock(group->lock);
+	while (group->numReady > 0) {
+		pcdRunGroupTask(group);
+		// Newly ready tasks may be worth more runners
+		pcdStartRunners(group);
+	}
+	group->runners--;
+	pcdMutexUnlock(group->lock);
+	pcdReleaseTaskGroup(group);
+}
+
+static void pcdRunTaskGroup(pcdExecutor *executor, pcdTaskFunction function, void *tasks, size_t taskSize, size_t numTasks, 
+							size_t *waitCounts, size_t *successorStart, size_t *successors)
+{
+	size_t index;
+	struct pcdTaskGroup *group = (struct pcdTaskGroup *) malloc(sizeof(struct pcdTaskGroup));
+	size_t *ready = (size_t *) malloc(numTasks * sizeof(size_t));
+	if ((group == NULL) || (ready == NULL)) {
+		// Just do it here
+		if (group != NULL) free(group);
+		if (ready != NULL) free(ready);
+		for (index = 0; index < numTasks; index++) {
+			function(((uint8_t *) tasks) + index*taskSize);
+		}
+		return;
+	}
+	pcdMutexInit(group->lock);
+	pcdConditionInit(group->changed);
+	group->executor = executor;
+	group->function = function;
+	group->tasks = (uint8_t *) tasks;
+	group->taskSize = taskSize;
+	group->waitCounts = waitCounts;
+	group->successorStart = successorStart;
+	group->successors = successors;
+	group->ready = ready;
+	group->numReady = 0;
+	group->pending = numTasks;
+	group->runners = 0;
+	group->maxRunners = pcdConcurrency(executor) - 1;
+	group->references = 1;
+	// The ready list is a stack, so push in reverse to start at the top of the image
+	for (index = numTasks; index-- > 0; ) {
+		if ((waitCounts == NULL) || (waitCounts[index] == 0)) {
+			group->ready[group->numReady++] = index;
+		}
+	}
+	
+	pcdMutexLock(group->lock);
+	pcdStartRunners(group);
+	while (group->pending > 0) {
+		if (group->numReady > 0) {
+			pcdRunGroupTask(group);
+			pcdStartRunners(group);
+		}
+		else {
+			// Everything that can run is running; help the executor if it lets us, 
+			// as we may be on one of its threads
+			pcdMutexUnlock(group->lock);
+			bool helped = executor->runPendingTask();
+			pcdMutexLock(group->lock);
+			if (!helped && (group->pending > 0) && (group->numReady == 0)) {
+				pcdConditionWait(group->changed, group->lock);
 			}
-#ifndef mNoPThreads
-			pthread_attr_destroy(&threadAttr);
-			status  = 0; // Avoid unreferenced local variable warning
-			for (thread = 0; thread < (kNumThreads-1); thread++) {
-				if (rd[thread].endRow > 0) {
-					rc = pcdThreadJoin(threadDescriptors[thread], &status);
-				}
-			}
+		}
+	}
+	pcdMutexUnlock(group->lock);
+	pcdReleaseTaskGroup(group);
+}
+
+// Runs function over each of the numTasks task descriptions in tasks, and returns 
+// when they have all completed. Task i may not start until waitCounts[i] other tasks
+// have completed; the tasks that wait on task i are successors[successorStart[i]] to 
+// successors[successorStart[i+1]-1]. waitCounts is used up in the process, and may be
+// NULL if the tasks are independent. Task indexes must be in dependency order; that is
+// the order they are run in if the executor has no concurrency.
+static void pcdRunTaskGraph(pcdExecutor *executor, pcdTaskFunction function, void *tasks, size_t taskSize, size_t numTasks, 
+							size_t *waitCounts, size_t *successorStart, size_t *successors)
+{
+	size_t index;
+	if ((numTasks < 2) || (pcdConcurrency(executor) < 2)) {
+		for (index = 0; index < numTasks; index++) {
+			function(((uint8_t *) tasks) + index*taskSize);
+		}
+		return;
+	}
+	
+	struct pcdPoolData *pd = pcdGetPoolData(executor);
+	if (pd != NULL) {
+		// Our own pool; use its queues directly
+		struct pcdTaskBatch batch;
+		batch.function = function;
+		batch.tasks = (uint8_t *) tasks;
+		batch.taskSize = taskSize;
+		batch.pending = numTasks;
+		batch.detached = false;
+		batch.waitCounts = waitCounts;
+		batch.successorStart = successorStart;
+		batch.successors = successors;
+		pcdRunBatch(pd, &batch, numTasks);
+	}
+	else {
+		pcdRunTaskGroup(executor, function, tasks, taskSize, numTasks, waitCounts, successorStart, successors);
+	}
+}
+
+// As pcdRunTaskGraph, for tasks that are independent
+static void pcdRunTasks(pcdExecutor *executor, pcdTaskFunction function, void *tasks, size_t taskSize, size_t numTasks)
+{
+	pcdRunTaskGraph(executor, function, tasks, taskSize, numTasks, NULL, NULL, NULL);
+}
+
+// Number of tiles to split a plane of the given size into; tiles are about
+// kTileRows high, and there are no more than kMaxTiles of them
+static size_t pcdNumTiles(pcdExecutor *executor, size_t width, size_t height)
+{
+	size_t tiles;
+	if (((width * height) < kInlinePixelThreshold) || (pcdConcurrency(executor) < 2)) {
+		return 1;
+	}
+	tiles = (height + kTileRows - 1) / kTileRows;
+	return tiles > kMaxTiles ? kMaxTiles : (tiles < 1 ? 1 : tiles);
+}
+
+// End row of a tile; tiles are an even number of rows, as the interpolators work on
+// 2x2 blocks, and the last tile takes up the remainder
+static size_t pcdTileEndRow(size_t tile, size_t numTiles, size_t height)
+{
+	return (tile == (numTiles - 1)) ? height : ((height * (tile + 1) / numTiles) & ~((size_t) 1));
+}
+
+pcdThreadPool::pcdThreadPool(unsigned int numThreads)
+{
+	struct pcdPoolData *pd = new pcdPoolData;
+	pd->numWorkers = 0;
+	pd->workers = NULL;
+	pd->workerData = NULL;
+	pd->queues = NULL;
+	pd->numQueues = 0;
+	pd->generation = 0;
+	pd->nextQueue = 0;
+	pd->shutdown = false;
+	pcdMutexInit(pd->lock);
+	pcdConditionInit(pd->workAvailable);
+	pcdConditionInit(pd->workDone);
+	poolData = pd;
+
+#ifndef mNoPThreads
+	if (numThreads == 0) {
+		numThreads = getAvailableCPUs();
+	}
+	// The calling thread always does a share of the work
+	if (numThreads > 1) {
+		pthread_attr_t threadAttr;
+		unsigned int i;
+		pthread_attr_init(&threadAttr);
+		pthread_attr_setdetachstate(&threadAttr, PTHREAD_CREATE_JOINABLE);
+		pthread_attr_setstacksize(&threadAttr, kPoolThreadStackSize);
+		pd->workers = new pcdThreadDescriptor[numThreads - 1];
+		pd->workerData = new pcdWorkerData[numThreads - 1];
+		pd->queues = new pcdWorkQueue[numThreads - 1];
+		for (i = 0; i < (numThreads - 1); i++) {
+			pcdMutexInit(pd->queues[i].lock);
+			pd->queues[i].items = NULL;
+			pd->queues[i].capacity = 0;
+			pd->queues[i].front = 0;
+			pd->queues[i].count = 0;
+		}
+		pd->numQueues = numThreads - 1;
+		for (i = 0; i < (numThreads - 1); i++) {
+			pd->workerData[i].pd = pd;
+			pd->workerData[i].index = i;
+			if (pcdStartThread(pd->workers[i], threadAttr, pcdPoolWorker, (void *) &(pd->workerData[i])) != 0) {
+				// Too many threads already.....; make do with what we have
+				break;
+			}
+			pd->numWorkers++;
+		}
+		pthread_attr_destroy(&threadAttr);
+	}
+#endif
+}
+
+pcdThreadPool::~pcdThreadPool()
+{
+	struct pcdPoolData *pd = (struct pcdPoolData *) poolData;
+#ifndef mNoPThreads
+	unsigned int i;
+	void *status;
+	pcdMutexLock(pd->lock);
+	pd->shutdown = true;
+	pcdConditionBroadcast(pd->workAvailable);
+	pcdMutexUnlock(pd->lock);
+	for (i = 0; i < pd->numWorkers; i++) {
+		pcdThreadJoin(pd->workers[i], &status);
+	}
+	for (i = 0; i < pd->numQueues; i++) {
+		if (pd->queues[i].items != NULL) free(pd->queues[i].items);
+		pcdMutexDestroy(pd->queues[i].lock);
+	}
 #endif
+	if (pd->queues != NULL) delete [] pd->queues;
+	if (pd->workerData != NULL) delete [] pd->workerData;
+	if (pd->workers != NULL) delete [] pd->workers;
+	pcdConditionDestroy(pd->workDone);
+	pcdConditionDestroy(pd->workAvailable);
+	pcdMutexDestroy(pd->lock);
+	delete pd;
+	poolData = NULL;
+}
+
+unsigned int pcdThreadPool::getNumThreads()
+{
+	return ((struct pcdPoolData *) poolData)->numWorkers + 1;
+}
+
+unsigned int pcdThreadPool::getConcurrency()
+{
+	return getNumThreads();
+}
+
+// A single task from execute; pcdRunTask frees it (via its batch, which must be 
+// the first member) once the task is done
+struct pcdDetachedTask {
+	struct pcdTaskBatch batch;
+	void (*function)(void *);
+	void *argument;
+};
+
+pcdThreadFunction pcdRunDetachedTask(void *t)
+{
+	struct pcdDetachedTask *task = (struct pcdDetachedTask *) t;
+	task->function(task->argument);
+	return 0;
+}
+
+void pcdThreadPool::execute(void (*function)(void *), void *argument)
+{
+	struct pcdPoolData *pd = (struct pcdPoolData *) poolData;
+	struct pcdDetachedTask *task = NULL;
+	struct pcdTaskRef ref;
+	unsigned int queue;
+	if (pd->numWorkers > 0) {
+		task = (struct pcdDetachedTask *) malloc(sizeof(struct pcdDetachedTask));
+	}
+	if (task == NULL) {
+		// No workers (or no memory); just do it here
+		function(argument);
+		return;
+	}
+	task->batch.function = pcdRunDetachedTask;
+	task->batch.tasks = (uint8_t *) task;
+	task->batch.taskSize = 0;
+	task->batch.pending = 1;
+	task->batch.detached = true;
+	task->batch.waitCounts = NULL;
+	task->batch.successorStart = NULL;
+	task->batch.successors = NULL;
+	task->function = function;
+	task->argument = argument;
+	ref.batch = &(task->batch);
+	ref.index = 0;
+	
+	pcdMutexLock(pd->lock);
+	queue = pd->nextQueue;
+	pd->nextQueue = (pd->nextQueue + 1) % pd->numWorkers;
+	pcdMutexUnlock(pd->lock);
+	if (!pcdQueuePush(&(pd->queues[queue]), &ref)) {
+		free(task);
+		function(argument);
+		return;
+	}
+	pcdMutexLock(pd->lock);
+	pcdSignalWork(pd);
+	pcdMutexUnlock(pd->lock);
+}
+
+bool pcdThreadPool::runPendingTask()
+{
+	struct pcdPoolData *pd = (struct pcdPoolData *) poolData;
+	struct pcdTaskRef ref;
+	if ((pd->numQueues == 0) || !pcdFindTask(pd, pd->numQueues, &ref)) {
+		return false;
+	}
+	pcdRunTask(pd, &ref, pd->numQueues);
+	return true;
+}
+
+// An application's task, as run by runTasks
+struct pcdPoolTask {
+	void (*function)(void *);
+	void *argument;
+};
+
+pcdThreadFunction pcdRunPoolTask(void *t)
+{
+	struct pcdPoolTask *task = (struct pcdPoolTask *) t;
+	task->function(task->argument);
+	return 0;
+}
+
+void pcdThreadPool::runTasks(void (*function)(void *), void *tasks, size_t taskSize, size_t numTasks)
+{
+	struct pcdPoolTask *poolTasks = (struct pcdPoolTask *) malloc(numTasks * sizeof(struct pcdPoolTask));
+	size_t index;
+	if (poolTasks == NULL) {
+		// No memory; just do them here
+		for (index = 0; index < numTasks; index++) {
+			function(((uint8_t *) tasks) + index*taskSize);
+		}
+		return;
+	}
+	for (index = 0; index < numTasks; index++) {
+		poolTasks[index].function = function;
+		poolTasks[index].argument = ((uint8_t *) tasks) + index*taskSize;
+	}
+	pcdRunTasks(this, pcdRunPoolTask, poolTasks, sizeof(struct pcdPoolTask), numTasks);
+	free(poolTasks);
+}
+
+struct pcdPoolData *pcdGetPoolData(pcdExecutor *executor)
+{
+	pcdThreadPool *pool = dynamic_cast<pcdThreadPool *>(executor);
+	return pool != NULL ? (struct pcdPoolData *) pool->poolData : NULL;
+}
+
+static pcdThreadPool *sharedThreadPool = NULL;
+
+#if defined(mNoPThreads)
+pcdThreadPool *pcdThreadPool::getSharedPool()
+{
+	if (sharedThreadPool == NULL) {
+		sharedThreadPool = new pcdThreadPool(1);
+	}
+	return sharedThreadPool;
+}
+#elif defined(_MSC_VER)
+static INIT_ONCE sharedThreadPoolOnce = INIT_ONCE_STATIC_INIT;
+
+static BOOL CALLBACK createSharedThreadPool(PINIT_ONCE initOnce, PVOID parameter, PVOID *context)
+{
+	sharedThreadPool = new pcdThreadPool(0);
+	return TRUE;
+}
+
+pcdThreadPool *pcdThreadPool::getSharedPool()
+{
+	InitOnceExecuteOnce(&sharedThreadPoolOnce, createSharedThreadPool, NULL, NULL);
+	return sharedThreadPool;
+}
+#else
+static pthread_once_t sharedThreadPoolOnce = PTHREAD_ONCE_INIT;
+
+static void createSharedThreadPool(void)
+{
+	sharedThreadPool = new pcdThreadPool(0);
+}
+
+pcdThreadPool *pcdThreadPool::getSharedPool()
+{
+	pthread_once(&sharedThreadPoolOnce, createSharedThreadPool);
+	return sharedThreadPool;
+}
+#endif
+
+#ifdef __linux__
+// Returns the CPU limit imposed by a cgroup (v2 or v1) quota, or 0 if there is none
+static unsigned int cgroupCPULimit(void)
+{
+	FILE *fp;
+	long long quota = -1, period = 0;
+	char text[64];
+	
+	fp = fopen("/sys/fs/cgroup/cpu.max", "r");
+	if (fp != NULL) {
+		// cgroup v2: "<quota> <period>", or "max <period>" if unlimited
+		if ((fscanf(fp, "%63s %lld", text, &period) == 2) && (strcmp(text, "max") != 0)) {
+			quota = atoll(text);
+		}
+		fclose(fp);
+	}
+	else {
+		fp = fopen("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", "r");
+		if (fp != NULL) {
+			if (fscanf(fp, "%lld", &quota) != 1) quota = -1;
+			fclose(fp);
+			fp = fopen("/sys/fs/cgroup/cpu/cpu.cfs_period_us", "r");
+			if (fp != NULL) {
+				if (fscanf(fp, "%lld", &period) != 1) period = 0;
+				fclose(fp);
+			}
+		}
+	}
+	if ((quota <= 0) || (period <= 0)) {
+		return 0;
+	}
+	// Round up; a quota of 1.5 CPUs can keep two threads reasonably busy
+	return (unsigned int) ((quota + period - 1) / period);
+}
+#endif
+
+unsigned int pcdThreadPool::getAvailableCPUs()
+{
+	unsigned int cpus = 1;
+#if defined(mNoPThreads)
+	cpus = 1;
+#elif defined(_MSC_VER)
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	cpus = (unsigned int) info.dwNumberOfProcessors;
+#else
+	long online = sysconf(_SC_NPROCESSORS_ONLN);
+	cpus = online > 0 ? (unsigned int) online : 1;
+#ifdef __linux__
+	cpu_set_t cpuSet;
+	CPU_ZERO(&cpuSet);
+	if (sched_getaffinity(0, sizeof(cpuSet), &cpuSet) == 0) {
+		int affinity = CPU_COUNT(&cpuSet);
+		if ((affinity > 0) && ((unsigned int) affinity < cpus)) {
+			cpus = (unsigned int) affinity;
+		}
+	}
+	unsigned int limit = cgroupCPULimit();
+	if ((limit > 0) && (limit < cpus)) {
+		cpus = limit;
+	}
+#endif
+#endif
+	return cpus < 1 ? 1 : cpus;
+}
+
+//////////////////////////////////////////////////////////////
+//
+// Interpolation routines 
+//
+//////////////////////////////////////////////////////////////
+#define pcdMin(x,y) (((x) < (y)) ? x : y)
+#define pcdMax(x,y) (((x) < (y)) ? y : x)
+#define pcdPin(low, x, high) (((x) < (low)) ? (low) : (((x) > (high)) ? (high) : (x)))
+
+// Data structure to be passed to each thread - effectively a tile description
+struct upResInterpolateData {
+	uint8_t *base;
+	uint8_t *dest;
+	uint8_t *luma;
+	unsigned int width;
+	unsigned int height;
+	bool hasDeltas;
+	unsigned int startRow;
+	unsigned int endRow;
+	struct pcdProgress *progress;					// NULL, other than for postParse
+};
+
+//////////////////////////////////////////////////////////////
+//
+// basic "Kodak standard" bilinear upres interpolator
+//
+//////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////
+//
+// basic "Kodak standard" bilinear upres interpolator
+//
+//////////////////////////////////////////////////////////////
+pcdThreadFunction upResInterpolate(void *t)
+{
+	struct upResInterpolateData *rd = (struct upResInterpolateData *) t;
+	unsigned int row, column; 
+	ptrdiff_t indexDelta;
+	int sum;
+	int8_t *deltaBase = (int8_t *) rd->dest;
+	
+	// This is as intended by Kodak - linear interpolation
+	uint8_t *basePix, *basePix01, *basePix10, *basePix11;
+	unsigned int rowPlus, columnPlus;
+	if (pcdProgressCancelled(rd->progress)) {
+		return NULL;
+	}
+	for (row = rd->startRow>>1; row < rd->endRow>>1; row++) {
+		for (column = 0; column < rd->width>>1; column++) {
+			// When upresing, the factor is always two
+			// Note here we're iterating in rd->base coordinates
+			columnPlus = pcdMin(column + 1, (rd->width>>1)-1);
+			rowPlus = pcdMin(row + 1, (rd->height>>1)-1);
+			basePix = rd->base + column + row * (rd->width>>1);
+			basePix01 = rd->base + columnPlus + row * (rd->width>>1);					
+			basePix10 = rd->base + column + rowPlus * (rd->width>>1);		
+			basePix11 = rd->base + columnPlus + rowPlus * (rd->width>>1);	
+			
+			// base Pixel
+			indexDelta = (column<<1) + (row<<1) * rd->width;
+			sum = (int) (*basePix);
+			if (rd->hasDeltas) sum += (int) (*(deltaBase + indexDelta));
+			sum = sum < 0 ? 0 : (sum > 255 ? 255 : sum);
+			*(rd->dest + indexDelta) = (uint8_t) sum;
+			
+			// 01 Pixel
+			indexDelta = (column<<1) + 1 + (row<<1) * rd->width;
+			sum = ((int) (*basePix) + (int) (*basePix01) + 1) >> 1;
+			if (rd->hasDeltas) sum += (int) (*(deltaBase + indexDelta));
+			sum = sum < 0 ? 0 : (sum > 255 ? 255 : sum);
+			*(rd->dest + indexDelta) = (uint8_t) sum;
+			
+			// 10 Pixel		
+			indexDelta = (column<<1) + ((row<<1) + 1) * rd->width;
+			sum = ((int) (*basePix) + (int) (*basePix10) + 1) >> 1;
+			if (rd->hasDeltas) sum += (int) (*(deltaBase + indexDelta));
+			sum = sum < 0 ? 0 : (sum > 255 ? 255 : sum);
+			*(rd->dest + indexDelta) = (uint8_t) sum;
+			
+			// 11 Pixel
+			indexDelta = (column<<1) + 1 + ((row<<1) + 1) * rd->width;
+#ifdef UseFourPixels
+			sum = ((int) (*basePix) + (int) (*basePix01) + (int) (*basePix10) + (int) (*basePix11) + 2) >> 2;
+#else
+			sum = ((int) (*basePix) + (int) (*basePix11) + 1) >> 1;
+#endif
+			if (rd->hasDeltas) sum += (int) (*(deltaBase + indexDelta));
+			sum = sum < 0 ? 0 : (sum > 255 ? 255 : sum);
+			*(rd->dest + indexDelta) = (uint8_t) sum;
+			
+		}
+	}			
+	pcdAddProgress(rd->progress, rd->endRow - rd->startRow, 0);
+	return NULL;
+}
+
+//////////////////////////////////////////////////////////////
+//
+// nearest neighbour upres
+//
+//////////////////////////////////////////////////////////////
+pcdThreadFunction upResNearest(void *t)
+{
+	struct upResInterpolateData *rd = (struct upResInterpolateData *) t;
+	unsigned int row, column;
+	ptrdiff_t indexBase, indexDelta;
+	int sum;
+	int8_t *deltaBase = (int8_t *) rd->dest;
+	if (pcdProgressCancelled(rd->progress)) {
+		return NULL;
+	}
+	for (row = rd->startRow; row < rd->endRow; row++) {
+		for (column = 0; column < rd->width; column++) {
+			// When upresing, the factor is always two
+			indexBase = (column >> 1) + (row >> 1) * (rd->width>>1);
+			indexDelta = column + row * rd->width;
+			sum = ((int) *(rd->base + indexBase));
+			if (rd->hasDeltas) {
+				sum += ((int) *(deltaBase + indexDelta));
+				sum = sum < 0 ? 0 : (sum > 255 ? 255 : sum);
+			}
+			
+			*(rd->dest + indexDelta) = (uint8_t) sum;
+		}
+	}
+	pcdAddProgress(rd->progress, rd->endRow - rd->startRow, 0);
+	return NULL;
+}
+
+#ifdef mUseNonGPLCode
+#include "PCDLumaInterpolate.hpp"
+#endif
+
+
+// Splits the rows of a plane into tiles for the pool.
+// If there is only one tile (or no memory for more), single is used
+static size_t setUpResTiles(struct upResInterpolateData **rdp, struct upResInterpolateData *single, pcdExecutor *executor, uint8_t *base, uint8_t *dest, uint8_t *luma, unsigned int width, unsigned int height, bool hasDeltas)
+{
+	size_t numTiles = pcdNumTiles(executor, width, height);
+	size_t tile;
+	unsigned int previousRow = 0;
+	struct upResInterpolateData *rd = NULL;
+	if (numTiles > 1) {
+		rd = (struct upResInterpolateData *) malloc(numTiles * sizeof(struct upResInterpolateData));
+	}
+	if (rd == NULL) {
+		rd = single;
+		numTiles = 1;
+	}
+	for (tile = 0; tile < numTiles; tile++) {
+		rd[tile].base = base;
+		rd[tile].dest = dest;
+		rd[tile].luma = luma;
+		rd[tile].width = width;
+		rd[tile].height = height;
+		rd[tile].hasDeltas = hasDeltas;
+		rd[tile].startRow = previousRow;
+		rd[tile].endRow = (unsigned int) pcdTileEndRow(tile, numTiles, height);
+		rd[tile].progress = NULL;
+		previousRow = rd[tile].endRow;
+	}
+	*rdp = rd;
+	return numTiles;
+}
+
+void upResBuffer(uint8_t *base, uint8_t *dest, uint8_t *luma, unsigned int width, unsigned int height, int upResMethod, bool hasDeltas, pcdExecutor *executor)
+{
+#ifdef mUseNonGPLCode
+	unsigned int row, column;
+#endif
+	size_t numTiles;
+	struct upResInterpolateData *rd, single;
+#ifdef __PerformanceAnalysis
+#ifdef qMacOS
+	AbsoluteTime nowTime, bgnTime;
+    bgnTime = UpTime();
+#endif
+#endif
+	
+	if (dest != NULL) {
+#ifdef mUseNonGPLCode
+		if ((upResMethod >= kUpResLumaIterpolate) && !hasDeltas && (luma != NULL)) {
+
+			// This does a homogeniety minimisation routine.
+			// We should only ever(!) use this for chroma interpolation
+			numTiles = setUpResTiles(&rd, &single, executor, base, dest, luma, width, height, hasDeltas);
+			pcdRunTasks(executor, upResLumaInterpolatePassI, rd, sizeof(struct upResInterpolateData), numTiles);
+			
+			// For this algorithm, the easist thing is to prep the last rows and columns separately.....
+			for (row = height-1; row < height; row++) {
+				for (column = 0; column < width; column++) {
+					*(dest + column + row * (width)) = *(base + (column>>1) + (row>>1) * (width>>1));
+				}
+			}
+			for (row = 0; row < height; row++) {
+				for (column = column-1; column < width; column++) {
+					*(dest + column + row * (width)) = *(base + (column>>1) + (row>>1) * (width>>1));
+				}
+			}
+			
+			pcdRunTasks(executor, upResLumaInterpolatePassII, rd, sizeof(struct upResInterpolateData), numTiles);
+			if (rd != &single) free(rd);
+#ifdef __PerformanceAnalysis
+#ifdef qMacOS
+			nowTime = UpTime();
+			float uSec  = HowLong(nowTime, bgnTime);
+			fprintf(stderr, " upResInterpolate: %.3f usec \n", uSec);
+#endif
+#endif
+		}
+		else
+#endif
+		if (upResMethod >= kUpResIterpolate) {
+			numTiles = setUpResTiles(&rd, &single, executor, base, dest, luma, width, height, hasDeltas);
+			pcdRunTasks(executor, upResInterpolate, rd, sizeof(struct upResInterpolateData), numTiles);
+			if (rd != &single) free(rd);
 #ifdef __PerformanceAnalysis
 #ifdef qMacOS
 			nowTime = UpTime();
@@ -2143,21 +3371,9 @@ void upResBuffer(uint8_t *base, uint8_t *dest, uint8_t *luma, unsigned int width
 		else {
 			// Here we do a very simple minded nearest neighbour look up; 
 			// Shouldn't be used for any serious purpose.
-			int8_t *deltaBase = (int8_t *) dest;
-			for (row = 0; row < height; row++) {
-				for (column = 0; column < width; column++) {
-					// When upresing, the factor is always two
-					indexBase = (column >> 1) + (row >> 1) * (width>>1);
-					indexDelta = column + row * width;
-					sum = ((int) *(base + indexBase));
-					if (hasDeltas) {
-						sum += ((int) *(deltaBase + indexDelta));
-						sum = sum < 0 ? 0 : (sum > 255 ? 255 : sum);
-					}
-
-					*(dest + indexDelta) = (uint8_t) sum;
-				}
-			}
+			numTiles = setUpResTiles(&rd, &single, executor, base, dest, luma, width, height, hasDeltas);
+			pcdRunTasks(executor, upResNearest, rd, sizeof(struct upResInterpolateData), numTiles);
+			if (rd != &single) free(rd);
 		}
 		// Now the new base is in the old dest....
 	}
@@ -2222,163 +3438,707 @@ void genTestBaseImage(int sceneNumber, uint8_t *luma, uint8_t *chroma1, uint8_t
 				}
 			}
 		}
-	}	
+	}	
+}
+
+#endif
+
+//////////////////////////////////////////////////////////////
+//
+// RGB conversion
+//
+//////////////////////////////////////////////////////////////
+
+// Destination of YCbCr output
+struct pcdYCbCrPlanes {
+	uint8_t *y;
+	uint8_t *cb;
+	uint8_t *cr;
+	size_t yRowBytes;
+	size_t chromaRowBytes;
+	int chromaD;
+};
+
+// Data structure to be passed to each thread - effectively a tile description
+struct ConvertToRGBData {
+	const struct pcdOutputDescriptor *outputs;
+	unsigned int numOutputs;
+	bool needStage[4];								// Stages that at least one output uses
+	const struct pcdYCbCrPlanes *planes;			// Set for YCbCr output, instead of outputs
+	bool interpolateChroma;							// Chroma is as stored, and is interpolated per pixel
+	int planeStage;									// The stage that YCbCr is made from
+	size_t startRow;
+	size_t endRow;
+	size_t startColumn;
+	size_t endColumn;
+	size_t columns;
+	size_t rows;
+	size_t firstRow;								// First output row that the buffers hold
+	size_t outputWidth;
+	uint8_t *lp;
+	uint8_t *c1p;
+	uint8_t *c2p;
+	unsigned int resFactor;
+	unsigned int imageRotate;
+	int whiteBalance;
+	struct pcdProgress *progress;
+	size_t progressRows;							// This tile's share of the output rows
+	const struct pcdOutputCurve *curve;				// NULL for none
+};
+
+
+//////////////////////////////////////////////////////////////
+//
+// The Micro CMM
+//
+//////////////////////////////////////////////////////////////
+// 
+// Normally, what we would do is to define a Photo CD color space, then
+// hand that together with the data to a Color Management Module - e.g., 
+// LittleCMS - and let it deal with all the nasty complex color space conversions.
+// However, to keep this as standalone as possible, what is implemented here is 
+// a "micro CMM", in the shape of a few LUTs and one matrix conversion. It does 
+// everything that a full CMM would do.....admittedly, only for the limited 
+// Photo CD to linear light to sRGB conversions that we need. And all in integer 
+// math. And multi-threaded.
+//
+enum ConvertStages {
+	kStageYCC = 0,
+	kStageRaw,
+	kStageLinear,
+	kStagesRGB
+};
+
+// Which stage each color space is delivered from
+static int convertStage(int colorSpace)
+{
+	switch (colorSpace) {
+		case kPCDYCCColorSpace:
+			return kStageYCC;
+		case kPCDLinearCCIR709ColorSpace:
+			return kStageLinear;
+		case kPCDsRGBColorSpace:
+			return kStagesRGB;
+		default:
+			return kStageRaw;
+	}
+}
+
+// Works out where each channel of an output starts, and the distance in bytes
+// between its pixels and its rows
+static bool outputChannels(const struct pcdOutputDescriptor *out, size_t width, uint8_t *channels[4], ptrdiff_t *pixelBytes, ptrdiff_t *rowBytes)
+{
+	static const ptrdiff_t channelBytes[] = {1, 2, 4, 2, 4};	// Indexed by PCDOutputDataSize
+	ptrdiff_t size = ((out->dataSize >= pcdByteSize) && (out->dataSize <= pcdPacked10Size)) ? channelBytes[out->dataSize] : 1;
+	uint8_t *base = (uint8_t *) out->red;
+	
+	switch (out->layout) {
+		case kPCDRGBALayout:
+		case kPCDRGBXLayout:
+			channels[0] = base;
+			channels[1] = base + size;
+			channels[2] = base + 2*size;
+			channels[3] = (out->layout == kPCDRGBALayout) ? base + 3*size : NULL;
+			*pixelBytes = 4*size;
+			break;
+		case kPCDBGRALayout:
+		case kPCDBGRXLayout:
+			channels[0] = base + 2*size;
+			channels[1] = base + size;
+			channels[2] = base;
+			channels[3] = (out->layout == kPCDBGRALayout) ? base + 3*size : NULL;
+			*pixelBytes = 4*size;
+			break;
+		case kPCDGrayLayout:
+			if (out->dataSize == pcdPacked10Size) return false;
+			channels[0] = channels[1] = channels[2] = base;
+			channels[3] = (uint8_t *) out->alpha;
+			*pixelBytes = out->d*size;
+			break;
+		default:
+			channels[0] = base;
+			channels[1] = (uint8_t *) out->green;
+			channels[2] = (uint8_t *) out->blue;
+			channels[3] = (uint8_t *) out->alpha;
+			*pixelBytes = out->d*size;
+			break;
+	}
+	if (out->dataSize == pcdPacked10Size) {
+		// All the channels are in the one word
+		channels[0] = channels[1] = channels[2] = base;
+		*pixelBytes = size;
+	}
+	*rowBytes = (out->rowBytes != 0) ? (ptrdiff_t) out->rowBytes : ((ptrdiff_t) width)*(*pixelBytes);
+	return (channels[0] != NULL) && (channels[1] != NULL) && (channels[2] != NULL);
+}
+
+// A run of chroma along one row, linearly interpolated from chroma stored at half
+// the luma resolution; this gives the same result as upResInterpolate
+static void interpolateChromaRun(const uint8_t *c, size_t row, size_t runStart, size_t runLength, 
+								 size_t rows, size_t columns, uint8_t *run)
+{
+	size_t width = columns >> 1;
+	const uint8_t *line = c + (row >> 1) * width;
+	const uint8_t *nextLine = c + pcdMin((row >> 1) + 1, (rows >> 1) - 1) * width;
+	size_t i, column, baseColumn, columnPlus;
+	
+	for (i = 0; i < runLength; i++) {
+		column = runStart + i;
+		baseColumn = column >> 1;
+		if ((row & 0x1) == 0) {
+			if ((column & 0x1) == 0) {
+				run[i] = line[baseColumn];
+			}
+			else {
+				columnPlus = pcdMin(baseColumn + 1, width - 1);
+				run[i] = (line[baseColumn] + line[columnPlus] + 1) >> 1;
+			}
+		}
+		else if ((column & 0x1) == 0) {
+			run[i] = (line[baseColumn] + nextLine[baseColumn] + 1) >> 1;
+		}
+		else {
+			columnPlus = pcdMin(baseColumn + 1, width - 1);
+#ifdef UseFourPixels
+			run[i] = (line[baseColumn] + line[columnPlus] + nextLine[baseColumn] + nextLine[columnPlus] + 2) >> 2;
+#else
+			run[i] = (line[baseColumn] + nextLine[columnPlus] + 1) >> 1;
+#endif
+		}
+	}
+}
+
+// Converts runLength pixels of a row, starting at runStart, into each of the stages
+// that rd asks for
+static void convertRun(struct ConvertToRGBData *rd, size_t row, size_t runStart, size_t runLength, uint16_t stage[4][3][kConvertRun])
+{
+	size_t col, i;
+	int32_t Li = 0, C1i = 0, C2i = 0, ri = 0, gi = 0, bi = 0;
+	int32_t rt = 0, gt = 0, bt = 0;
+	ptrdiff_t chromaIndex = 0, lumaIndex = 0;
+	int c1 = 0, c2 = 0;
+	uint8_t c1Run[kConvertRun], c2Run[kConvertRun];
+	
+	if (rd->interpolateChroma && (rd->c1p != NULL)) {
+		interpolateChromaRun(rd->c1p, row, runStart, runLength, rd->rows, rd->columns, c1Run);
+		interpolateChromaRun(rd->c2p, row, runStart, runLength, rd->rows, rd->columns, c2Run);
+	}
+	for (i = 0; i < runLength; i++) {
+		col = runStart + i;
+		lumaIndex = col + row * rd->columns;
+		chromaIndex = (col>>rd->resFactor) + (row >> rd->resFactor) * (rd->columns >> rd->resFactor);
+		if (rd->c1p != NULL) {
+			c1 = rd->interpolateChroma ? c1Run[i] : (rd->c1p)[chromaIndex];
+			c2 = rd->interpolateChroma ? c2Run[i] : (rd->c2p)[chromaIndex];
+		}
+		
+		if (rd->needStage[kStageYCC]) {
+			// Here we want the original YCC color space
+			stage[kStageYCC][0][i] = pcdPin(0, (((int32_t) *(rd->lp + lumaIndex))<<10)/188, 1388);
+			// Monochrome has no chroma planes, so use the neutral values (as the RGB case does)
+			stage[kStageYCC][1][i] = pcdPin(0, (((int32_t) (rd->c1p != NULL ? c1 : 156))<<10)/188, 1388);
+			stage[kStageYCC][2][i] = pcdPin(0, (((int32_t) (rd->c2p != NULL ? c2 : 137))<<10)/188, 1388);
+		}
+		if (!rd->needStage[kStageRaw]) {
+			continue;
+		}
+		// here one or the other of the RGB color spaces
+		Li = *(rd->lp + lumaIndex) * 5573;								// Range 0 - 1,421,115
+		if (rd->c1p != NULL) {
+			C1i = (((int32_t) c1) - 156) * 9085;						// -1,417,260 to 899,415
+		}
+		if (rd->c2p != NULL) {
+			C2i = (((int32_t) c2) - 137) * 7461;						// -1,022,157 to 880,398
+		}
+		ri = pcdPin(0, (Li + C2i) >> 10, 1388);							// 0 - 1388
+		gi = pcdPin(0, (Li>>10) - C1i/5278 - C2i/2012, 1388);			// 0 - 1388
+		bi = pcdPin(0, (Li + C1i) >> 10, 1388);							// 0 - 1388
+		stage[kStageRaw][0][i] = ri;
+		stage[kStageRaw][1][i] = gi;
+		stage[kStageRaw][2][i] = bi;
+	
+		// Here we have RGB in the original photo CD color space. So we can either 
+		// (a) pass that back raw, or
+		// (b) convert to a CCIR709 linear light space, or
+		// (c) convert to a sRGB space
+		// and (c) is made from (b)
+		if (rd->needStage[kStageLinear]) {
+			ri = toLinearLight[ri];
+			gi = toLinearLight[gi];
+			bi = toLinearLight[bi];
+			// We only do whitebalance conversions for the processed spaces, not raw.....
+			if (rd->whiteBalance == kPCDD50White) {
+				// This implements the equivalent of:
+				//	r = (0.9555f*r-0.0231f*g+0.0633f*b)/1.32;
+				//	g = (-0.0283f*r+1.0100f*g+0.0211*b)/1.32;
+				//	p = (0.0123f*r-0.0206f*g+1.3303f*b)/1.32;
+				rt = ri;
+				gt = gi;
+				bt = bi;
+				ri = (5930*rt - 143*gt + 393*bt)>>13;
+				gi = (-176*rt + 6268*gt + 131*bt)>>13;
+				bi = (76*rt - 128*gt + 8256*bt)>>13;
+			}
+			ri = pcdPin(0, ri, 1388);
+			gi = pcdPin(0, gi, 1388);
+			bi = pcdPin(0, bi, 1388);
+			stage[kStageLinear][0][i] = ri;
+			stage[kStageLinear][1][i] = gi;
+			stage[kStageLinear][2][i] = bi;
+		}
+		if (rd->needStage[kStagesRGB]) {
+			// Recompress
+			stage[kStagesRGB][0][i] = CCIR709tosRGB[ri];
+			stage[kStagesRGB][1][i] = CCIR709tosRGB[gi];
+			stage[kStagesRGB][2][i] = CCIR709tosRGB[bi];
+		}
+	}
+}
+
+// The output tables with a setOutputCurve curve composed in; used in place of the
+// static tables for every stage but YCC
+struct pcdOutputCurve {
+	uint8_t uint8Table[numLUTItems];
+	uint16_t uint16Table[numLUTItems];
+	float floatTable[numLUTItems];
+	uint16_t halfTable[numLUTItems];
+	uint16_t uint10Table[numLUTItems];
+};
+
+// Output tables for an output in the given stage
+struct pcdOutputTables {
+	const uint8_t *uint8Table;
+	const uint16_t *uint16Table;
+	const float *floatTable;
+	const uint16_t *halfTable;
+	const uint16_t *uint10Table;
+};
+
+static void pcdGetOutputTables(const struct pcdOutputCurve *curve, int stage, struct pcdOutputTables *tables)
+{
+	bool curved = (curve != NULL) && (stage != kStageYCC);
+	tables->uint8Table = curved ? curve->uint8Table : uint8Output;
+	tables->uint16Table = curved ? curve->uint16Table : uint16Output;
+	tables->floatTable = curved ? curve->floatTable : floatOutput;
+	tables->halfTable = curved ? curve->halfTable : halfOutput;
+	tables->uint10Table = curved ? curve->uint10Table : uint10Output;
+}
+
+// The curve at value, linearly interpolated between its points, and held at its 
+// end values outside 0.0 to 1.0
+static float pcdCurveValue(const float *curve, size_t numPoints, float value)
+{
+	float position;
+	size_t point;
+	if (value <= 0.0f) return curve[0];
+	if (value >= 1.0f) return curve[numPoints - 1];
+	position = value * (float) (numPoints - 1);
+	point = pcdMin((size_t) position, numPoints - 2);
+	return curve[point] + (curve[point + 1] - curve[point]) * (position - (float) point);
+}
+
+// IEEE half from float, rounding to nearest
+static uint16_t pcdFloatToHalf(float value)
+{
+	union {
+		float f;
+		uint32_t u;
+	} bits;
+	uint32_t sign, mantissa;
+	int32_t exponent, shift;
+	bits.f = value;
+	sign = (bits.u >> 16) & 0x8000;
+	exponent = (int32_t) ((bits.u >> 23) & 0xff) - 127 + 15;
+	mantissa = bits.u & 0x7fffff;
+	if (exponent >= 31) {
+		// Too big (or not a number); infinity
+		return (uint16_t) (sign | 0x7c00);
+	}
+	if (exponent <= 0) {
+		// Denormal, or too small to be anything but zero
+		if (exponent < -10) return (uint16_t) sign;
+		mantissa |= 0x800000;
+		shift = 14 - exponent;
+		return (uint16_t) (sign | ((mantissa + (1 << (shift - 1))) >> shift));
+	}
+	// A carry out of the mantissa correctly bumps the exponent
+	return (uint16_t) (sign | ((((uint32_t) exponent << 10) + ((mantissa + 0x1000) >> 13))));
+}
+
+// Where a pixel of the stored image lands in the (rotated) output, and how far
+// the output moves for each step along the stored row
+static void outputPosition(struct ConvertToRGBData *rd, size_t row, size_t column, 
+						   ptrdiff_t *outRow, ptrdiff_t *outColumn, ptrdiff_t *rowStep, ptrdiff_t *columnStep)
+{
+	switch (rd->imageRotate) {
+		case 1:
+			*outRow = rd->columns - 1 - column;
+			*outColumn = row;
+			*rowStep = -1;
+			*columnStep = 0;
+			break;
+		case 2:					
+			*outRow = rd->rows - 1 - row;
+			*outColumn = rd->columns - 1 - column;
+			*rowStep = 0;
+			*columnStep = -1;
+			break;
+		case 3:
+			*outRow = column;
+			*outColumn = rd->rows - 1 - row;
+			*rowStep = 1;
+			*columnStep = 0;
+			break;
+		default:
+			*outRow = row;
+			*outColumn = column;
+			*rowStep = 0;
+			*columnStep = 1;
+			break;
+	}
+}
+
+pcdThreadFunction convertToRGB(void *t)
+{
+	struct ConvertToRGBData *rd = (struct ConvertToRGBData *) t;
+	const struct pcdOutputDescriptor *out;
+	unsigned int output;
+	size_t row = 0;
+	size_t runStart, runLength, i;
+	ptrdiff_t dest;
+	ptrdiff_t outRow, outColumn, rowStep, columnStep, pixelBytes, rowBytes, step;
+	// Every stage holds values in the range 0 - 1388
+	uint16_t stage[4][3][kConvertRun], gray[kConvertRun];
+	const uint16_t *r, *g, *b, *low = NULL, *high = NULL;
+	uint8_t *channels[4], *red, *green, *blue, *alpha;
+	uint32_t packedAlpha = 0;
+	bool bgr;
+	struct pcdOutputTables tables;
+	
+	if (pcdProgressCancelled(rd->progress)) {
+		return NULL;
+	}
+	for (row = rd->startRow; row != rd->endRow; row++) {
+		for (runStart = rd->startColumn; runStart < rd->endColumn; runStart += runLength) {
+			runLength = pcdMin(rd->endColumn - runStart, (size_t) kConvertRun);
+			convertRun(rd, row, runStart, runLength, stage);
+			outputPosition(rd, row, runStart, &outRow, &outColumn, &rowStep, &columnStep);
+			outRow -= rd->firstRow;
+			
+			// Deliver back in the right formats
+			for (output = 0; output < rd->numOutputs; output++) {
+				out = rd->outputs + output;
+				r = stage[convertStage(out->colorSpace)][0];
+				g = stage[convertStage(out->colorSpace)][1];
+				b = stage[convertStage(out->colorSpace)][2];
+				pcdGetOutputTables(rd->curve, convertStage(out->colorSpace), &tables);
+				if (!outputChannels(out, rd->outputWidth, channels, &pixelBytes, &rowBytes)) {
+					continue;
+				}
+				if (out->dataSize == pcdPacked10Size) {
+					bgr = (out->layout == kPCDBGRALayout) || (out->layout == kPCDBGRXLayout);
+					low = bgr ? b : r;
+					high = bgr ? r : b;
+					packedAlpha = ((out->layout == kPCDRGBXLayout) || (out->layout == kPCDBGRXLayout)) ? 0x0 : 0xc0000000;
+				}
+				dest = outRow*rowBytes + outColumn*pixelBytes;
+				step = rowStep*rowBytes + columnStep*pixelBytes;
+				red = channels[0];
+				green = channels[1];
+				blue = channels[2];
+				alpha = channels[3];
+				if (out->layout == kPCDGrayLayout) {
+					if (convertStage(out->colorSpace) == kStageYCC) {
+						// Y is already luminance
+						memcpy(gray, r, runLength*sizeof(uint16_t));
+					}
+					else {
+						// The BT.601 weights, scaled by 2^16; they sum to 1, so equal
+						// channels pass through unchanged
+						for (i = 0; i < runLength; i++) {
+							gray[i] = (uint16_t) ((19595*r[i] + 38470*g[i] + 7471*b[i] + 32768) >> 16);
+						}
+					}
+					switch (out->dataSize) {
+						case pcdFloatSize:
+							for (i = 0; i < runLength; i++, dest += step) {
+								*((float *) (red + dest)) = tables.floatTable[gray[i]];
+								if (alpha != NULL) *((float *) (alpha + dest)) = 1.0f;
+							}
+							break;
+						case pcdInt16Size:
+							for (i = 0; i < runLength; i++, dest += step) {
+								*((uint16_t *) (red + dest)) = tables.uint16Table[gray[i]];
+								if (alpha != NULL) *((uint16_t *) (alpha + dest)) = 0xffff;
+							}
+							break;
+						case pcdHalfSize:
+							for (i = 0; i < runLength; i++, dest += step) {
+								*((uint16_t *) (red + dest)) = tables.halfTable[gray[i]];
+								if (alpha != NULL) *((uint16_t *) (alpha + dest)) = 0x3c00;
+							}
+							break;
+						default:
+							for (i = 0; i < runLength; i++, dest += step) {
+								red[dest] = tables.uint8Table[gray[i]];
+								if (alpha != NULL) alpha[dest] = 0xff;
+							}
+							break;
+					}
+					continue;
+				}
+				switch (out->dataSize) {
+					case pcdFloatSize:
+						for (i = 0; i < runLength; i++, dest += step) {
+							*((float *) (red + dest)) = tables.floatTable[r[i]];
+							*((float *) (green + dest)) = tables.floatTable[g[i]];
+							*((float *) (blue + dest)) = tables.floatTable[b[i]];
+							if (alpha != NULL) *((float *) (alpha + dest)) = 1.0f;
+						}
+						break;
+					case pcdInt16Size:
+						for (i = 0; i < runLength; i++, dest += step) {
+							*((uint16_t *) (red + dest)) = tables.uint16Table[r[i]];
+							*((uint16_t *) (green + dest)) = tables.uint16Table[g[i]];
+							*((uint16_t *) (blue + dest)) = tables.uint16Table[b[i]];
+							if (alpha != NULL) *((uint16_t *) (alpha + dest)) = 0xffff;
+						}
+						break;
+					case pcdHalfSize:
+						for (i = 0; i < runLength; i++, dest += step) {
+							*((uint16_t *) (red + dest)) = tables.halfTable[r[i]];
+							*((uint16_t *) (green + dest)) = tables.halfTable[g[i]];
+							*((uint16_t *) (blue + dest)) = tables.halfTable[b[i]];
+							if (alpha != NULL) *((uint16_t *) (alpha + dest)) = 0x3c00;		// 1.0
+						}
+						break;
+					case pcdPacked10Size:
+						for (i = 0; i < runLength; i++, dest += step) {
+							*((uint32_t *) (red + dest)) = packedAlpha | ((uint32_t) tables.uint10Table[high[i]] << 20) |
+								((uint32_t) tables.uint10Table[g[i]] << 10) | (uint32_t) tables.uint10Table[low[i]];
+						}
+						break;
+					default:
+						for (i = 0; i < runLength; i++, dest += step) {
+							red[dest] = tables.uint8Table[r[i]];
+							green[dest] = tables.uint8Table[g[i]];
+							blue[dest] = tables.uint8Table[b[i]];
+							if (alpha != NULL) alpha[dest] = 0xff;
+						}
+						break;
+				}
+			}
+		}
+	}
+	pcdAddProgress(rd->progress, rd->progressRows, 0);
+	return NULL;
+}
+
+
+// Sum of one channel of the 8-bit output over the 2x2 block starting at column i
+static int32_t blockSum(const uint8_t *table, uint16_t stage[2][4][3][kConvertRun], int st, int channel, size_t i)
+{
+	return table[stage[0][st][channel][i]] + table[stage[0][st][channel][i + 1]] + 
+		table[stage[1][st][channel][i]] + table[stage[1][st][channel][i + 1]];
+}
+
+// JFIF YCbCr with 4:2:0 chroma. Tiles always start on an even row, and Photo CD
+// images are always an even number of pixels in each direction, so the image is
+// converted in 2x2 blocks; each block's chroma is the average over its four pixels.
+// Where the file's chroma is at half resolution, it is interpolated a run at a time
+// by convertRun, so no full size chroma planes are needed.
+pcdThreadFunction convertToYCbCr(void *t)
+{
+	struct ConvertToRGBData *rd = (struct ConvertToRGBData *) t;
+	const struct pcdYCbCrPlanes *planes = rd->planes;
+	size_t row, runStart, runLength, i;
+	unsigned int pair;
+	int32_t r, g, b;
+	ptrdiff_t dest, step, outRow, outColumn, rowStep, columnStep;
+	uint16_t stage[2][4][3][kConvertRun];
+	struct pcdOutputTables tables;
+	
+	pcdGetOutputTables(rd->curve, rd->planeStage, &tables);
+	if (pcdProgressCancelled(rd->progress)) {
+		return NULL;
+	}
+	for (row = rd->startRow; row < rd->endRow; row += 2) {
+		for (runStart = rd->startColumn; runStart < rd->endColumn; runStart += runLength) {
+			runLength = pcdMin(rd->endColumn - runStart, (size_t) kConvertRun);
+			for (pair = 0; pair < 2; pair++) {
+				convertRun(rd, row + pair, runStart, runLength, stage[pair]);
+				outputPosition(rd, row + pair, runStart, &outRow, &outColumn, &rowStep, &columnStep);
+				dest = (outRow - (ptrdiff_t) rd->firstRow)*planes->yRowBytes + outColumn;
+				step = rowStep*planes->yRowBytes + columnStep;
+				for (i = 0; i < runLength; i++, dest += step) {
+					r = tables.uint8Table[stage[pair][rd->planeStage][0][i]];
+					g = tables.uint8Table[stage[pair][rd->planeStage][1][i]];
+					b = tables.uint8Table[stage[pair][rd->planeStage][2][i]];
+					planes->y[dest] = (uint8_t) ((19595*r + 38470*g + 7471*b + 32768) >> 16);
+				}
+			}
+			// The block position is that of its top left pixel (in stored image terms) 
+			// halved, whichever way the image is rotated
+			outputPosition(rd, row, runStart, &outRow, &outColumn, &rowStep, &columnStep);
+			for (i = 0; i < runLength; i += 2) {
+				r = blockSum(tables.uint8Table, stage, rd->planeStage, 0, i);
+				g = blockSum(tables.uint8Table, stage, rd->planeStage, 1, i);
+				b = blockSum(tables.uint8Table, stage, rd->planeStage, 2, i);
+				dest = (((outRow + (ptrdiff_t) i*rowStep) >> 1) - (ptrdiff_t) (rd->firstRow >> 1))*planes->chromaRowBytes + 
+					((outColumn + (ptrdiff_t) i*columnStep) >> 1)*planes->chromaD;
+				// The BT.601 coefficients, scaled by 2^16, applied to the sum of four pixels
+				planes->cb[dest] = (uint8_t) ((-11059*r - 21709*g + 32768*b + (128 << 18) + (1 << 17)) >> 18);
+				planes->cr[dest] = (uint8_t) ((32768*r - 27439*g - 5329*b + (128 << 18) + (1 << 17)) >> 18);
+			}
+		}
+	}
+	pcdAddProgress(rd->progress, rd->progressRows, 0);
+	return NULL;
 }
 
-#endif
 
 //////////////////////////////////////////////////////////////
 //
-// RGB conversion
+// Buffer cache 
 //
 //////////////////////////////////////////////////////////////
+// The image and residual planes and the Huffman tables are large, and a decoder
+// working through a batch of files needs the same sizes over and over. So rather
+// than being freed, they go back to a per-decoder cache, and the next allocation
+// takes the smallest cached buffer that is big enough; once the first file is done,
+// same-resolution files do no large allocations at all. Each buffer has a small
+// header in front of it holding its capacity, so buffers from the cache must always
+// be released to it, never freed directly. The buffers themselves come from the
+// decoder's pcdAllocator, if it has one; the header also records which allocator,
+// so a buffer always goes back to the one it came from.
+
+#define kBufferHeaderSize 16						// Keeps the buffers 16 byte aligned
+#define kMaxCachedBuffers 32
+#define kHugePageSize (2*1024*1024)
+
+struct pcdBufferHeader {
+	size_t capacity;
+	pcdAllocator *allocator;						// NULL for malloc
+};
 
-// Data structure to be passed to each thread - effectively a tile description
-struct ConvertToRGBData {
-	short outputSize;
-	void *red;
-	void *green;
-	void *blue;
-	void *alpha;
-	ptrdiff_t d;
-	size_t startRow;
-	size_t endRow;
-	size_t columns;
-	size_t rows;
-	uint8_t *lp;
-	uint8_t *c1p;
-	uint8_t *c2p;
-	unsigned int resFactor;
-	unsigned int imageRotate;
-	size_t colorSpace;
-	int whiteBalance;
+struct pcdBufferCache {
+	pcdMutex lock;									// The residual streams allocate in parallel
+	pcdAllocator *allocator;
+	uint8_t *buffers[kMaxCachedBuffers];			// Free buffers, as returned by pcdCacheAlloc
+	unsigned int numBuffers;
 };
 
+static struct pcdBufferHeader *pcdGetBufferHeader(uint8_t *buffer)
+{
+	return (struct pcdBufferHeader *) (buffer - kBufferHeaderSize);
+}
 
-//////////////////////////////////////////////////////////////
-//
-// The Micro CMM
-//
-//////////////////////////////////////////////////////////////
-// 
-// Normally, what we would do is to define a Photo CD color space, then
-// hand that together with the data to a Color Management Module - e.g., 
-// LittleCMS - and let it deal with all the nasty complex color space conversions.
-// However, to keep this as standalone as possible, what is implemented here is 
-// a "micro CMM", in the shape of a few LUTs and one matrix conversion. It does 
-// everything that a full CMM would do.....admittedly, only for the limited 
-// Photo CD to linear light to sRGB conversions that we need. And all in integer 
-// math. And multi-threaded.
-//
-pcdThreadFunction convertToRGB(void *t)
+static size_t pcdBufferCapacity(uint8_t *buffer)
 {
-	struct ConvertToRGBData *rd = (struct ConvertToRGBData *) t;
-	size_t row = 0;
-	size_t col = 0;
-	int32_t Li = 0, C1i = 0, C2i = 0, ri = 0, gi = 0, bi = 0;
-	int32_t rt = 0, gt = 0, bt = 0;
-	ptrdiff_t chromaIndex = 0, lumaIndex = 0, destIndex = 0;
+	return pcdGetBufferHeader(buffer)->capacity;
+}
+
+static void pcdFreeBuffer(uint8_t *buffer)
+{
+	struct pcdBufferHeader *header = pcdGetBufferHeader(buffer);
+	if (header->allocator != NULL) {
+		header->allocator->release(header, header->capacity + kBufferHeaderSize);
+	}
+	else {
+		free(header);
+	}
+}
+
+static void pcdCacheFlush(struct pcdBufferCache *cache)
+{
+	pcdMutexLock(cache->lock);
+	while (cache->numBuffers > 0) {
+		pcdFreeBuffer(cache->buffers[--cache->numBuffers]);
+	}
+	pcdMutexUnlock(cache->lock);
+}
+
+static void *pcdCacheAlloc(struct pcdBufferCache *cache, size_t size)
+{
+	unsigned int i, best = kMaxCachedBuffers;
+	uint8_t *buffer;
+	struct pcdBufferHeader *header;
 	
-	for (row = rd->startRow; row != rd->endRow; row++) {
-		for (col = 0; col != rd->columns; col++) {
-			switch (rd->imageRotate) {
-				case 0:
-					destIndex = (col + row*rd->columns)*rd->d;
-					break;
-				case 1:
-					destIndex = (row + (rd->columns - 1 - col)*rd->rows)*rd->d;
-					break;
-				case 2:					
-					destIndex = (rd->columns - 1 - col + (rd->rows - 1 - row)*rd->columns)*rd->d;
-					break;
-				case 3:
-					destIndex = (rd->rows - 1 - row + col*rd->rows)*rd->d;
-					break;
-				default:
-					destIndex = (col + row*rd->columns)*rd->d;
-					break;
-			}
-			lumaIndex = col + row * rd->columns;
-			chromaIndex = (col>>rd->resFactor) + (row >> rd->resFactor) * (rd->columns >> rd->resFactor);
-			
-			if (rd->colorSpace == kPCDYCCColorSpace) {
-				// Here we want the original YCC color space
-				ri = pcdPin(0, (((int32_t) *(rd->lp + lumaIndex))<<10)/188, 1388);
-				gi = pcdPin(0, (((int32_t) (rd->c1p)[chromaIndex])<<10)/188, 1388);
-				bi = pcdPin(0, (((int32_t) (rd->c2p)[chromaIndex])<<10)/188, 1388);
-			}
-			else {
-				// here one or the other of the RGB color spaces
-				Li = *(rd->lp + lumaIndex) * 5573;								// Range 0 - 1,421,115
-				if (rd->c1p != NULL) {
-					C1i = (((int32_t) (rd->c1p)[chromaIndex]) - 156) * 9085;	// -1,417,260 to 899,415
-				}
-				if (rd->c2p != NULL) {
-					C2i = (((int32_t) (rd->c2p)[chromaIndex]) - 137) * 7461;	// -1,022,157 to 880,398
-				}
-				ri = pcdPin(0, (Li + C2i) >> 10, 1388);							// 0 - 1388
-				gi = pcdPin(0, (Li>>10) - C1i/5278 - C2i/2012, 1388);			// 0 - 1388
-				bi = pcdPin(0, (Li + C1i) >> 10, 1388);							// 0 - 1388
-			
-				// Here we have RGB in the original photo CD color space. So we can either 
-				// (a) pass that back raw, or
-				// (b) convert to a CCIR709 linear light space, or
-				// (c) convert to a sRGB space
-				if ((rd->colorSpace == kPCDLinearCCIR709ColorSpace) || (rd->colorSpace == kPCDsRGBColorSpace)) {
-					ri = toLinearLight[ri];
-					gi = toLinearLight[gi];
-					bi = toLinearLight[bi];
-					// We only do whitebalance conversions for the processed spaces, not raw.....
-					if (rd->whiteBalance == kPCDD50White) {
-						// This implements the equivalent of:
-						//	r = (0.9555f*r-0.0231f*g+0.0633f*b)/1.32;
-						//	g = (-0.0283f*r+1.0100f*g+0.0211*b)/1.32;
-						//	p = (0.0123f*r-0.0206f*g+1.3303f*b)/1.32;
-						rt = ri;
-						gt = gi;
-						bt = bi;
-						ri = (5930*rt - 143*gt + 393*bt)>>13;
-						gi = (-176*rt + 6268*gt + 131*bt)>>13;
-						bi = (76*rt - 128*gt + 8256*bt)>>13;
-					}
-				}
-				if (rd->colorSpace == kPCDsRGBColorSpace) {
-					// Recompress and pin
-					ri = CCIR709tosRGB[pcdPin(0, ri, 1388)];
-					gi = CCIR709tosRGB[pcdPin(0, gi, 1388)];
-					bi = CCIR709tosRGB[pcdPin(0, bi, 1388)];
-				}
-				else {
-					// just pin
-					ri = pcdPin(0, ri, 1388);
-					gi = pcdPin(0, gi, 1388);
-					bi = pcdPin(0, bi, 1388);
-				}
-			}
-			// Deliver back in the right format
-			if (rd->outputSize == pcdFloatSize) {
-				*(((float *) rd->red) + destIndex) = floatOutput[ri];
-				*(((float *) rd->green) + destIndex) = floatOutput[gi];
-				*(((float *) rd->blue) + destIndex) = floatOutput[bi];
-				if (rd->alpha != NULL) *(((float *) rd->alpha) + destIndex) = 1.0f;
-			}
-			else if (rd->outputSize == pcdInt16Size) {
-				*(((uint16_t *) rd->red) + destIndex) = uint16Output[ri];
-				*(((uint16_t *) rd->green) + destIndex) = uint16Output[gi];
-				*(((uint16_t *) rd->blue) + destIndex) = uint16Output[bi];
-				if (rd->alpha != NULL) *(((uint16_t *) rd->alpha) + destIndex) = 0xffff;
-			}
-			else {
-				*(((uint8_t *) rd->red) + destIndex) = uint8Output[ri];
-				*(((uint8_t *) rd->green) + destIndex) = uint8Output[gi];
-				*(((uint8_t *) rd->blue) + destIndex) = uint8Output[bi];
-				if (rd->alpha != NULL) *(((uint8_t *) rd->alpha) + destIndex) = 0xff;					
-			}
+	pcdMutexLock(cache->lock);
+	for (i = 0; i < cache->numBuffers; i++) {
+		if ((pcdBufferCapacity(cache->buffers[i]) >= size) && 
+			((best == kMaxCachedBuffers) || (pcdBufferCapacity(cache->buffers[i]) < pcdBufferCapacity(cache->buffers[best])))) {
+			best = i;
+		}
+	}
+	if (best < kMaxCachedBuffers) {
+		buffer = cache->buffers[best];
+		cache->buffers[best] = cache->buffers[--cache->numBuffers];
+		pcdMutexUnlock(cache->lock);
+		return buffer;
+	}
+	pcdMutexUnlock(cache->lock);
+	
+	for (i = 0; i < 2; i++) {
+		if (cache->allocator != NULL) {
+			header = (struct pcdBufferHeader *) cache->allocator->allocate(size + kBufferHeaderSize);
 		}
+		else {
+			header = (struct pcdBufferHeader *) malloc(size + kBufferHeaderSize);
+		}
+		if (header != NULL) {
+			header->capacity = size;
+			header->allocator = cache->allocator;
+			return ((uint8_t *) header) + kBufferHeaderSize;
+		}
+		// Nothing cached was big enough, but together they may be in the way
+		pcdCacheFlush(cache);
 	}
 	return NULL;
 }
 
+static void pcdCacheRelease(struct pcdBufferCache *cache, void *buffer)
+{
+	if (buffer == NULL) return;
+	pcdMutexLock(cache->lock);
+	if ((cache->numBuffers < kMaxCachedBuffers) && (pcdGetBufferHeader((uint8_t *) buffer)->allocator == cache->allocator)) {
+		cache->buffers[cache->numBuffers++] = (uint8_t *) buffer;
+		buffer = NULL;
+	}
+	pcdMutexUnlock(cache->lock);
+	if (buffer != NULL) {
+		pcdFreeBuffer((uint8_t *) buffer);
+	}
+}
+
+pcdHugePageAllocator::pcdHugePageAllocator(size_t threshold)
+{
+	hugePageThreshold = threshold;
+}
+
+void *pcdHugePageAllocator::allocate(size_t size)
+{
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+	if (size >= hugePageThreshold) {
+		void *buffer = NULL;
+		size_t rounded = (size + kHugePageSize - 1) & ~((size_t) kHugePageSize - 1);
+		if (posix_memalign(&buffer, kHugePageSize, rounded) == 0) {
+			// Just advice; if the kernel has no huge pages to hand, these are ordinary pages
+			(void) madvise(buffer, rounded, MADV_HUGEPAGE);
+			return buffer;
+		}
+	}
+#endif
+	return malloc(size);
+}
+
+void pcdHugePageAllocator::release(void *buffer, size_t size)
+{
+	(void) size;
+	// posix_memalign memory goes back with free too
+	free(buffer);
+}
+
 
 //////////////////////////////////////////////////////////////
 //
@@ -2387,7 +4147,9 @@ pcdThreadFunction convertToRGB(void *t)
 //////////////////////////////////////////////////////////////
 
 
-int readBaseImage(FILE *fp, int sceneNumber, int ICDOffset[kMaxScenes], uint8_t **luma, uint8_t **chroma1, uint8_t **chroma2)
+// If lumaOnly, the chroma rows are skipped over, and the chroma planes are left NULL
+int readBaseImage(struct pcdBufferCache *cache, FILE *fp, int sceneNumber, int ICDOffset[kMaxScenes], 
+				  uint8_t **luma, uint8_t **chroma1, uint8_t **chroma2, bool lumaOnly)
 {
 	// Base image scene number......
 	sceneNumber = (sceneNumber > kBase) ? kBase : sceneNumber;
@@ -2396,11 +4158,11 @@ int readBaseImage(FILE *fp, int sceneNumber, int ICDOffset[kMaxScenes], uint8_t
 	while (!haveReadBase && (sceneNumber >= kBase16)) {
 		try {
 			size_t numBytes = PCDLumaWidth[sceneNumber]*PCDLumaHeight[sceneNumber]*sizeof(uint8_t)+1;
-			*luma=(uint8_t *) malloc(numBytes);
-			*chroma1=(uint8_t *) malloc(numBytes>>2);
-			*chroma2=(uint8_t *) malloc(numBytes>>2);
+			*luma=(uint8_t *) pcdCacheAlloc(cache, numBytes);
+			*chroma1 = lumaOnly ? NULL : (uint8_t *) pcdCacheAlloc(cache, numBytes>>2);
+			*chroma2 = lumaOnly ? NULL : (uint8_t *) pcdCacheAlloc(cache, numBytes>>2);
 			
-			if ((*luma == NULL) || (*chroma1 == NULL) || (*chroma2 ==  NULL)) {
+			if ((*luma == NULL) || (!lumaOnly && ((*chroma1 == NULL) || (*chroma2 ==  NULL)))) {
 				throw "Memory allocation error";
 			}
 			
@@ -2412,27 +4174,25 @@ int readBaseImage(FILE *fp, int sceneNumber, int ICDOffset[kMaxScenes], uint8_t
 			{
 				count += readBytes(fp, PCDLumaWidth[sceneNumber], *luma + y*2*PCDLumaWidth[sceneNumber]);
 				count += readBytes(fp, PCDLumaWidth[sceneNumber], *luma + (y*2 + 1)*PCDLumaWidth[sceneNumber]);
+				if (lumaOnly) {
+					fseek(fp, PCDChromaWidth[sceneNumber]*2, SEEK_CUR);
+					continue;
+				}
 				count += readBytes(fp, PCDChromaWidth[sceneNumber], *chroma1 + y*(PCDChromaWidth[sceneNumber]));
 				count += readBytes(fp, PCDChromaWidth[sceneNumber], *chroma2 + y*(PCDChromaWidth[sceneNumber]));
 			}
-			if (count != ((PCDLumaWidth[sceneNumber]*2 + PCDChromaWidth[sceneNumber]*2)*PCDChromaHeight[sceneNumber])) {
+			if (count != ((PCDLumaWidth[sceneNumber]*2 + (lumaOnly ? 0 : PCDChromaWidth[sceneNumber]*2))*PCDChromaHeight[sceneNumber])) {
 				throw "File ended unexpectedly";
 			}
 			haveReadBase = true;
 		}
 		catch (...) {
-			if ((*luma) != NULL) {
-				free (*luma);
-				*luma = NULL;
-			}
-			if ((*chroma1) != NULL) {
-				free (*chroma1);
-				*chroma1 = NULL;
-			}
-			if ((*chroma2) != NULL) {
-				free (*chroma2);
-				*chroma2 = NULL;
-			}
+			pcdCacheRelease(cache, *luma);
+			*luma = NULL;
+			pcdCacheRelease(cache, *chroma1);
+			*chroma1 = NULL;
+			pcdCacheRelease(cache, *chroma2);
+			*chroma2 = NULL;
 			sceneNumber--;
 		}
 	}
@@ -2460,6 +4220,27 @@ pcdDecode::pcdDecode(void)
 	colorSpace = kPCDRawColorSpace;			// Default for PCD
 	whiteBalance = kPCDD65White;			// Default for PCD
 	monochrome = false;
+	taskExecutor = NULL;
+	scanlineRow = 0;
+	upResC1 = NULL;
+	upResC2 = NULL;
+	upResValid = false;
+	retainScenes = false;
+	progressCallback = NULL;
+	progressContext = NULL;
+	cancelToken = NULL;
+	outputCurve = NULL;
+	inData = NULL;
+	inDataSize = 0;
+	bufferCache = new pcdBufferCache;
+	pcdMutexInit(bufferCache->lock);
+	bufferCache->allocator = NULL;
+	bufferCache->numBuffers = 0;
+	for (i = 0; i < kMaxScenes; i++) {
+		for (j = 0; j < 3; j++) {
+			retainedPlanes[i][j] = NULL;
+		}
+	}
 	// Next line only used if we aren't using static LUTs
 //	 populateLUTs();
 }
@@ -2467,22 +4248,48 @@ pcdDecode::pcdDecode(void)
 pcdDecode::~pcdDecode()
 {
 	pcdFreeAll();
+	pcdCacheFlush(bufferCache);
+	pcdMutexDestroy(bufferCache->lock);
+	delete bufferCache;
+	if (outputCurve != NULL) free(outputCurve);
+}
+
+void pcdDecode::releaseCachedBuffers()
+{
+	pcdCacheFlush(bufferCache);
+}
+
+void pcdDecode::setAllocator(pcdAllocator *value)
+{
+	// Cached buffers are from the old allocator; anything in use goes back to it 
+	// when released, as the buffer header records where it came from
+	pcdCacheFlush(bufferCache);
+	pcdMutexLock(bufferCache->lock);
+	bufferCache->allocator = value;
+	pcdMutexUnlock(bufferCache->lock);
 }
 
 void pcdDecode::pcdFreeAll(void)
 {
-	if (luma != NULL) free(luma);
+	unsigned int scene;
+	rewindScanlines();
+	freeUpResChroma();
+	for (scene = 0; scene < kMaxScenes; scene++) {
+		freeRetainedScene(scene);
+	}
+	// Everything goes back to the cache for the next file
+	pcdCacheRelease(bufferCache, luma);
 	luma = NULL;
-	if (chroma1 != NULL) free(chroma1);
+	pcdCacheRelease(bufferCache, chroma1);
 	chroma1 = NULL;
-	if (chroma2 != NULL) free(chroma2);
+	pcdCacheRelease(bufferCache, chroma2);
 	chroma2 = NULL;
-	if (pcdFileHeader != NULL) free(pcdFileHeader);
+	pcdCacheRelease(bufferCache, pcdFileHeader);
 	pcdFileHeader = NULL;
 	int i, j;
 	for (i = 0; i < 3; i++) {
 		for (j = 0; j < 3; j++) {
-			if (deltas[i][j] != NULL) free(deltas[i][j]);
+			pcdCacheRelease(bufferCache, deltas[i][j]);
 			deltas[i][j] = NULL;
 		}
 	}
@@ -2556,6 +4363,37 @@ void pcdDecode::setWhiteBalance(int value)
 	whiteBalance = value;
 }
 
+bool pcdDecode::setOutputCurve(const float *curve, size_t numPoints)
+{
+	struct pcdOutputCurve *newCurve = NULL;
+	float value;
+	int i;
+	if (curve != NULL) {
+		if (numPoints < 2) {
+			return false;
+		}
+		newCurve = (struct pcdOutputCurve *) malloc(sizeof(struct pcdOutputCurve));
+		if (newCurve == NULL) {
+			return false;
+		}
+		// Each table's own values go through the curve, so e.g. 8-bit output is 
+		// exactly what applying the curve to the 8-bit data would give
+		for (i = 0; i < numLUTItems; i++) {
+			value = pcdCurveValue(curve, numPoints, uint8Output[i] / 255.0f) * 255.0f + 0.5f;
+			newCurve->uint8Table[i] = (uint8_t) pcdPin(0.0f, value, 255.0f);
+			value = pcdCurveValue(curve, numPoints, uint16Output[i] / 65535.0f) * 65535.0f + 0.5f;
+			newCurve->uint16Table[i] = (uint16_t) pcdPin(0.0f, value, 65535.0f);
+			value = pcdCurveValue(curve, numPoints, uint10Output[i] / 1023.0f) * 1023.0f + 0.5f;
+			newCurve->uint10Table[i] = (uint16_t) pcdPin(0.0f, value, 1023.0f);
+			newCurve->floatTable[i] = pcdCurveValue(curve, numPoints, floatOutput[i]);
+			newCurve->halfTable[i] = pcdFloatToHalf(newCurve->floatTable[i]);
+		}
+	}
+	if (outputCurve != NULL) free(outputCurve);
+	outputCurve = newCurve;
+	return true;
+}
+
 char *pcdDecode::getErrorString()
 {
 	return errorString;
@@ -2618,9 +4456,6 @@ void pcdDecode::getMetadata(unsigned int select, char *description, char *value)
 	else {
 		if (description != NULL) strcpy(description, PCDMetadataDescriptions[select]);
 		if (compareBytes(pcdFile->ipiHeader.ipiSignature,"PCD_IPI") == 0) {
-			time_t t;
-			struct tm *brokentime;
-			char *temp;
 			switch (select) {
 				case kspecificationVersion:
 					if (getPCD32(pcdFile->ipiHeader.specificationVersion) == 0xffff) {
@@ -2645,12 +4480,7 @@ void pcdDecode::getMetadata(unsigned int select, char *description, char *value)
 						strcpy(value, "-");
 					}
 					else {
-						t = getPCD32(pcdFile->ipiHeader.imageScanningTime);
-						brokentime = localtime(&t);
-						temp = asctime (brokentime);
-						// Get rid of the newline
-						temp[strlen(temp)-1] = 0x0;
-						strcpy(value, temp);
+						copyTime(value, getPCD32(pcdFile->ipiHeader.imageScanningTime));
 					}
 					break;
 				case kimageModificationTime:
@@ -2660,12 +4490,7 @@ void pcdDecode::getMetadata(unsigned int select, char *description, char *value)
 							strcpy(value, "-");
 						}
 						else {
-							t = getPCD32(pcdFile->ipiHeader.imageModificationTime);
-							brokentime = localtime(&t);
-							temp = asctime (brokentime);
-							// Get rid of the newline
-							temp[strlen(temp)-1] = 0x0;
-							strcpy(value, temp);
+							copyTime(value, getPCD32(pcdFile->ipiHeader.imageModificationTime));
 						}
 					break;
 				case kimageMedium:
@@ -2781,9 +4606,91 @@ void pcdDecode::getMetadata(unsigned int select, char *description, char *value)
 	}
 }
 
+void pcdDecode::setExecutor(pcdExecutor *value)
+{
+	taskExecutor = value;
+}
+
+pcdExecutor *pcdDecode::getExecutor(void)
+{
+	return taskExecutor != NULL ? taskExecutor : pcdThreadPool::getSharedPool();
+}
+
+void pcdDecode::setProgressCallback(pcdProgressCallback callback, void *context)
+{
+	progressCallback = callback;
+	progressContext = context;
+}
+
+void pcdDecode::setCancelToken(pcdCancelToken *token)
+{
+	cancelToken = token;
+}
+
+// If the decode has been cancelled, drops the file, as if it had never been parsed
+bool pcdDecode::checkCancelled(void)
+{
+	if ((cancelToken == NULL) || !cancelToken->isCancelled()) {
+		return false;
+	}
+	pcdFreeAll();
+	strncpy(errorString, "Decode cancelled", kPCDMaxStringLength*3-1);
+	return true;
+}
+
+void pcdDecode::setRetainScenes(bool value)
+{
+	retainScenes = value;
+}
+
+bool pcdDecode::isSceneAvailable(unsigned int scene)
+{
+	return (pcdFileHeader != NULL) && (scene < kMaxScenes) && 
+			((scene == sceneNumber) || (retainedPlanes[scene][0] != NULL));
+}
+
+bool pcdDecode::setOutputScene(unsigned int scene)
+{
+	int i, j;
+	if (!isSceneAvailable(scene)) {
+		return false;
+	}
+	if (scene == sceneNumber) {
+		return true;
+	}
+	// The retained scenes are only complete once postParse is done
+	for (i = 0; i < 3; i++) {
+		for (j = 0; j < 3; j++) {
+			if (deltas[i][j] != NULL) return false;
+		}
+	}
+	// Swap the current planes out for the ones asked for; the planes always have 
+	// exactly one owner, so nothing is copied or freed
+	rewindScanlines();
+	retainedPlanes[sceneNumber][0] = luma;
+	retainedPlanes[sceneNumber][1] = chroma1;
+	retainedPlanes[sceneNumber][2] = chroma2;
+	luma = retainedPlanes[scene][0];
+	chroma1 = retainedPlanes[scene][1];
+	chroma2 = retainedPlanes[scene][2];
+	retainedPlanes[scene][0] = retainedPlanes[scene][1] = retainedPlanes[scene][2] = NULL;
+	sceneNumber = scene;
+	return true;
+}
+
+void pcdDecode::freeRetainedScene(unsigned int scene)
+{
+	int plane;
+	for (plane = 0; plane < 3; plane++) {
+		pcdCacheRelease(bufferCache, retainedPlanes[scene][plane]);
+		retainedPlanes[scene][plane] = NULL;
+	}
+}
+
 void pcdDecode::interpolateBuffers(uint8_t **c1UpRes, uint8_t **c2UpRes, int *resFactor)
 {
 	// This does an interpolate either by a factor of 2 or 4
+	pcdExecutor *executor = getExecutor();
 	uint8_t *lp, *c1p, *c2p, *intermediate;
 	lp = luma;
 	c1p = chroma1;
@@ -2796,39 +4703,37 @@ void pcdDecode::interpolateBuffers(uint8_t **c1UpRes, uint8_t **c2UpRes, int *re
 	
 	if (upResMethod >= kUpResIterpolate) {
 		// Linear interpolation..........
-		*c1UpRes = (uint8_t *) malloc(PCDLumaHeight[sceneNumber]*PCDLumaWidth[sceneNumber]*sizeof(uint8_t));
-		*c2UpRes = (uint8_t *) malloc(PCDLumaHeight[sceneNumber]*PCDLumaWidth[sceneNumber]*sizeof(uint8_t));
-		if (*c1UpRes == NULL || *c1UpRes == NULL) {
+		*c1UpRes = (uint8_t *) pcdCacheAlloc(bufferCache, PCDLumaHeight[sceneNumber]*PCDLumaWidth[sceneNumber]*sizeof(uint8_t));
+		*c2UpRes = (uint8_t *) pcdCacheAlloc(bufferCache, PCDLumaHeight[sceneNumber]*PCDLumaWidth[sceneNumber]*sizeof(uint8_t));
+		if (*c1UpRes == NULL || *c2UpRes == NULL) {
 			throw "Memory Error!";
 		}
 		
 		if (*resFactor == 2) {
-			intermediate = (uint8_t *) malloc((PCDLumaHeight[sceneNumber]>>1)*(PCDLumaWidth[sceneNumber]>>1)*sizeof(uint8_t));
+			intermediate = (uint8_t *) pcdCacheAlloc(bufferCache, (PCDLumaHeight[sceneNumber]>>1)*(PCDLumaWidth[sceneNumber]>>1)*sizeof(uint8_t));
 			if (intermediate == NULL) {
 				throw "Memory Error!";
 			}
-			upResBuffer(c1p, intermediate, NULL, PCDLumaWidth[sceneNumber]>>1, PCDLumaHeight[sceneNumber]>>1, upResMethod, false);
+			upResBuffer(c1p, intermediate, NULL, PCDLumaWidth[sceneNumber]>>1, PCDLumaHeight[sceneNumber]>>1, upResMethod, false, executor);
 			c1p = intermediate;
 #ifdef __debug
 			dump8by8(c1p, PCDLumaWidth[sceneNumber]>>1);
 #endif
 		}
 
-		upResBuffer(c1p, *c1UpRes, lp, PCDLumaWidth[sceneNumber], PCDLumaHeight[sceneNumber], upResMethod, false);
+		upResBuffer(c1p, *c1UpRes, lp, PCDLumaWidth[sceneNumber], PCDLumaHeight[sceneNumber], upResMethod, false, executor);
 		c1p = *c1UpRes;
 		
 		if (*resFactor == 2) {
-			upResBuffer(c2p, intermediate, NULL, PCDLumaWidth[sceneNumber]>>1, PCDLumaHeight[sceneNumber]>>1, upResMethod, false);
+			upResBuffer(c2p, intermediate, NULL, PCDLumaWidth[sceneNumber]>>1, PCDLumaHeight[sceneNumber]>>1, upResMethod, false, executor);
 			c2p = intermediate;
 		}
-		upResBuffer(c2p, *c2UpRes, lp, PCDLumaWidth[sceneNumber], PCDLumaHeight[sceneNumber], upResMethod, false);
+		upResBuffer(c2p, *c2UpRes, lp, PCDLumaWidth[sceneNumber], PCDLumaHeight[sceneNumber], upResMethod, false, executor);
 		c2p = *c2UpRes;
 
 		
-		if (intermediate != NULL) {
-			free(intermediate);
-			intermediate = NULL;
-		}
+		pcdCacheRelease(bufferCache, intermediate);
+		intermediate = NULL;
 		*resFactor = 0;
 	}
 }
@@ -2850,17 +4755,25 @@ void pcdDecode::populateUInt8Buffers(uint8_t *red, uint8_t *green, uint8_t *blue
 
 void pcdDecode::populateBuffers(void *red, void *green, void *blue, void *alpha, int d, int dataSize)
 {
+	struct pcdOutputDescriptor output;
+	setOutput(&output, red, green, blue, alpha, d, dataSize);
+	populateOutputs(&output, 1);
+}
 
-	uint8_t *lp, *c1p, *c2p, *intermediate, *c1UpRes, *c2UpRes;
-	lp = luma;
-	c1p = chroma1;
-	c2p = chroma2;
-	intermediate = NULL;
-	c1UpRes = NULL;
-	c2UpRes = NULL;
-	int resFactor = PCDChromaResFactor[sceneNumber];
+void pcdDecode::populateUInt8GrayBuffer(uint8_t *gray, int d)
+{
+	struct pcdOutputDescriptor output;
+	setOutput(&output, gray, NULL, NULL, NULL, d, pcdByteSize);
+	output.layout = kPCDGrayLayout;
+	populateOutputs(&output, 1);
+}
+
+void pcdDecode::populateOutputs(const struct pcdOutputDescriptor *outputs, unsigned int numOutputs)
+{
+	uint8_t *c1p, *c2p;
+	int resFactor;
 	
-	if (pcdFileHeader == NULL) {
+	if ((pcdFileHeader == NULL) || (numOutputs == 0)) {
 		// No file
 		return;
 	}
@@ -2870,101 +4783,286 @@ void pcdDecode::populateBuffers(void *red, void *green, void *blue, void *alpha,
 //	dump8by8(c1p, PCDChromaWidth[sceneNumber]);
 #endif
 	
-	interpolateBuffers(&c1UpRes, &c2UpRes, &resFactor);
-	if (c1UpRes != NULL) c1p = c1UpRes;
-	if (c2UpRes != NULL) c2p = c2UpRes;
+	if (!getUpResChroma(&c1p, &c2p, &resFactor)) {
+		return;
+	}
 
 #ifdef __debug
 //	dump8by8(c1p, PCDLumaWidth[sceneNumber]);
 #endif	
-	struct ConvertToRGBData rd[kNumThreads];
-	size_t previousRow = 0;	
-	int thread;
-#ifndef mNoPThreads
-	int rc;
-	void *status;
-	pcdThreadDescriptor threadDescriptors[kNumThreads];
-	pthread_attr_t threadAttr;
-	
-	/* Initialize and set thread detached attribute */
-	pthread_attr_init(&threadAttr);
-	pthread_attr_setdetachstate(&threadAttr, PTHREAD_CREATE_JOINABLE);
-	// Use minimum stacksize times two; we have only a few stack variables
-	pthread_attr_setstacksize(&threadAttr, PTHREAD_STACK_MIN<<1);
-#endif
+	convertRows(outputs, numOutputs, NULL, 0, getHeight(), c1p, c2p, resFactor);
+}
+
+void pcdDecode::setOutput(struct pcdOutputDescriptor *output, void *red, void *green, void *blue, void *alpha, int d, int dataSize)
+{
+	output->colorSpace = colorSpace;
+	output->dataSize = dataSize;
+	output->red = red;
+	output->green = green;
+	output->blue = blue;
+	output->alpha = alpha;
+	output->d = d;
+	output->layout = kPCDSeparateLayout;
+	output->rowBytes = 0;
+}
+
+bool pcdDecode::getUpResChroma(uint8_t **c1p, uint8_t **c2p, int *resFactor)
+{
+	if (monochrome) {
+		// The chroma isn't used at all
+		*c1p = chroma1;
+		*c2p = chroma2;
+		*resFactor = PCDChromaResFactor[sceneNumber];
+		return true;
+	}
+	if (!upResValid || (upResCacheMethod != upResMethod) || (upResCacheScene != sceneNumber)) {
+		// Interpolating the chroma costs about as much as the RGB conversion itself,
+		// so the result is kept for later populate and read scanlines calls
+		freeUpResChroma();
+		upResCacheResFactor = PCDChromaResFactor[sceneNumber];
+		try {
+			interpolateBuffers(&upResC1, &upResC2, &upResCacheResFactor);
+		}
+		catch (const char *err) {
+			// Don't let exceptions out of the library; the caller may not even be on the
+			// thread that made the decoder
+			freeUpResChroma();
+			strncpy(errorString, err, kPCDMaxStringLength*2);
+			errorString[kPCDMaxStringLength*2] = 0x0;
+			strcat(errorString, " while converting to RGB");
+			return false;
+		}
+		upResCacheMethod = upResMethod;
+		upResCacheScene = sceneNumber;
+		upResValid = true;
+	}
+	*c1p = upResC1 != NULL ? upResC1 : chroma1;
+	*c2p = upResC2 != NULL ? upResC2 : chroma2;
+	*resFactor = upResCacheResFactor;
+	return true;
+}
+
+void pcdDecode::freeUpResChroma(void)
+{
+	pcdCacheRelease(bufferCache, upResC1);
+	upResC1 = NULL;
+	pcdCacheRelease(bufferCache, upResC2);
+	upResC2 = NULL;
+	upResValid = false;
+}
+
+bool pcdDecode::convertRows(const struct pcdOutputDescriptor *outputs, unsigned int numOutputs, const struct pcdYCbCrPlanes *planes,
+							size_t firstRow, size_t numRows, uint8_t *c1p, uint8_t *c2p, int resFactor)
+{
+	// Rows here are rows of the rotated output image; work out what part of the
+	// stored image they come from. For 90 and 270 degree rotations, that's a band of columns
+	size_t columns = PCDLumaWidth[sceneNumber];
+	size_t rows = PCDLumaHeight[sceneNumber];
+	size_t startRow = 0, endRow = rows, startColumn = 0, endColumn = columns;
+	switch (imageRotate) {
+		case 1:
+			startColumn = columns - firstRow - numRows;
+			endColumn = columns - firstRow;
+			break;
+		case 2:
+			startRow = rows - firstRow - numRows;
+			endRow = rows - firstRow;
+			break;
+		case 3:
+			startColumn = firstRow;
+			endColumn = firstRow + numRows;
+			break;
+		default:
+			startRow = firstRow;
+			endRow = firstRow + numRows;
+			break;
+	}
+	
+	// Only run the conversion stages that some output needs; sRGB is made from
+	// linear light, which is made from raw. YCbCr is made from the decoder's color space
+	bool needStage[4] = {false, false, false, false};
+	unsigned int output;
+	int stage;
+	for (output = 0; output < (planes != NULL ? 1 : numOutputs); output++) {
+		stage = convertStage(planes != NULL ? colorSpace : outputs[output].colorSpace);
+		if (stage == kStageYCC) {
+			needStage[kStageYCC] = true;
+		}
+		for (; stage >= kStageRaw; stage--) {
+			needStage[stage] = true;
+		}
+	}
+	
+	pcdExecutor *executor = getExecutor();
+	struct ConvertToRGBData *rd, single;
+	struct pcdProgress progressData;
+	struct pcdProgress *progress = pcdBeginProgress(&progressData, this, progressCallback, progressContext, cancelToken,
+													kPCDConvertStage, firstRow, getHeight());
+	bool cancelled;
+	size_t previousRow = startRow;	
+	size_t numTiles = pcdNumTiles(executor, endColumn - startColumn, endRow - startRow);
+	size_t tile;
+	rd = numTiles > 1 ? (struct ConvertToRGBData *) malloc(numTiles * sizeof(struct ConvertToRGBData)) : NULL;
+	if (rd == NULL) {
+		rd = &single;
+		numTiles = 1;
+	}
 #ifdef __PerformanceAnalysis
 #ifdef qMacOS
 	AbsoluteTime nowTime, bgnTime;
     bgnTime = UpTime();
 #endif
 #endif
-	for (thread = 0; thread < kNumThreads; thread++) {
-		rd[thread].outputSize = dataSize;
-		rd[thread].red = red;
-		rd[thread].green = green;
-		rd[thread].blue = blue;
-		rd[thread].alpha = alpha;
-		rd[thread].d = d;
-		rd[thread].startRow = previousRow;
-		rd[thread].endRow = PCDLumaHeight[sceneNumber]/kNumThreads*(thread+1);
-		rd[thread].columns = PCDLumaWidth[sceneNumber];
-		rd[thread].rows = PCDLumaHeight[sceneNumber];
-		rd[thread].lp = lp;
-		rd[thread].c1p = monochrome ? NULL : c1p;
-		rd[thread].c2p = monochrome ? NULL : c2p;
-		rd[thread].resFactor = resFactor;
-		rd[thread].imageRotate = imageRotate;
-		rd[thread].colorSpace = colorSpace;		
-		rd[thread].whiteBalance = whiteBalance;		
-		
-		previousRow = rd[thread].endRow;
-#ifndef mNoPThreads
-		if (thread == (kNumThreads - 1)) {
-			convertToRGB(&(rd[thread]));
-		}
-		else {
-			if (pcdStartThread(threadDescriptors[thread], threadAttr, convertToRGB, (void *)&(rd[thread])) != 0) {
-				// Too many threads already.....
-				convertToRGB(&(rd[thread]));
-				// Don't try to join
-				rd[thread].endRow = 0;
-			}
+	for (tile = 0; tile < numTiles; tile++) {
+		rd[tile].outputs = outputs;
+		rd[tile].numOutputs = numOutputs;
+		rd[tile].planes = planes;
+		rd[tile].interpolateChroma = (planes != NULL) && (resFactor == 1);
+		rd[tile].planeStage = convertStage(colorSpace);
+		for (stage = 0; stage < 4; stage++) {
+			rd[tile].needStage[stage] = needStage[stage];
 		}
-#else
-		convertToRGB(&(rd[thread]));
+		rd[tile].startRow = previousRow;
+		rd[tile].endRow = startRow + pcdTileEndRow(tile, numTiles, endRow - startRow);
+		rd[tile].startColumn = startColumn;
+		rd[tile].endColumn = endColumn;
+		rd[tile].columns = columns;
+		rd[tile].rows = rows;
+		rd[tile].firstRow = firstRow;
+		rd[tile].outputWidth = getWidth();
+		rd[tile].lp = luma;
+		rd[tile].c1p = monochrome ? NULL : c1p;
+		rd[tile].c2p = monochrome ? NULL : c2p;
+		rd[tile].resFactor = resFactor;
+		rd[tile].imageRotate = imageRotate;
+		rd[tile].whiteBalance = whiteBalance;		
+		rd[tile].curve = outputCurve;
+		rd[tile].progress = progress;
+		// For 90 and 270 degree rotations, each tile is part of every output row
+		rd[tile].progressRows = numRows * (rd[tile].endRow - startRow) / (endRow - startRow) - 
+			numRows * (rd[tile].startRow - startRow) / (endRow - startRow);
+		
+		previousRow = rd[tile].endRow;
+	}
+	pcdRunTasks(executor, planes != NULL ? convertToYCbCr : convertToRGB, rd, sizeof(struct ConvertToRGBData), numTiles);
+	if (rd != &single) free(rd);
+	cancelled = pcdProgressCancelled(progress);
+	pcdEndProgress(progress, false);
+#ifdef __PerformanceAnalysis
+#ifdef qMacOS
+	nowTime = UpTime();
+    float uSec  = HowLong(nowTime, bgnTime);
+    fprintf(stderr, " ConvertRGB: %.3f usec \n", uSec);
+#endif
 #endif
+	return !cancelled;
+}
+
+size_t pcdDecode::readFloatScanlines(float *red, float *green, float *blue, float *alpha, int d, size_t numRows)
+{
+	return readScanlines(red, green, blue, alpha, d, pcdFloatSize, numRows);
+}
+
+size_t pcdDecode::readUInt16Scanlines(uint16_t *red, uint16_t *green, uint16_t *blue, uint16_t *alpha, int d, size_t numRows)
+{
+	return readScanlines(red, green, blue, alpha, d, pcdInt16Size, numRows);
+}
+
+size_t pcdDecode::readUInt8Scanlines(uint8_t *red, uint8_t *green, uint8_t *blue, uint8_t *alpha, int d, size_t numRows)
+{
+	return readScanlines(red, green, blue, alpha, d, pcdByteSize, numRows);
+}
+
+size_t pcdDecode::readScanlines(void *red, void *green, void *blue, void *alpha, int d, int dataSize, size_t numRows)
+{
+	struct pcdOutputDescriptor output;
+	setOutput(&output, red, green, blue, alpha, d, dataSize);
+	return readOutputScanlines(&output, 1, numRows);
+}
+
+size_t pcdDecode::readUInt8GrayScanlines(uint8_t *gray, int d, size_t numRows)
+{
+	struct pcdOutputDescriptor output;
+	setOutput(&output, gray, NULL, NULL, NULL, d, pcdByteSize);
+	output.layout = kPCDGrayLayout;
+	return readOutputScanlines(&output, 1, numRows);
+}
+
+size_t pcdDecode::readOutputScanlines(const struct pcdOutputDescriptor *outputs, unsigned int numOutputs, size_t numRows)
+{
+	uint8_t *c1p, *c2p;
+	int resFactor;
+	if ((pcdFileHeader == NULL) || (numOutputs == 0) || (scanlineRow >= getHeight())) {
+		return 0;
 	}
-#ifdef __PerformanceAnalysis
-#ifdef qMacOS
-	nowTime = UpTime();
-    float uSec  = HowLong(nowTime, bgnTime);
-    fprintf(stderr, " ConvertRGB: %.3f usec \n", uSec);
-#endif
-#endif
-#ifndef mNoPThreads
-	pthread_attr_destroy(&threadAttr);
-	status  = 0; // Avoid unreferenced local variable warning
-	for (thread = 0; thread < (kNumThreads-1); thread++) {
-		if (rd[thread].endRow > 0) {
-			rc = pcdThreadJoin(threadDescriptors[thread], &status);
-		}
+	// The chroma is interpolated as whole planes on the first call; after that, 
+	// rows are converted as they are asked for
+	if (!getUpResChroma(&c1p, &c2p, &resFactor)) {
+		return 0;
 	}
-#endif
-#ifdef __PerformanceAnalysis
-#ifdef qMacOS
-	nowTime = UpTime();
-    uSec  = HowLong(nowTime, bgnTime);
-    fprintf(stderr, " ConvertRGB: %.3f usec \n", uSec);
-#endif
-#endif
-	if (c1UpRes != NULL) {
-		free(c1UpRes);
-		c1UpRes = NULL;
+	if (numRows > (getHeight() - scanlineRow)) {
+		numRows = getHeight() - scanlineRow;
+	}
+	if (!convertRows(outputs, numOutputs, NULL, scanlineRow, numRows, c1p, c2p, resFactor)) {
+		return 0;
+	}
+	scanlineRow += numRows;
+	return numRows;
+}
+
+void pcdDecode::populateYCbCrBuffers(uint8_t *y, uint8_t *cb, uint8_t *cr, size_t yRowBytes, size_t chromaRowBytes, int chromaD)
+{
+	struct pcdYCbCrPlanes planes;
+	if (pcdFileHeader == NULL) {
+		// No file
+		return;
+	}
+	planes.y = y;
+	planes.cb = cb;
+	planes.cr = cr;
+	planes.yRowBytes = yRowBytes;
+	planes.chromaRowBytes = chromaRowBytes;
+	planes.chromaD = chromaD;
+	// The chroma is used as stored, so there's no need for the upres
+	convertRows(NULL, 0, &planes, 0, getHeight(), chroma1, chroma2, PCDChromaResFactor[sceneNumber]);
+}
+
+size_t pcdDecode::readYCbCrScanlines(uint8_t *y, uint8_t *cb, uint8_t *cr, size_t yRowBytes, size_t chromaRowBytes, int chromaD, size_t numRows)
+{
+	struct pcdYCbCrPlanes planes;
+	if ((pcdFileHeader == NULL) || (scanlineRow >= getHeight())) {
+		return 0;
 	}
-	if (c2UpRes != NULL) {
-		free(c2UpRes);
-		c2UpRes = NULL;
+	// Whole 2x2 blocks only
+	numRows = numRows < 2 ? 2 : (numRows & ~((size_t) 1));
+	if ((scanlineRow & 0x1) != 0) {
+		strcpy(errorString, "YCbCr scanlines must start on an even row");
+		return 0;
+	}
+	if (numRows > (getHeight() - scanlineRow)) {
+		numRows = getHeight() - scanlineRow;
+	}
+	planes.y = y;
+	planes.cb = cb;
+	planes.cr = cr;
+	planes.yRowBytes = yRowBytes;
+	planes.chromaRowBytes = chromaRowBytes;
+	planes.chromaD = chromaD;
+	if (!convertRows(NULL, 0, &planes, scanlineRow, numRows, chroma1, chroma2, PCDChromaResFactor[sceneNumber])) {
+		return 0;
 	}
+	scanlineRow += numRows;
+	return numRows;
+}
+
+size_t pcdDecode::getScanline()
+{
+	return scanlineRow;
+}
+
+void pcdDecode::rewindScanlines()
+{
+	scanlineRow = 0;
 }
 
 
@@ -2973,49 +5071,185 @@ int pcdDecode::getOrientation()
 	return imageRotate;
 }
 
+// One plane at one resolution level; postParse splits each of these into row tiles, 
+// where each tile depends only on the tiles of the same plane at the level below that 
+// cover its source rows. So the three planes, and the levels of each plane, can all
+// be worked on at the same time.
+struct postParseStep {
+	uint8_t *base;
+	uint8_t *dest;
+	unsigned int width;
+	unsigned int height;
+	bool hasDeltas;
+	int previous;									// Same plane at the level below; -1 for none
+	size_t firstTile;
+	size_t numTiles;
+};
+
+static unsigned int postParseTileStart(struct postParseStep *step, size_t tile)
+{
+	return tile == 0 ? 0 : (unsigned int) pcdTileEndRow(tile - 1, step->numTiles, step->height);
+}
+
 void pcdDecode::postParse()
 {
-	int sceneNumber;
-	bool haveDeltas;
+	int sceneNumber, plane, step, numSteps;
+	int lastStep[3];
+	struct postParseStep steps[9];
+	uint8_t *oldPlanes[9];
+	int oldScenes[9], oldPlaneIndexes[9];
+	uint8_t **planes[3];
+	struct upResInterpolateData *rd;
+	size_t *waitCounts, *successorStart, *successors;
+	size_t numTasks, tile, sourceTile, task, numLinks;
+	unsigned int sourceFirst, sourceLast;
+	int method = pcdMin(kUpResIterpolate, upResMethod);
+	pcdExecutor *executor = getExecutor();
+	struct pcdProgress progressData, *progress;
+	size_t totalRows = 0;
 	
 	if (pcdFileHeader == NULL) {
 		// No file
 		return;
 	}
+	// The planes are about to change under any scan in progress
+	rewindScanlines();
+	freeUpResChroma();
 	
+	planes[0] = &luma;
+	planes[1] = &chroma1;
+	planes[2] = &chroma2;
+	lastStep[0] = lastStep[1] = lastStep[2] = -1;
+	numSteps = 0;
+	numTasks = 0;
 	for (sceneNumber = k4Base; sceneNumber <= k64Base; sceneNumber++) {
 		// Iterate the possible deltas that are avalable......
-		if (deltas[sceneNumber-k4Base][0] != NULL) {
-			// First the luma delta....
-			upResBuffer(luma, deltas[sceneNumber-k4Base][0], NULL, PCDLumaWidth[sceneNumber], PCDLumaHeight[sceneNumber], pcdMin(kUpResIterpolate, upResMethod), true);
-			if (deltas[sceneNumber-k4Base][0] != NULL) {
-				free(luma);
-				luma = deltas[sceneNumber-k4Base][0];
-				deltas[sceneNumber-k4Base][0] = NULL;
+		// If there is a luma delta, we have to upres the chromas as well.....
+		if (deltas[sceneNumber-k4Base][0] == NULL) continue;
+		for (plane = 0; plane < 3; plane++) {
+			// Monochrome images are read without any chroma at all
+			if (*(planes[plane]) == NULL) continue;
+			steps[numSteps].hasDeltas = (deltas[sceneNumber-k4Base][plane] != NULL);
+			steps[numSteps].width = plane == 0 ? PCDLumaWidth[sceneNumber] : PCDLumaWidth[sceneNumber]>>1;
+			steps[numSteps].height = plane == 0 ? PCDLumaHeight[sceneNumber] : PCDLumaHeight[sceneNumber]>>1;
+			if (!steps[numSteps].hasDeltas) {
+				deltas[sceneNumber-k4Base][plane] = (uint8_t *) pcdCacheAlloc(bufferCache, steps[numSteps].width * steps[numSteps].height * sizeof(uint8_t));
+				if (deltas[sceneNumber-k4Base][plane] == NULL) continue;
 			}
-			// If there is a luma delta, we have to upres the chromas as well.....
-			haveDeltas = (deltas[sceneNumber-k4Base][1] != NULL);
-			if (!haveDeltas) {
-				deltas[sceneNumber-k4Base][1] = (uint8_t *) malloc((PCDLumaWidth[sceneNumber]>>1) * (PCDLumaHeight[sceneNumber]>>1)*sizeof(uint8_t));
-			}
-			upResBuffer(chroma1, deltas[sceneNumber-k4Base][1], NULL, PCDLumaWidth[sceneNumber]>>1, PCDLumaHeight[sceneNumber]>>1, pcdMin(kUpResIterpolate, upResMethod), haveDeltas);
-			if (deltas[sceneNumber-k4Base][1] != NULL) {
-				free(chroma1);
-				chroma1 = deltas[sceneNumber-k4Base][1];
-				deltas[sceneNumber-k4Base][1] = NULL;
-			}
-			haveDeltas = (deltas[sceneNumber-k4Base][2] != NULL);
-			if (!haveDeltas) {
-				deltas[sceneNumber-k4Base][2] = (uint8_t *) malloc((PCDLumaWidth[sceneNumber]>>1) * (PCDLumaHeight[sceneNumber]>>1)*sizeof(uint8_t));
+			steps[numSteps].base = *(planes[plane]);
+			steps[numSteps].dest = deltas[sceneNumber-k4Base][plane];
+			steps[numSteps].previous = lastStep[plane];
+			steps[numSteps].firstTile = numTasks;
+			steps[numSteps].numTiles = (pcdConcurrency(executor) < 2) ? 1 : (steps[numSteps].height + kTileRows - 1) / kTileRows;
+			numTasks += steps[numSteps].numTiles;
+			totalRows += steps[numSteps].height;
+			lastStep[plane] = numSteps;
+			// The upres'ed plane replaces the old one, but the old one is still needed
+			// until the graph is complete
+			oldPlanes[numSteps] = *(planes[plane]);
+			oldScenes[numSteps] = sceneNumber - 1;
+			oldPlaneIndexes[numSteps] = plane;
+			*(planes[plane]) = deltas[sceneNumber-k4Base][plane];
+			deltas[sceneNumber-k4Base][plane] = NULL;
+			numSteps++;
+		}
+	}
+	if (numSteps == 0) return;
+	
+	progress = pcdBeginProgress(&progressData, this, progressCallback, progressContext, cancelToken, kPCDUpResStage, 0, totalRows);
+	rd = (struct upResInterpolateData *) malloc(numTasks * sizeof(struct upResInterpolateData));
+	waitCounts = (size_t *) calloc(numTasks, sizeof(size_t));
+	successorStart = (size_t *) calloc(numTasks + 1, sizeof(size_t));
+	successors = NULL;
+	numLinks = 0;
+	if ((rd != NULL) && (waitCounts != NULL) && (successorStart != NULL)) {
+		// Two passes over the dependencies; the first to count them, the second to
+		// fill in the successor lists
+		for (step = 0; step < numSteps; step++) {
+			for (tile = 0; tile < steps[step].numTiles; tile++) {
+				task = steps[step].firstTile + tile;
+				rd[task].base = steps[step].base;
+				rd[task].dest = steps[step].dest;
+				rd[task].luma = NULL;
+				rd[task].width = steps[step].width;
+				rd[task].height = steps[step].height;
+				rd[task].hasDeltas = steps[step].hasDeltas;
+				rd[task].startRow = postParseTileStart(&(steps[step]), tile);
+				rd[task].endRow = (unsigned int) pcdTileEndRow(tile, steps[step].numTiles, steps[step].height);
+				rd[task].progress = progress;
+				if (steps[step].previous < 0) continue;
+				struct postParseStep *source = &(steps[steps[step].previous]);
+				// The interpolators read source rows row>>1 and the one below it
+				sourceFirst = rd[task].startRow >> 1;
+				sourceLast = pcdMin(rd[task].endRow >> 1, source->height - 1);
+				for (sourceTile = 0; sourceTile < source->numTiles; sourceTile++) {
+					if ((postParseTileStart(source, sourceTile) <= sourceLast) && 
+						(pcdTileEndRow(sourceTile, source->numTiles, source->height) > sourceFirst)) {
+						waitCounts[task]++;
+						successorStart[source->firstTile + sourceTile + 1]++;
+						numLinks++;
+					}
+				}
 			}
-			upResBuffer(chroma2, deltas[sceneNumber-k4Base][2], NULL, PCDLumaWidth[sceneNumber]>>1, PCDLumaHeight[sceneNumber]>>1, pcdMin(kUpResIterpolate, upResMethod), haveDeltas);
-			if (deltas[sceneNumber-k4Base][2] != NULL) {
-				free(chroma2);
-				chroma2 = deltas[sceneNumber-k4Base][2];
-				deltas[sceneNumber-k4Base][2] = NULL;
+		}
+		for (task = 0; task < numTasks; task++) {
+			successorStart[task + 1] += successorStart[task];
+		}
+		successors = (size_t *) malloc((numLinks + 1) * sizeof(size_t));
+	}
+	if (successors != NULL) {
+		size_t *fill = (size_t *) malloc((numTasks + 1) * sizeof(size_t));
+		if (fill != NULL) {
+			memcpy(fill, successorStart, (numTasks + 1) * sizeof(size_t));
+			for (step = 0; step < numSteps; step++) {
+				if (steps[step].previous < 0) continue;
+				struct postParseStep *source = &(steps[steps[step].previous]);
+				for (tile = 0; tile < steps[step].numTiles; tile++) {
+					task = steps[step].firstTile + tile;
+					sourceFirst = rd[task].startRow >> 1;
+					sourceLast = pcdMin(rd[task].endRow >> 1, source->height - 1);
+					for (sourceTile = 0; sourceTile < source->numTiles; sourceTile++) {
+						if ((postParseTileStart(source, sourceTile) <= sourceLast) && 
+							(pcdTileEndRow(sourceTile, source->numTiles, source->height) > sourceFirst)) {
+							successors[fill[source->firstTile + sourceTile]++] = task;
+						}
+					}
+				}
 			}
+			free(fill);
+			pcdRunTaskGraph(executor, method >= kUpResIterpolate ? upResInterpolate : upResNearest, rd, sizeof(struct upResInterpolateData), 
+							numTasks, waitCounts, successorStart, successors);
+		}
+		else {
+			free(successors);
+			successors = NULL;
+		}
+	}
+	if (successors == NULL) {
+		// Not enough memory for the graph; just do one plane at a time
+		for (step = 0; step < numSteps && !pcdProgressCancelled(progress); step++) {
+			upResBuffer(steps[step].base, steps[step].dest, NULL, steps[step].width, steps[step].height, method, steps[step].hasDeltas, executor);
+			pcdAddProgress(progress, steps[step].height, 0);
+		}
+	}
+	
+	if (rd != NULL) free(rd);
+	if (waitCounts != NULL) free(waitCounts);
+	if (successorStart != NULL) free(successorStart);
+	if (successors != NULL) free(successors);
+	for (step = 0; step < numSteps; step++) {
+		if (retainScenes) {
+			// Keep each level that we went through; see setOutputScene
+			uint8_t **retained = &(retainedPlanes[oldScenes[step]][oldPlaneIndexes[step]]);
+			pcdCacheRelease(bufferCache, *retained);
+			*retained = oldPlanes[step];
+		}
+		else {
+			pcdCacheRelease(bufferCache, oldPlanes[step]);
 		}
 	}
+	pcdEndProgress(progress, true);
+	checkCancelled();
 }
 
 //////////////////////////////////////////////////////////////
@@ -3058,7 +5292,7 @@ struct ic_entry {
 	uint8_t offset[4];
 };
 
-bool pcdDecode::parseICFile (const pcdFilenameType *ipe_file)
+bool pcdDecode::parseICFile (const pcdFilenameType *ipe_file, struct pcdProgress *progress)
 {	
 	FILE *ic = NULL;
 	FILE *thisFile = NULL;
@@ -3094,7 +5328,7 @@ bool pcdDecode::parseICFile (const pcdFilenameType *ipe_file)
 		return false;
 	}
 
-	huffTables *hTables = (huffTables *) malloc(sizeof(huffTables));
+	huffTables *hTables = (huffTables *) pcdCacheAlloc(bufferCache, sizeof(huffTables));
 	if (hTables == NULL) {
 		strncpy(errorString, "Could not allocate huffman tables", kPCDMaxStringLength*3-1);
 		return false;
@@ -3102,7 +5336,7 @@ bool pcdDecode::parseICFile (const pcdFilenameType *ipe_file)
 	
 	try {
 		// Read the whole file in......
-		buffer = (uint8_t *)malloc(fileSize*KSectorSize*sizeof(uint8_t));
+		buffer = (uint8_t *) pcdCacheAlloc(bufferCache, fileSize*KSectorSize*sizeof(uint8_t));
 		if (buffer == NULL) {
 			throw "Memory allocation error";
 		}
@@ -3154,11 +5388,11 @@ bool pcdDecode::parseICFile (const pcdFilenameType *ipe_file)
 		// Read the Huffman tables........
 		readAllHuffmanTables(ic, getPCD32(header->off_huffman), hTables, ipeLayers);
 		
-		deltas[k64Base - k4Base][0] = (uint8_t *) malloc(PCDLumaWidth[k64Base]*PCDLumaHeight[k64Base]*sizeof(uint8_t));
+		deltas[k64Base - k4Base][0] = (uint8_t *) pcdCacheAlloc(bufferCache, PCDLumaWidth[k64Base]*PCDLumaHeight[k64Base]*sizeof(uint8_t));
 		memset(deltas[k64Base - k4Base][0], 0x0, PCDLumaWidth[k64Base]*PCDLumaHeight[k64Base]*sizeof(uint8_t));
 		if (ipeLayers == 3) {
-			deltas[k64Base - k4Base][1] = (uint8_t *) malloc(PCDChromaWidth[k64Base]*PCDChromaHeight[k64Base]*sizeof(uint8_t));
-			deltas[k64Base - k4Base][2] = (uint8_t *) malloc(PCDChromaWidth[k64Base]*PCDChromaHeight[k64Base]*sizeof(uint8_t));
+			deltas[k64Base - k4Base][1] = (uint8_t *) pcdCacheAlloc(bufferCache, PCDChromaWidth[k64Base]*PCDChromaHeight[k64Base]*sizeof(uint8_t));
+			deltas[k64Base - k4Base][2] = (uint8_t *) pcdCacheAlloc(bufferCache, PCDChromaWidth[k64Base]*PCDChromaHeight[k64Base]*sizeof(uint8_t));
 			memset(deltas[k64Base - k4Base][1], 0x0, PCDChromaWidth[k64Base]*PCDChromaHeight[k64Base]*sizeof(uint8_t));
 			memset(deltas[k64Base - k4Base][2], 0x0, PCDChromaWidth[k64Base]*PCDChromaHeight[k64Base]*sizeof(uint8_t));	
 		}
@@ -3183,6 +5417,7 @@ bool pcdDecode::parseICFile (const pcdFilenameType *ipe_file)
 			int sequenceSize = getPCD32((uint8_t*) &description[layer]->length);
 			int numSequences = getPCD16((uint8_t*) &description[layer]->width)*getPCD16((uint8_t*) &description[layer]->height)/sequenceSize;
 			int sequence = 0;
+			pcdAddProgress(progress, 0, numSequences);
 			struct ic_entry *entry = (ic_entry *) (buffer + getPCD32((uint8_t*) &description[layer]->off_pointers));
 			currentFile = getPCD16((uint8_t*) entry->fno);
 			size_t startPoint = getPCD32((uint8_t*) entry->offset);
@@ -3203,7 +5438,7 @@ bool pcdDecode::parseICFile (const pcdFilenameType *ipe_file)
 					}
 					fseek(thisFile, (long) startPoint, SEEK_SET);
 					initReadBuffer(&hufBuffer, thisFile);
-					readPCDDeltas(&hufBuffer, hTables, k64Base, sequenceSize, sequence-1, deltas[k64Base - k4Base], getPCD16((uint8_t*) &description[layer]->offset));
+					readPCDDeltas(&hufBuffer, hTables, k64Base, sequenceSize, sequence-1, deltas[k64Base - k4Base], getPCD16((uint8_t*) &description[layer]->offset), progress);
 #ifdef __debug					
 					uint8_t *test = deltas[k64Base - k4Base][1];
 					test += ((PCDChromaWidth[k64Base]*PCDChromaHeight[k64Base]*sizeof(uint8_t)) >> 1) -32 -224;
@@ -3218,30 +5453,27 @@ bool pcdDecode::parseICFile (const pcdFilenameType *ipe_file)
 			}
 		}		
 	}
-	catch (char *err) {
-		if (errorString == NULL) {
-			strncpy(errorString, err, kPCDMaxStringLength*3-1);
+	catch (const char *err) {
+		if (errorString[0] == 0x0) {
+			strncpy(errorString, err, kPCDMaxStringLength*2);
+			errorString[kPCDMaxStringLength*2] = 0x0;
 			strcat(errorString, " while processing 64Base image");
 		}
 		retVal = false;
 	}
 	catch (...) {
-		if (errorString == NULL) strncpy(errorString, "Error while processing 64Base image", kPCDMaxStringLength*3-1);
+		if (errorString[0] == 0x0) strncpy(errorString, "Error while processing 64Base image", kPCDMaxStringLength*3-1);
 		retVal = false;
 	}
 	if (!retVal) {
 		int i;
 		for(i = 0; i < 3; i++ ) {
-			if (deltas[k64Base - k4Base][i] != NULL) {
-				free(deltas[k64Base - k4Base][i]);
-				deltas[k64Base - k4Base][i] = NULL;
-			}
+			pcdCacheRelease(bufferCache, deltas[k64Base - k4Base][i]);
+			deltas[k64Base - k4Base][i] = NULL;
 		}
 	}
 	
-	if (hTables != NULL) {
-		free(hTables);
-	}
+	pcdCacheRelease(bufferCache, hTables);
 	
 	if (ic != NULL) {
 		fclose(ic);
@@ -3251,15 +5483,154 @@ bool pcdDecode::parseICFile (const pcdFilenameType *ipe_file)
 		fclose(thisFile);
 		thisFile = NULL;
 	}
-	if (buffer != NULL) {
-		free(buffer);
-		buffer = NULL;
-	}
+	pcdCacheRelease(bufferCache, buffer);
+	buffer = NULL;
 	return retVal;
 }
 
 
+//////////////////////////////////////////////////////////////
+//
+// Residual streams
+//
+//////////////////////////////////////////////////////////////
+// The 4Base and 16Base deltas, and the 64Base IPE files, are at independent
+// locations with their own huffman tables, so parseFile decodes them concurrently
+// on the thread pool. Each stream has its own file handle and tables, and writes
+// only its own delta planes; errors are caught within the stream, and sorted
+// out by parseFile once all the streams are done.
+struct pcdResidualStream {
+	pcdDecode *decoder;
+	int scene;
+	const pcdFilenameType *fileName;
+	off_t HCTOffset;
+	off_t ICDOffset;
+	struct pcdProgress *progress;
+	bool success;
+	char error[kPCDMaxStringLength*3];
+	
+	pcdThreadFunction decode(void *t)
+	{
+		struct pcdResidualStream *stream = (struct pcdResidualStream *) t;
+		pcdDecode *decoder = stream->decoder;
+		int scene = stream->scene;
+		FILE *fp = NULL;
+		huffTables *hTables = NULL;
+		ReadBuffer hufBuffer;
+		
+		stream->success = true;
+		stream->error[0] = 0x0;
+		if (scene == k64Base) {
+			// the 6144 by 4096 image;
+			// parseICFile has its own internal try/catch, and sets the error string itself
+			if (stream->fileName == NULL) {
+				stream->success = false;
+				strncpy(stream->error, "No 64Base IPE file was given", kPCDMaxStringLength*3-1);
+			}
+			else {
+				stream->success = decoder->parseICFile(stream->fileName, stream->progress);
+			}
+			return 0;
+		}
+		try {
+			fp = decoder->openInput(stream->fileName);
+			if (fp == NULL) {
+				throw "Could not reopen PCD file";
+			}
+			hTables = (huffTables *) pcdCacheAlloc(decoder->bufferCache, sizeof(huffTables));
+			if (hTables == NULL) {
+				throw "Could not allocate huffman tables";
+			}
+			if (scene == k4Base) {
+				// Here we're reading in the 1536 by 1024 image's deltas - luma only
+				// So we end up with an image with the chroma subsampled by a factor of 4
+				readAllHuffmanTables(fp, stream->HCTOffset, hTables, 1);			
+				// Now we need to get the actual data......
+				fseek(fp, stream->ICDOffset, SEEK_SET);
+				decoder->deltas[k4Base - k4Base][0] = (uint8_t *) pcdCacheAlloc(decoder->bufferCache, PCDLumaWidth[k4Base]*PCDLumaHeight[k4Base]*sizeof(uint8_t));
+			}
+			else {
+				// Here we're reading in the 3072 by 2048 image's deltas - luma and chroma
+				// Chroma is subsampled by a factor of two. Aka 16 times more data than
+				// the 4 Base image			
+				readAllHuffmanTables(fp, stream->HCTOffset, hTables, decoder->monochrome ? 1 : 3);	
+				fseek(fp, stream->ICDOffset, SEEK_SET);
+				decoder->deltas[k16Base - k4Base][0] = (uint8_t *) pcdCacheAlloc(decoder->bufferCache, PCDLumaWidth[k16Base]*PCDLumaHeight[k16Base]*sizeof(uint8_t));	
+				if (!decoder->monochrome) {
+					decoder->deltas[k16Base - k4Base][1] = (uint8_t *) pcdCacheAlloc(decoder->bufferCache, PCDChromaWidth[k16Base]*PCDChromaHeight[k16Base]*sizeof(uint8_t));
+					decoder->deltas[k16Base - k4Base][2] = (uint8_t *) pcdCacheAlloc(decoder->bufferCache, PCDChromaWidth[k16Base]*PCDChromaHeight[k16Base]*sizeof(uint8_t));
+				}
+			}
+			initReadBuffer(&hufBuffer, fp);
+			readPCDDeltas(&hufBuffer, hTables, scene, 0, 0, decoder->deltas[scene - k4Base], 0, stream->progress);
+		}
+		catch (const char *err) {
+			stream->success = false;
+			strncpy(stream->error, err, kPCDMaxStringLength*2);
+			stream->error[kPCDMaxStringLength*2] = 0x0;
+			strcat(stream->error, scene == k4Base ? " while processing 4Base image" : " while processing 16Base image");
+		}
+		catch (...) {
+			stream->success = false;
+			strncpy(stream->error, scene == k4Base ? "Could not find a valid 4Base image; falling back to Base" :
+					"Could not find a valid 16Base image; falling back to 4Base", kPCDMaxStringLength*3-1);
+		}
+		pcdCacheRelease(decoder->bufferCache, hTables);
+		if (fp != NULL) fclose(fp);
+		return 0;
+	}
+};
+
 bool pcdDecode::parseFile (const pcdFilenameType *in_file, const pcdFilenameType *ipe_file, unsigned int sNum)
+{
+	return parseLevels(in_file, ipe_file, sNum, NULL, NULL);
+}
+
+bool pcdDecode::parseData (const uint8_t *data, size_t size, const pcdFilenameType *ipe_file, unsigned int sNum)
+{
+	bool result;
+	if ((data == NULL) || (size == 0)) {
+		pcdFreeAll();
+		strncpy(errorString, "PCD file is too small to be valid", kPCDMaxStringLength*3-1);
+		return false;
+	}
+#ifdef _MSC_VER
+	pcdFreeAll();
+	strncpy(errorString, "Reading PCD data from memory is not supported on this platform", kPCDMaxStringLength*3-1);
+	result = false;
+#else
+	// Every stream that parseLevels opens is then a separate read-only stream on data, 
+	// so the residual streams can still be read concurrently
+	inData = data;
+	inDataSize = size;
+	result = parseLevels(NULL, ipe_file, sNum, NULL, NULL);
+	inData = NULL;
+	inDataSize = 0;
+#endif
+	return result;
+}
+
+// Opens the PCD file; or during parseData, a stream on the caller's data
+FILE *pcdDecode::openInput(const pcdFilenameType *in_file)
+{
+	if (inData != NULL) {
+#ifdef _MSC_VER
+		return NULL;
+#else
+		return fmemopen((void *) inData, inDataSize, "rb");
+#endif
+	}
+	return pcdMagicFOpen(in_file, pcdMagicFOpenMode);
+}
+
+bool pcdDecode::parseFileProgressive (const pcdFilenameType *in_file, const pcdFilenameType *ipe_file, unsigned int sNum,
+									  pcdRefinementCallback callback, void *context)
+{
+	return parseLevels(in_file, ipe_file, sNum, callback, context);
+}
+
+bool pcdDecode::parseLevels (const pcdFilenameType *in_file, const pcdFilenameType *ipe_file, unsigned int sNum,
+							 pcdRefinementCallback callback, void *context)
 {
 	FILE *fp = NULL;
 	size_t count = 0;
@@ -3272,8 +5643,11 @@ bool pcdDecode::parseFile (const pcdFilenameType *in_file, const pcdFilenameType
 	// Free any memory from previous conversions
 	pcdFreeAll();
 	errorString[0] = 0x0;
+	if (checkCancelled()) {
+		return false;
+	}
 	
-	fp = pcdMagicFOpen (in_file, pcdMagicFOpenMode);
+	fp = openInput(in_file);
 	if (fp == NULL) 
 	{
 		strncpy(errorString, "Could not open PCD file - may be a file permissions problem", kPCDMaxStringLength*3-1);
@@ -3281,7 +5655,7 @@ bool pcdDecode::parseFile (const pcdFilenameType *in_file, const pcdFilenameType
 	}
 	
 	// Check that this is a PCD file.
-	pcdFileHeader = malloc(sizeof(PCDFile));
+	pcdFileHeader = pcdCacheAlloc(bufferCache, sizeof(PCDFile));
 	if (pcdFileHeader == NULL) {
 		return false;
 	}
@@ -3289,7 +5663,7 @@ bool pcdDecode::parseFile (const pcdFilenameType *in_file, const pcdFilenameType
 	
 	count = readBytes(fp, sizeof(PCDFile), (uint8_t *) pcdFile);
 	if (count != sizeof(PCDFile)) {
-		free(pcdFileHeader);
+		pcdCacheRelease(bufferCache, pcdFileHeader);
 		pcdFileHeader = NULL;
 		strncpy(errorString, "PCD file is too small to be valid", kPCDMaxStringLength*3-1);
 		return false;
@@ -3298,7 +5672,7 @@ bool pcdDecode::parseFile (const pcdFilenameType *in_file, const pcdFilenameType
 
 	if ((compareBytes(pcdFile->ipiHeader.ipiSignature,"PCD_IPI") != 0) && !overview)
 	{
-		free(pcdFileHeader);
+		pcdCacheRelease(bufferCache, pcdFileHeader);
 		pcdFileHeader = NULL;
 		strncpy(errorString, "That is not a valid PCD file", kPCDMaxStringLength*3-1);
 		return false;
@@ -3307,7 +5681,7 @@ bool pcdDecode::parseFile (const pcdFilenameType *in_file, const pcdFilenameType
 	if (pcdFile->iciBase16.interleaveRatio != 1)
 	{
 		// We have interleaved audio......
-		free(pcdFileHeader);
+		pcdCacheRelease(bufferCache, pcdFileHeader);
 		pcdFileHeader = NULL;
 		strncpy(errorString, "The file contains interleaved audio", kPCDMaxStringLength*3-1);
 		return false;
@@ -3334,7 +5708,7 @@ bool pcdDecode::parseFile (const pcdFilenameType *in_file, const pcdFilenameType
 
 	// This reads in the base image - may be the right size, may be smaller
 	// if smaller, we need to get delta images.........
-	baseScene = readBaseImage(fp, sceneNumber, ICDOffset, &luma, &chroma1, &chroma2);
+	baseScene = readBaseImage(bufferCache, fp, sceneNumber, ICDOffset, &luma, &chroma1, &chroma2, monochrome);
 	
 	// Test Image only
 //	 genTestBaseImage(sceneNumber, luma, chroma1, chroma2);
@@ -3351,97 +5725,314 @@ bool pcdDecode::parseFile (const pcdFilenameType *in_file, const pcdFilenameType
 		sceneNumber = baseScene;
 	}
 	
-	if (sceneNumber >= k4Base) {
-		try {
-			// Here we're reading in the 1536 by 1024 image's deltas - luma only
-			// So we end up with an image with the chroma subsampled by a factor of 4
-			ReadBuffer hufBuffer;
-			huffTables *hTables = (huffTables *) malloc(sizeof(huffTables));
-			if (hTables == NULL) {
-				strncpy(errorString, "Could not allocate huffman tables", kPCDMaxStringLength*3-1);
-			}
-			else {
-				readAllHuffmanTables(fp, kSceneSectorSize * HCTOffset[k4Base], hTables, 1);			
-				// Now we need to get the actual data......
-				fseek(fp, kSceneSectorSize * ICDOffset[k4Base], SEEK_SET);
-				deltas[k4Base - k4Base][0] = (uint8_t *) malloc(PCDLumaWidth[k4Base]*PCDLumaHeight[k4Base]*sizeof(uint8_t));
-				initReadBuffer(&hufBuffer, fp);
-				readPCDDeltas(&hufBuffer, hTables, k4Base, 0, 0, deltas[k4Base - k4Base], 0);
-				
-				if (sceneNumber >= k16Base) {
-					try {
-						// Here we're reading in the 3072 by 2048 image's deltas - luma and chroma
-						// Chroma is subsampled by a factor of two. Aka 16 times more data than
-						// the 4 Base image			
-						readAllHuffmanTables(fp, kSceneSectorSize * HCTOffset[k16Base], hTables, monochrome ? 1 : 3);	
-						fseek(fp, kSceneSectorSize * ICDOffset[k16Base], SEEK_SET);
-						deltas[k16Base - k4Base][0] = (uint8_t *) malloc(PCDLumaWidth[k16Base]*PCDLumaHeight[k16Base]*sizeof(uint8_t));	
-						if (!monochrome) {
-							deltas[k16Base - k4Base][1] = (uint8_t *) malloc(PCDChromaWidth[k16Base]*PCDChromaHeight[k16Base]*sizeof(uint8_t));
-							deltas[k16Base - k4Base][2] = (uint8_t *) malloc(PCDChromaWidth[k16Base]*PCDChromaHeight[k16Base]*sizeof(uint8_t));
-						}
-						initReadBuffer(&hufBuffer, fp);
-						readPCDDeltas(&hufBuffer, hTables, k16Base, 0, 0, deltas[k16Base - k4Base], 0);
-						if (sceneNumber >= k64Base) {
-							// the 6144 by 4096 image;
-							// parseICFile has its own internal try/catch 
-							if (!parseICFile(ipe_file)) {
-								sceneNumber = k16Base;							
-								if (errorString == NULL) {
-									strncpy(errorString, "Error while processing 64Base image", kPCDMaxStringLength*3-1);
-								}
-							 }
-						}
-					}
-					catch (char *err) {
-						sceneNumber = k4Base;
-						if (errorString == NULL) {
-							strncpy(errorString, err, kPCDMaxStringLength*3-1);
-							strcat(errorString, " while processing 16Base image");
-						}
-					}
-					catch (...) {
-						sceneNumber = k4Base;
-						if (errorString == NULL) strncpy(errorString, "Could not find a valid 16Base image; falling back to 4Base", kPCDMaxStringLength*3-1);
-					}
-					if (sceneNumber == k4Base) {
-						if (deltas[k16Base - k4Base][0] != NULL) {
-							free (deltas[k16Base - k4Base][0]);
-							deltas[k16Base - k4Base][0] = NULL;
-						}			
-						if (deltas[k16Base - k4Base][1] != NULL) {
-							free (deltas[k16Base - k4Base][1]);
-							deltas[k16Base - k4Base][1] = NULL;
-						}	
-						if (deltas[k16Base - k4Base][2] != NULL) {
-							free (deltas[k16Base - k4Base][2]);
-							deltas[k16Base - k4Base][2] = NULL;
-						}
-					}
-				}
-				free(hTables);
-			}
-		}
-		catch (char *err) {
-			sceneNumber = kBase;
-			if (errorString == NULL) {
-				strncpy(errorString, err, kPCDMaxStringLength*3-1);
-				strcat(errorString, " while processing 4Base image");
+	if (retainScenes) {
+		// The lower resolutions are stored as complete images, and are small, so 
+		// just read them in as well
+		unsigned int scene;
+		for (scene = kBase16; scene < baseScene; scene++) {
+			if (readBaseImage(bufferCache, fp, scene, ICDOffset, &(retainedPlanes[scene][0]), &(retainedPlanes[scene][1]), 
+							  &(retainedPlanes[scene][2]), monochrome) != (int) scene) {
+				freeRetainedScene(scene);
 			}
 		}
-		catch (...) {
-			sceneNumber = kBase;
-			if (errorString == NULL) strncpy(errorString, "Could not find a valid 4Base image; falling back to Base", kPCDMaxStringLength*3-1);
+	}
+	
+	fclose(fp);
+	fp = NULL;
+	
+	if (sceneNumber < k4Base) {
+		// No residuals; what we have is all there is
+		if (callback != NULL) callback(this, sceneNumber, context);
+		return true;
+	}
+	if (callback == NULL) {
+		// All the residual streams at once
+		decodeResiduals(in_file, ipe_file, k4Base, sceneNumber, HCTOffset, ICDOffset);
+		return !checkCancelled();
+	}
+	
+	// Progressive; each level is assembled on top of the one before, and handed to
+	// the callback as soon as it is complete
+	unsigned int targetScene = sceneNumber, level;
+	sceneNumber = kBase;
+	if (!callback(this, sceneNumber, context)) return true;
+	setOutputScene(kBase);
+	for (level = k4Base; level <= targetScene; level++) {
+		bool decoded = decodeResiduals(in_file, ipe_file, level, level, HCTOffset, ICDOffset);
+		if (checkCancelled()) return false;
+		if (!decoded) break;
+		postParse();
+		if (pcdFileHeader == NULL) {
+			// postParse was cancelled
+			return false;
 		}
-		if (sceneNumber == kBase) {
-			if (deltas[k4Base - k4Base][0] != NULL) {
-				free (deltas[k4Base - k4Base][0]);
-				deltas[k4Base - k4Base][0] = NULL;
+		if (!callback(this, sceneNumber, context)) break;
+		// The callback may have picked a lower scene for output
+		setOutputScene(level);
+	}
+	return true;
+}
+
+bool pcdDecode::decodeResiduals(const pcdFilenameType *in_file, const pcdFilenameType *ipe_file, 
+								unsigned int firstScene, unsigned int lastScene, int HCTOffset[kMaxScenes], int ICDOffset[kMaxScenes])
+{
+	struct pcdResidualStream streams[3];
+	int stream, numStreams = lastScene - firstScene + 1, level;
+	bool success = true;
+	struct pcdProgress progressData, *progress;
+	size_t totalRows = 0;
+	for (level = firstScene; level <= (int) lastScene; level++) {
+		// 64Base's rows are added once its IC file has been read
+		if (level == k4Base) totalRows += PCDLumaHeight[k4Base];
+		if (level == k16Base) totalRows += PCDLumaHeight[k16Base] + (monochrome ? 0 : 2*PCDChromaHeight[k16Base]);
+	}
+	progress = pcdBeginProgress(&progressData, this, progressCallback, progressContext, cancelToken, kPCDReadingStage, 0, totalRows);
+	for (stream = 0; stream < numStreams; stream++) {
+		streams[stream].decoder = this;
+		streams[stream].scene = firstScene + stream;
+		streams[stream].fileName = (streams[stream].scene == k64Base) ? ipe_file : in_file;
+		streams[stream].HCTOffset = kSceneSectorSize * HCTOffset[firstScene + stream];
+		streams[stream].ICDOffset = kSceneSectorSize * ICDOffset[firstScene + stream];
+		streams[stream].progress = progress;
+	}
+	pcdRunTasks(getExecutor(), pcdResidualStream::decode, 
+				streams, sizeof(struct pcdResidualStream), numStreams);
+	
+	// Each level needs all the ones below it, so we fall back to just below the
+	// lowest level that failed
+	sceneNumber = lastScene;
+	for (stream = 0; stream < numStreams; stream++) {
+		if (!streams[stream].success) {
+			sceneNumber = firstScene + stream - 1;
+			success = false;
+			if (streams[stream].error[0] != 0x0) {
+				strncpy(errorString, streams[stream].error, kPCDMaxStringLength*3-1);
+			}
+			else if (errorString[0] == 0x0) {
+				strncpy(errorString, "Error while processing 64Base image", kPCDMaxStringLength*3-1);
 			}
+			break;
+		}
+	}
+	for (level = sceneNumber + 1; level <= k64Base; level++) {
+		if (level < k4Base) continue;
+		for (stream = 0; stream < 3; stream++) {
+			pcdCacheRelease(bufferCache, deltas[level - k4Base][stream]);
+			deltas[level - k4Base][stream] = NULL;
 		}
 	}
+	pcdEndProgress(progress, success);
+	return success;
+}
 
-	fclose(fp);
-	fp = NULL;
+//////////////////////////////////////////////////////////////
+//
+// Decoded image
+//
+//////////////////////////////////////////////////////////////
+// An image is just a private decoder that is handed the planes, geometry and 
+// settings of another; rendering only reads from it, other than interpolating
+// the chroma the first time, which is done under the lock.
+
+struct pcdImageData {
+	pcdDecode *decoder;
+	pcdMutex lock;
+	bool prepared;									// The chroma is ready for rendering
+	uint8_t *c1p;
+	uint8_t *c2p;
+	int resFactor;
+};
+
+bool pcdDecode::takeImage(pcdDecodedImage &image)
+{
+	struct pcdImageData *id;
+	pcdDecode *target;
+	int i, j;
+	
+	if (pcdFileHeader == NULL) {
+		return false;
+	}
+	for (i = 0; i < 3; i++) {
+		for (j = 0; j < 3; j++) {
+			// postParse hasn't been called
+			if (deltas[i][j] != NULL) return false;
+		}
+	}
+	id = (struct pcdImageData *) image.imageData;
+	if (id == NULL) {
+		id = new pcdImageData;
+		id->decoder = new pcdDecode();
+		pcdMutexInit(id->lock);
+		image.imageData = id;
+	}
+	target = id->decoder;
+	
+	// Whatever the image held comes back here, for the next file
+	target->rewindScanlines();
+	pcdCacheRelease(bufferCache, target->luma);
+	pcdCacheRelease(bufferCache, target->chroma1);
+	pcdCacheRelease(bufferCache, target->chroma2);
+	pcdCacheRelease(bufferCache, target->pcdFileHeader);
+	pcdCacheRelease(bufferCache, target->upResC1);
+	pcdCacheRelease(bufferCache, target->upResC2);
+	
+	target->setAllocator(bufferCache->allocator);
+	target->luma = luma;
+	target->chroma1 = chroma1;
+	target->chroma2 = chroma2;
+	target->pcdFileHeader = pcdFileHeader;
+	target->upResC1 = upResC1;
+	target->upResC2 = upResC2;
+	target->upResCacheResFactor = upResCacheResFactor;
+	target->upResCacheMethod = upResCacheMethod;
+	target->upResCacheScene = upResCacheScene;
+	target->upResValid = upResValid;
+	target->imageRotate = imageRotate;
+	target->imageResolution = imageResolution;
+	target->imageIPEAvailable = imageIPEAvailable;
+	target->imageHuffmanClass = imageHuffmanClass;
+	target->baseScene = baseScene;
+	target->sceneNumber = sceneNumber;
+	target->ipeLayers = ipeLayers;
+	target->ipeFiles = ipeFiles;
+	target->upResMethod = upResMethod;
+	target->monochrome = monochrome;
+	target->colorSpace = colorSpace;
+	target->whiteBalance = whiteBalance;
+	// The image keeps the curve it was taken with
+	if (target->outputCurve != NULL) free(target->outputCurve);
+	target->outputCurve = NULL;
+	if (outputCurve != NULL) {
+		target->outputCurve = (struct pcdOutputCurve *) malloc(sizeof(struct pcdOutputCurve));
+		if (target->outputCurve != NULL) {
+			memcpy(target->outputCurve, outputCurve, sizeof(struct pcdOutputCurve));
+		}
+	}
+	target->taskExecutor = taskExecutor;
+	target->cancelToken = cancelToken;
+	strcpy(target->errorString, errorString);
+	id->prepared = false;
+	
+	// The planes have moved, so mustn't be freed here
+	luma = chroma1 = chroma2 = NULL;
+	pcdFileHeader = NULL;
+	upResC1 = upResC2 = NULL;
+	upResValid = false;
+	pcdFreeAll();
 	return true;
 }
+
+pcdDecodedImage::pcdDecodedImage()
+{
+	imageData = NULL;
+}
+
+pcdDecodedImage::~pcdDecodedImage()
+{
+	struct pcdImageData *id = (struct pcdImageData *) imageData;
+	if (id != NULL) {
+		delete id->decoder;
+		pcdMutexDestroy(id->lock);
+		delete id;
+	}
+	imageData = NULL;
+}
+
+#if __cplusplus >= 201103L
+pcdDecodedImage::pcdDecodedImage(pcdDecodedImage &&other)
+{
+	imageData = other.imageData;
+	other.imageData = NULL;
+}
+
+pcdDecodedImage &pcdDecodedImage::operator= (pcdDecodedImage &&other)
+{
+	// Our old contents go with other, and are freed with it
+	swap(other);
+	return *this;
+}
+#endif
+
+void pcdDecodedImage::swap(pcdDecodedImage &other)
+{
+	void *temp = imageData;
+	imageData = other.imageData;
+	other.imageData = temp;
+}
+
+bool pcdDecodedImage::isEmpty()
+{
+	return imageData == NULL;
+}
+
+size_t pcdDecodedImage::getWidth()
+{
+	return imageData == NULL ? 0 : ((struct pcdImageData *) imageData)->decoder->getWidth();
+}
+
+size_t pcdDecodedImage::getHeight()
+{
+	return imageData == NULL ? 0 : ((struct pcdImageData *) imageData)->decoder->getHeight();
+}
+
+int pcdDecodedImage::getOrientation()
+{
+	return imageData == NULL ? 0 : ((struct pcdImageData *) imageData)->decoder->getOrientation();
+}
+
+bool pcdDecodedImage::isMonochrome()
+{
+	return imageData == NULL ? false : ((struct pcdImageData *) imageData)->decoder->isMonochrome();
+}
+
+unsigned int pcdDecodedImage::getScene()
+{
+	return imageData == NULL ? 0 : ((struct pcdImageData *) imageData)->decoder->sceneNumber;
+}
+
+void pcdDecodedImage::getMetadata(unsigned int select, char *description, char *value)
+{
+	if (imageData == NULL) {
+		if (description != NULL) strcpy(description, "Error");
+		strcpy(value, "Error");
+		return;
+	}
+	((struct pcdImageData *) imageData)->decoder->getMetadata(select, description, value);
+}
+
+bool pcdDecodedImage::prepare(uint8_t **c1p, uint8_t **c2p, int *resFactor)
+{
+	struct pcdImageData *id = (struct pcdImageData *) imageData;
+	bool ready;
+	if (id == NULL) {
+		return false;
+	}
+	pcdMutexLock(id->lock);
+	if (!id->prepared) {
+		id->prepared = id->decoder->getUpResChroma(&(id->c1p), &(id->c2p), &(id->resFactor));
+	}
+	ready = id->prepared;
+	*c1p = id->c1p;
+	*c2p = id->c2p;
+	*resFactor = id->resFactor;
+	pcdMutexUnlock(id->lock);
+	return ready;
+}
+
+bool pcdDecodedImage::populateOutputs(const struct pcdOutputDescriptor *outputs, unsigned int numOutputs)
+{
+	return renderRows(outputs, numOutputs, 0, getHeight());
+}
+
+bool pcdDecodedImage::renderRows(const struct pcdOutputDescriptor *outputs, unsigned int numOutputs, size_t firstRow, size_t numRows)
+{
+	uint8_t *c1p, *c2p;
+	int resFactor;
+	if ((numOutputs == 0) || (numRows == 0) || (firstRow + numRows > getHeight())) {
+		return false;
+	}
+	if (!prepare(&c1p, &c2p, &resFactor)) {
+		return false;
+	}
+	return ((struct pcdImageData *) imageData)->decoder->convertRows(outputs, numOutputs, NULL, firstRow, numRows, c1p, c2p, resFactor);
+}
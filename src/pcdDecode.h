@@ -126,6 +126,7 @@ typedef unsigned __int64  uint64_t;
 #endif
 
 #include <stddef.h>
+#include <stdio.h>
 #ifdef qMacOS
 #include <CoreServices/CoreServices.h>
 #endif
@@ -165,6 +166,29 @@ enum PCDWhiteBalance {
 	kPCDD50White,			// 5000K
 };
 
+enum PCDOutputDataSize {
+	pcdByteSize = 0,
+	pcdInt16Size,
+	pcdFloatSize,
+	pcdHalfSize,			// IEEE 754 half precision float, in a uint16_t
+	pcdPacked10Size,		// 10 bits per channel and 2 bits of alpha, packed into a uint32_t
+};
+
+enum PCDOutputLayouts {
+	kPCDSeparateLayout = 0,	// red, green, blue and alpha each point to their own channel
+	kPCDRGBALayout,			// Packed pixels starting at red; the other pointers are ignored
+	kPCDBGRALayout,
+	kPCDRGBXLayout,			// As RGBA and BGRA, but the fourth channel is left alone
+	kPCDBGRXLayout,
+	kPCDGrayLayout,			// One channel of luminance, at red; green and blue are ignored
+};
+
+enum PCDProgressStages {
+	kPCDReadingStage = 0,	// parseFile, decoding the 4Base, 16Base and 64Base residuals
+	kPCDUpResStage,			// postParse, adding the residuals to the interpolated image
+	kPCDConvertStage,		// The populate and read scanlines functions
+};
+
 enum PCDMetaDataDictionary {
 	kspecificationVersion = 0,	
 	kauthoringSoftwareRelease,		
@@ -204,6 +228,270 @@ enum PCDMediums {
 
 
 
+struct pcdResidualStream;
+struct pcdPoolData;
+struct pcdYCbCrPlanes;
+struct pcdBufferCache;
+struct pcdProgress;
+class pcdDecode;
+class pcdDecodedImage;
+
+// One set of RGB buffers to be filled by populateOutputs or readOutputScanlines.
+// Set any fields you don't use to zero; the defaults then match the populate functions.
+// For the packed layouts, pixels are four channels (or, for pcdPacked10Size, one
+// 32-bit word) apart, and d is not used. pcdPacked10Size holds red in the low bits
+// for RGBA and RGBX, and blue in the low bits for BGRA and BGRX; it is always
+// packed, so with kPCDSeparateLayout it is written as RGBA.
+// kPCDGrayLayout writes a single channel, d apart, plus alpha if it isn't NULL; the
+// value is the BT.601 weighted sum of the RGB channels (or Y for kPCDYCCColorSpace),
+// so for a monochrome image it is the same as each of the RGB channels. It can't
+// be used with pcdPacked10Size.
+struct pcdOutputDescriptor {
+	int colorSpace;									// One of PCDColorSpaces
+	int dataSize;									// One of PCDOutputDataSize
+	void *red;
+	void *green;
+	void *blue;
+	void *alpha;									// May be NULL
+	int d;											// Pointer increment, in units of dataSize
+	int layout;										// One of PCDOutputLayouts
+	size_t rowBytes;								// Distance between rows; 0 if rows follow on directly
+};
+
+// Called by parseFileProgressive each time a resolution level is ready; scene is a 
+// member of PCDResolutions. Return false to stop at this level.
+typedef bool (*pcdRefinementCallback)(pcdDecode *decoder, unsigned int scene, void *context);
+
+// Called as a decode stage makes progress; stage is a member of PCDProgressStages,
+// and done and total are in rows. See setProgressCallback.
+typedef void (*pcdProgressCallback)(pcdDecode *decoder, int stage, size_t done, size_t total, void *context);
+
+class pcdExecutor
+	{
+	public:
+		virtual ~pcdExecutor () {}
+		
+		//////////////////////////////////////////////////////////////
+		//
+		// Execute
+		//
+		//////////////////////////////////////////////////////////////
+		// Runs function(argument) once, at some later time, on any thread. It may 
+		// also be run before execute returns. The decoder submits at most 
+		// getConcurrency()-1 of these at a time for each operation, and always works on 
+		// the operation on the calling thread as well. So an executor that is busy (or 
+		// that runs everything inline) just means less help, never a stalled decode.
+		virtual void execute(void (*function)(void *), void *argument) = 0;
+		
+		//////////////////////////////////////////////////////////////
+		//
+		// Get Concurrency
+		//
+		//////////////////////////////////////////////////////////////
+		// Returns the number of threads, including the calling thread, that a single
+		// decode should try to keep busy. 1 means run everything on the calling thread.
+		virtual unsigned int getConcurrency() = 0;
+		
+		//////////////////////////////////////////////////////////////
+		//
+		// Run Pending Task
+		//
+		//////////////////////////////////////////////////////////////
+		// Optionally runs one queued task on the calling thread, and returns true if
+		// it did. The decoder calls this while waiting on tasks it has submitted, so
+		// a decode running on one of the executor's own threads helps drain the
+		// queue rather than just blocking that thread.
+		virtual bool runPendingTask() { return false; }
+	};
+
+class pcdThreadPool : public pcdExecutor
+	{
+	public:
+		//////////////////////////////////////////////////////////////
+		//
+		// Class initialiser
+		//
+		//////////////////////////////////////////////////////////////
+		// numThreads : Total number of threads that will work on a decode, including
+		// the calling thread; 0 for one per available CPU (see getAvailableCPUs)
+		// The worker threads are created here, and persist until the pool is deleted.
+		// A pool may be shared by any number of decoders, including decoders that are 
+		// running concurrently on different threads.
+		pcdThreadPool (unsigned int numThreads = 0);
+		
+		virtual ~pcdThreadPool ();
+		
+		//////////////////////////////////////////////////////////////
+		//
+		// Get Number of Threads
+		//
+		//////////////////////////////////////////////////////////////
+		// Returns the number of threads that work on a task, including the calling thread
+		virtual unsigned int getNumThreads();
+		
+		//////////////////////////////////////////////////////////////
+		//
+		// Get Shared Pool
+		//
+		//////////////////////////////////////////////////////////////
+		// Returns the process-wide pool used by decoders that have not been given a 
+		// executor with setExecutor. It is created on first use, with one thread per
+		// available CPU, and is never deleted.
+		static pcdThreadPool *getSharedPool();
+		
+		//////////////////////////////////////////////////////////////
+		//
+		// Get Available CPUs
+		//
+		//////////////////////////////////////////////////////////////
+		// Returns the number of CPUs this process can actually use. On linux this 
+		// takes account of the CPU affinity mask and of any cgroup CPU quota (as 
+		// set by e.g., docker --cpus), so is often less than the number of CPUs installed.
+		static unsigned int getAvailableCPUs();
+		
+		//////////////////////////////////////////////////////////////
+		//
+		// pcdExecutor functions
+		//
+		//////////////////////////////////////////////////////////////
+		// Tasks from execute go on the worker queues alongside the decoder's own. 
+		// With no worker threads, execute runs the function immediately.
+		virtual void execute(void (*function)(void *), void *argument);
+		virtual unsigned int getConcurrency();
+		virtual bool runPendingTask();
+		
+		//////////////////////////////////////////////////////////////
+		//
+		// Run Tasks
+		//
+		//////////////////////////////////////////////////////////////
+		// Runs function once for each of the numTasks task descriptions in tasks, 
+		// each taskSize bytes long, spread over the pool's threads and the calling 
+		// thread, and returns when they have all completed. The tasks may themselves 
+		// decode on this pool. But a thread waiting for a batch helps with whatever is
+		// queued, including other batches' tasks, so a task that runs for a long time
+		// - e.g., a batch converter's per-file worker - can end up nested on the stack
+		// of a thread that is waiting on something else. Such work is better run on
+		// threads of its own, with the pool just doing the decoders' work.
+		virtual void runTasks(void (*function)(void *), void *tasks, size_t taskSize, size_t numTasks);
+		
+	protected:
+		void *poolData;
+		
+		friend struct pcdPoolData *pcdGetPoolData(pcdExecutor *executor);
+		
+	private:
+		// Pools own threads, so can't be copied
+		pcdThreadPool (const pcdThreadPool &);
+		pcdThreadPool &operator= (const pcdThreadPool &);
+	};
+
+class pcdAllocator
+	{
+	public:
+		virtual ~pcdAllocator () {}
+		
+		//////////////////////////////////////////////////////////////
+		//
+		// Allocate
+		//
+		//////////////////////////////////////////////////////////////
+		// Returns at least size bytes, aligned as malloc would, or NULL if there is
+		// no memory. The decoder uses this for all of its large buffers - image and 
+		// residual planes, interpolated chroma, Huffman tables and the 64Base IPE file 
+		// - so an application can supply e.g., an arena or pool. It may be called from 
+		// any of the decoder's threads at the same time.
+		virtual void *allocate(size_t size) = 0;
+		
+		//////////////////////////////////////////////////////////////
+		//
+		// Release
+		//
+		//////////////////////////////////////////////////////////////
+		// Gives back a buffer from allocate; size is the size that was asked for.
+		virtual void release(void *buffer, size_t size) = 0;
+	};
+
+// Buffers at least this big are put on huge pages by default; each 64Base luma or
+// residual plane is about 24MB, so would otherwise need some 6000 4K pages
+#define kPCDHugePageThreshold (2*1024*1024)
+
+class pcdHugePageAllocator : public pcdAllocator
+	{
+	public:
+		//////////////////////////////////////////////////////////////
+		//
+		// Class initialiser
+		//
+		//////////////////////////////////////////////////////////////
+		// Buffers of threshold bytes or more are aligned to, and rounded up to, 2MB
+		// and marked for transparent huge pages; smaller ones just come from malloc.
+		// That cuts the TLB misses of the upres and conversion passes over large
+		// planes. On platforms other than linux, everything comes from malloc.
+		pcdHugePageAllocator (size_t threshold = kPCDHugePageThreshold);
+		
+		//////////////////////////////////////////////////////////////
+		//
+		// pcdAllocator functions
+		//
+		//////////////////////////////////////////////////////////////
+		virtual void *allocate(size_t size);
+		virtual void release(void *buffer, size_t size);
+		
+	protected:
+		size_t hugePageThreshold;
+	};
+
+class pcdCancelToken
+	{
+	public:
+		pcdCancelToken ();
+		virtual ~pcdCancelToken ();
+		
+		//////////////////////////////////////////////////////////////
+		//
+		// Cancel
+		//
+		//////////////////////////////////////////////////////////////
+		// Asks any decode using this token to stop as soon as it can. May be called
+		// from any thread, e.g., a request handler whose client has gone away, or
+		// from a progress callback. The token stays cancelled until reset.
+		virtual void cancel();
+		
+		//////////////////////////////////////////////////////////////
+		//
+		// Is Cancelled
+		//
+		//////////////////////////////////////////////////////////////
+		virtual bool isCancelled();
+		
+		//////////////////////////////////////////////////////////////
+		//
+		// Reset
+		//
+		//////////////////////////////////////////////////////////////
+		// Makes the token usable for another decode
+		virtual void reset();
+		
+	protected:
+		void *tokenData;
+		
+	private:
+		// Tokens are shared by pointer, so can't be copied
+		pcdCancelToken (const pcdCancelToken &);
+		pcdCancelToken &operator= (const pcdCancelToken &);
+	};
+
+//////////////////////////////////////////////////////////////
+//
+// Thread safety
+//
+//////////////////////////////////////////////////////////////
+// The decoder keeps no global state other than its constant lookup tables and the 
+// shared pool, so any number of pcdDecode instances can be used at the same time, 
+// on different threads, and can share an executor. A single instance must only be
+// used by one thread at a time. No function throws; errors are reported through 
+// the return value of parseFile and through getErrorString.
 class pcdDecode
 	{
 	public:
@@ -234,6 +522,69 @@ class pcdDecode
 		// When this function returns, metadata and image size is available, but no pixel data.
 		virtual bool parseFile (const pcdFilenameType *in_file, const pcdFilenameType *ipe_file, unsigned int sNum);
 		
+		//////////////////////////////////////////////////////////////
+		//
+		// Data parser
+		//
+		//////////////////////////////////////////////////////////////
+		// As parseFile, but the PCD file is the size bytes at data - e.g., as read from
+		// a pipe - rather than a file on disk. The data is only read during the call, so
+		// it can be freed as soon as this returns. ipe_file is still a file location, as 
+		// the 64Base data is spread over several files.
+		// This needs fmemopen, which MSVC doesn't have; there it just returns false, with
+		// the error string set.
+		virtual bool parseData (const uint8_t *data, size_t size, const pcdFilenameType *ipe_file, unsigned int sNum);
+		
+		//////////////////////////////////////////////////////////////
+		//
+		// Progressive file parser
+		//
+		//////////////////////////////////////////////////////////////
+		// As parseFile, but calls callback as soon as each resolution level is ready to 
+		// display: first the Base (or lower) image, which is read directly from the file, 
+		// then 4Base, 16Base and 64Base in turn, as far as sNum. Each level is built by 
+		// adding its residuals to the level before, so nothing is decoded twice.
+		// Within the callback the decoder is exactly as it would be after parseFile and
+		// postParse at that level; getWidth, getHeight, and the populate and read 
+		// scanlines functions can all be used. Return false from the callback to stop
+		// at that level. When this returns, the decoder is at the last level reached, 
+		// and postParse has already been done.
+		// If the callback isn't called at all, this returns false, with the error string set.
+		virtual bool parseFileProgressive (const pcdFilenameType *in_file, const pcdFilenameType *ipe_file, unsigned int sNum,
+										   pcdRefinementCallback callback, void *context);
+		
+		//////////////////////////////////////////////////////////////
+		//
+		// Set Retain Scenes
+		//
+		//////////////////////////////////////////////////////////////
+		// If this is set to true before parseFile, the decoder keeps the image at every 
+		// resolution up to the one decoded: the lower resolutions that are stored as  
+		// complete images are read from the file as well, and postParse keeps each level
+		// it builds on the way up. setOutputScene can then switch between them. This costs
+		// about a third more memory than the decoded resolution alone. Default false.
+		virtual void setRetainScenes(bool value);
+		
+		//////////////////////////////////////////////////////////////
+		//
+		// Set Output Scene
+		//
+		//////////////////////////////////////////////////////////////
+		// Selects which of the retained resolutions (a member of PCDResolutions) getWidth, 
+		// getHeight and the populate and read scanlines functions work on, without any
+		// re-parsing. So a master, a web image and a thumbnail cost one decode. Returns
+		// false, and changes nothing, if that resolution isn't available, or if 
+		// postParse hasn't been called yet. parseFile starts at the highest resolution.
+		virtual bool setOutputScene(unsigned int scene);
+		
+		//////////////////////////////////////////////////////////////
+		//
+		// Is Scene Available?
+		//
+		//////////////////////////////////////////////////////////////
+		// Returns true if setOutputScene can select the resolution
+		virtual bool isSceneAvailable(unsigned int scene);
+		
 		//////////////////////////////////////////////////////////////
 		//
 		// Post parser
@@ -281,6 +632,9 @@ class pcdDecode
 		// chroma data will be ignored. Note that values returned from the populateBuffers
 		// are still three component RGB, and that those three compoenets may not be equal.
 		// The relationship between them depends on the white balance setting
+		// If this is called before parseFile, the chroma is never read from the file,
+		// so the image can only be read as monochrome; use populateUInt8GrayBuffer or
+		// kPCDGrayLayout to get just the one channel back.
 		virtual void setIsMonoChrome(bool val);
 
 		//////////////////////////////////////////////////////////////
@@ -349,6 +703,21 @@ class pcdDecode
 		// The default (and what PCD images should be scanned at!) is 6500K
 		virtual void setWhiteBalance(int value);
 		
+		//////////////////////////////////////////////////////////////
+		//
+		// Set Output Curve
+		//
+		//////////////////////////////////////////////////////////////
+		// Sets a transfer curve to apply to the RGB data on output, after the color 
+		// space's own transfer function - e.g., a brightness or contrast adjustment. 
+		// curve holds numPoints (at least 2) output values for inputs evenly spaced 
+		// from 0.0 to 1.0, and is linearly interpolated between them. It is composed 
+		// with the decoder's output tables here, so it costs nothing per pixel. It 
+		// applies to every data size, to gray output, and to the RGB that YCbCr output 
+		// is made from; but not to the YCC color space. Pass NULL to remove the curve.
+		// Returns false, leaving any previous curve in place, if the curve couldn't be set.
+		virtual bool setOutputCurve(const float *curve, size_t numPoints);
+		
 		//////////////////////////////////////////////////////////////
 		//
 		// Get Error String
@@ -360,6 +729,8 @@ class pcdDecode
 		// If parseFile return false, then the contents of the error string consitute 
 		// an error message, and no image data is available. If parseFile returns true
 		// then the contents of the error string consitute a warning.
+		// If a populate function cannot allocate its working memory, it leaves the
+		// buffers untouched, and sets the error string.
 		virtual char *getErrorString();
 		
 		//////////////////////////////////////////////////////////////
@@ -430,6 +801,123 @@ class pcdDecode
 		// Multithreaded on platforms that support threading
 		virtual void populateUInt8Buffers(uint8_t *red, uint8_t *green, uint8_t *blue, uint8_t *alpha, int d);
 		
+		//////////////////////////////////////////////////////////////
+		//
+		// Read RGB scanlines
+		//
+		//////////////////////////////////////////////////////////////
+		// Converts the next numRows rows of the image (as rotated; see getOrientation)
+		// into the supplied buffers, and returns the number of rows actually converted,
+		// which is 0 once the whole image has been read. Buffers, alpha and d are as for 
+		// the corresponding populate function, except that the buffers only need to 
+		// hold numRows rows of getWidth() pixels. So an encoder can pull the image
+		// a band at a time, without ever holding a full frame of RGB data.
+		// The chroma is interpolated up to the luma resolution once, on the first
+		// populate or read scanlines call, and kept for later calls with the same
+		// interpolation method and scene; only the RGB conversion is repeated. It is
+		// released by postParse, parseFile or deleting the decoder.
+		// These functions can only be called if parseFile returned true, and 
+		// postParse has been called.
+		// Multithreaded on platforms that support threading
+		virtual size_t readFloatScanlines(float *red, float *green, float *blue, float *alpha, int d, size_t numRows);
+		virtual size_t readUInt16Scanlines(uint16_t *red, uint16_t *green, uint16_t *blue, uint16_t *alpha, int d, size_t numRows);
+		virtual size_t readUInt8Scanlines(uint8_t *red, uint8_t *green, uint8_t *blue, uint8_t *alpha, int d, size_t numRows);
+		
+		//////////////////////////////////////////////////////////////
+		//
+		// Populate multiple outputs
+		//
+		//////////////////////////////////////////////////////////////
+		// Fills several sets of buffers - each with its own color space, data size,
+		// layout, alpha, pointer increment and row pitch - in one pass over the 
+		// image. Each pixel is converted from YCC once, and the linear light stage 
+		// is shared by all the CCIR709 and sRGB outputs; so, e.g., 16-bit linear and
+		// 8-bit sRGB output costs little more than either on its own. The layouts and
+		// row pitch let the decoder write straight into, e.g., an aligned frame buffer
+		// or texture upload surface. The decoder's own color space setting is not used.
+		// Otherwise as for the populate functions.
+		virtual void populateOutputs(const struct pcdOutputDescriptor *outputs, unsigned int numOutputs);
+		
+		//////////////////////////////////////////////////////////////
+		//
+		// Read multiple output scanlines
+		//
+		//////////////////////////////////////////////////////////////
+		// The read scanlines equivalent of populateOutputs; shares the current
+		// scanline with the other read scanlines functions
+		virtual size_t readOutputScanlines(const struct pcdOutputDescriptor *outputs, unsigned int numOutputs, size_t numRows);
+		
+		//////////////////////////////////////////////////////////////
+		//
+		// Populate uint8 gray buffer
+		//
+		//////////////////////////////////////////////////////////////
+		// Populates the supplied buffer with a single channel of 8-bit luminance in
+		// the current color space; d is the pointer increment, in units of <uint8>.
+		// For a decoder set to monochrome before parseFile, no chroma is read, 
+		// decoded or interpolated at any stage, so this is the fast path for black and
+		// white images. For other data sizes, use populateOutputs with kPCDGrayLayout.
+		// This function can only be called if parseFile returned true, and 
+		// postParse has been called.
+		// Multithreaded on platforms that support threading
+		virtual void populateUInt8GrayBuffer(uint8_t *gray, int d);
+		
+		//////////////////////////////////////////////////////////////
+		//
+		// Read uint8 gray scanlines
+		//
+		//////////////////////////////////////////////////////////////
+		// The read scanlines equivalent of populateUInt8GrayBuffer; shares the current
+		// scanline with the other read scanlines functions
+		virtual size_t readUInt8GrayScanlines(uint8_t *gray, int d, size_t numRows);
+		
+		//////////////////////////////////////////////////////////////
+		//
+		// Populate YCbCr buffers
+		//
+		//////////////////////////////////////////////////////////////
+		// Populates the supplied planes with JFIF YCbCr - full range ITU-R BT.601, as 
+		// used by JPEG - with the chroma at half resolution in both directions (4:2:0).
+		// Y rows are getWidth() samples, yRowBytes apart. Cb and Cr rows are getWidth()/2
+		// samples, chromaRowBytes apart, with samples chromaD apart; so for I420 style
+		// planes pass chromaD = 1, and for NV12 style pass cr = cb + 1 and chromaD = 2.
+		// The samples are made from the 8-bit RGB data of the current color space 
+		// (normally sRGB). The file's chroma is interpolated as each pixel is converted,
+		// rather than into full size planes first, and the RGB never leaves the decoder;
+		// so an encoder is spared both its own RGB to YCbCr conversion and the 
+		// downsampling. 
+		// This function can only be called if parseFile returned true, and 
+		// postParse has been called.
+		// Multithreaded on platforms that support threading
+		virtual void populateYCbCrBuffers(uint8_t *y, uint8_t *cb, uint8_t *cr, size_t yRowBytes, size_t chromaRowBytes, int chromaD);
+		
+		//////////////////////////////////////////////////////////////
+		//
+		// Read YCbCr scanlines
+		//
+		//////////////////////////////////////////////////////////////
+		// The read scanlines equivalent of populateYCbCrBuffers; numRows Y rows and 
+		// numRows/2 chroma rows are converted. numRows is rounded down to an even 
+		// number, but is at least 2. Shares the current scanline with the other read 
+		// scanlines functions, which must be left on an even row.
+		virtual size_t readYCbCrScanlines(uint8_t *y, uint8_t *cb, uint8_t *cr, size_t yRowBytes, size_t chromaRowBytes, int chromaD, size_t numRows);
+		
+		//////////////////////////////////////////////////////////////
+		//
+		// Get Scanline
+		//
+		//////////////////////////////////////////////////////////////
+		// Returns the row the next read scanlines call will start at
+		virtual size_t getScanline();
+		
+		//////////////////////////////////////////////////////////////
+		//
+		// Rewind Scanlines
+		//
+		//////////////////////////////////////////////////////////////
+		// Restarts the read scanlines functions at the top of the image
+		virtual void rewindScanlines();
+		
 		
 		//////////////////////////////////////////////////////////////
 		//
@@ -443,6 +931,91 @@ class pcdDecode
 		// kPCDMaxStringLength
 		virtual void getMetadata(unsigned int select, char *description, char *value);
 		
+		//////////////////////////////////////////////////////////////
+		//
+		// Set Executor
+		//
+		//////////////////////////////////////////////////////////////
+		// Sets the executor that all of the decoder's parallel work - residual 
+		// decoding in parseFile, upres in postParse, and RGB conversion in the populate
+		// functions - is submitted to. This can be a pcdThreadPool, or an adaptor onto
+		// an application's own scheduler, so that one scheduler controls the total CPU
+		// use of any number of concurrent decodes. The executor is not owned by the 
+		// decoder, and must outlive it. Pass NULL (the default) to use the shared pool 
+		// returned by pcdThreadPool::getSharedPool.
+		virtual void setExecutor(pcdExecutor *value);
+		
+		//////////////////////////////////////////////////////////////
+		//
+		// Release Cached Buffers
+		//
+		//////////////////////////////////////////////////////////////
+		// The decoder's image planes, residual planes and Huffman tables are not freed
+		// when the next file is parsed, but kept for reuse; so one decoder working
+		// through a batch of files of the same resolution only allocates for the 
+		// first. The cost is that an idle decoder holds on to about as much memory as
+		// its largest recent file needed. This frees the buffers that aren't in use;
+		// deleting the decoder frees everything.
+		virtual void releaseCachedBuffers();
+		
+		//////////////////////////////////////////////////////////////
+		//
+		// Set Allocator
+		//
+		//////////////////////////////////////////////////////////////
+		// Sets where the decoder's large buffers come from; see pcdAllocator. Pass NULL
+		// (the default) for malloc and free. Buffers already allocated go back to the
+		// allocator they came from, so this can be changed at any time. The allocator
+		// is not owned by the decoder, and must outlive it.
+		virtual void setAllocator(pcdAllocator *value);
+		
+		//////////////////////////////////////////////////////////////
+		//
+		// Take Image
+		//
+		//////////////////////////////////////////////////////////////
+		// Moves the decoded image - the planes of the current scene, with its geometry
+		// and metadata - into image, without copying any planes, and leaves the decoder
+		// as if no file had been parsed, so it can start on the next file while image 
+		// is rendered, e.g., on another thread. Whatever image held before comes back
+		// to the decoder, so its buffers are reused for the next file. The image keeps
+		// the decoder's interpolation, white balance and monochrome settings, and its 
+		// executor, allocator and cancel token, which must outlive it; it doesn't make
+		// progress calls. Retained scenes are not moved; they are freed. Returns false,
+		// and leaves image alone, if parseFile hasn't succeeded, or postParse hasn't
+		// been called since.
+		virtual bool takeImage(pcdDecodedImage &image);
+		
+		//////////////////////////////////////////////////////////////
+		//
+		// Set Progress Callback
+		//
+		//////////////////////////////////////////////////////////////
+		// callback is called as each stage of a decode makes progress: reading the 
+		// residuals in parseFile (done and total count residual rows; for 64Base 
+		// these are row segments, and total goes up once the IC file has been read),
+		// the upres in postParse (rows of all the planes being upres'ed), and the RGB 
+		// or YCbCr conversion (rows of the output; for the read scanlines functions, 
+		// done includes the rows of earlier calls). Calls for one stage don't overlap, 
+		// but can come from any of the executor's threads, so the callback should be 
+		// quick. Pass NULL (the default) for no calls.
+		virtual void setProgressCallback(pcdProgressCallback callback, void *context);
+		
+		//////////////////////////////////////////////////////////////
+		//
+		// Set Cancel Token
+		//
+		//////////////////////////////////////////////////////////////
+		// Once token is cancelled, the decoder stops work between residual rows in
+		// parseFile, and between tiles in postParse and the conversions, and frees
+		// the threads and memory it was using. A cancelled parseFile or postParse 
+		// leaves the decoder as if no file had been parsed, and parseFile returns 
+		// false, with the error string "Decode cancelled". A cancelled conversion 
+		// leaves the output part filled; the read scanlines functions return 0.
+		// The token is not owned by the decoder, and must outlive it, or be unset by 
+		// passing NULL (the default, for no cancellation).
+		virtual void setCancelToken(pcdCancelToken *token);
+		
 	protected:
 		
 		int upResMethod;
@@ -462,12 +1035,133 @@ class pcdDecode
 		uint16_t ipeLayers;
 		uint16_t ipeFiles;
 		void *pcdFileHeader;
+		pcdExecutor *taskExecutor;
+		size_t scanlineRow;
+		uint8_t *upResC1;								// Interpolated chroma, kept between conversions
+		uint8_t *upResC2;
+		int upResCacheResFactor;
+		int upResCacheMethod;
+		unsigned int upResCacheScene;
+		bool upResValid;
+		bool retainScenes;
+		uint8_t *retainedPlanes[kMaxScenes][3];			// Not including the current scene
+		struct pcdBufferCache *bufferCache;				// Planes and tables kept for the next file
+		pcdProgressCallback progressCallback;
+		void *progressContext;
+		pcdCancelToken *cancelToken;
+		struct pcdOutputCurve *outputCurve;				// Output tables with the curve composed in
+		const uint8_t *inData;							// The PCD file, during parseData
+		size_t inDataSize;
 		char errorString[kPCDMaxStringLength*3];
 		
 		void interpolateBuffers(uint8_t  **c1UpRes, uint8_t **c2UpRes, int *resFactor);
+		bool getUpResChroma(uint8_t **c1p, uint8_t **c2p, int *resFactor);
+		void freeUpResChroma(void);
 		virtual void populateBuffers(void *red, void *green, void *blue, void *alpha, int d, int dataSize);
-		virtual bool parseICFile (const pcdFilenameType *ipe_file);
+		virtual size_t readScanlines(void *red, void *green, void *blue, void *alpha, int d, int dataSize, size_t numRows);
+		void setOutput(struct pcdOutputDescriptor *output, void *red, void *green, void *blue, void *alpha, int d, int dataSize);
+		bool convertRows(const struct pcdOutputDescriptor *outputs, unsigned int numOutputs, const struct pcdYCbCrPlanes *planes,
+						 size_t firstRow, size_t numRows, uint8_t *c1p, uint8_t *c2p, int resFactor);
+		virtual bool parseLevels (const pcdFilenameType *in_file, const pcdFilenameType *ipe_file, unsigned int sNum,
+								  pcdRefinementCallback callback, void *context);
+		bool decodeResiduals(const pcdFilenameType *in_file, const pcdFilenameType *ipe_file, 
+							 unsigned int firstScene, unsigned int lastScene, int HCTOffset[kMaxScenes], int ICDOffset[kMaxScenes]);
+		virtual bool parseICFile (const pcdFilenameType *ipe_file, struct pcdProgress *progress);
+		FILE *openInput(const pcdFilenameType *in_file);
 		void pcdFreeAll(void);
+		void freeRetainedScene(unsigned int scene);
+		pcdExecutor *getExecutor(void);
+		bool checkCancelled(void);
+		
+		friend struct pcdResidualStream;
+		friend class pcdDecodedImage;
+	};
+
+//////////////////////////////////////////////////////////////
+//
+// Decoded image
+//
+//////////////////////////////////////////////////////////////
+// A finished decode, as handed over by pcdDecode::takeImage. It owns its planes, 
+// which are freed when it is deleted; it can't be copied, but can be moved (or 
+// swapped) to another pcdDecodedImage, which just moves the ownership. Nothing in
+// it changes once it has been taken, so any number of threads can render from one
+// image at the same time.
+class pcdDecodedImage
+	{
+	public:
+		pcdDecodedImage ();
+		virtual ~pcdDecodedImage ();
+#if __cplusplus >= 201103L
+		pcdDecodedImage (pcdDecodedImage &&other);
+		pcdDecodedImage &operator= (pcdDecodedImage &&other);
+#endif
+		
+		//////////////////////////////////////////////////////////////
+		//
+		// Swap
+		//
+		//////////////////////////////////////////////////////////////
+		// Exchanges the contents of two images; no planes are copied. Not thread safe.
+		virtual void swap(pcdDecodedImage &other);
+		
+		//////////////////////////////////////////////////////////////
+		//
+		// Is Empty
+		//
+		//////////////////////////////////////////////////////////////
+		// Returns true if no image has been taken into this one
+		virtual bool isEmpty();
+		
+		//////////////////////////////////////////////////////////////
+		//
+		// Image information
+		//
+		//////////////////////////////////////////////////////////////
+		// As for the pcdDecode functions of the same name, for the image as it was 
+		// when it was taken. getScene returns the resolution it was decoded to, one
+		// of PCDResolutions.
+		virtual size_t getWidth();
+		virtual size_t getHeight();
+		virtual int getOrientation();
+		virtual bool isMonochrome();
+		virtual unsigned int getScene();
+		virtual void getMetadata(unsigned int select, char *description, char *value);
+		
+		//////////////////////////////////////////////////////////////
+		//
+		// Populate Outputs
+		//
+		//////////////////////////////////////////////////////////////
+		// As pcdDecode::populateOutputs. Safe to call from several threads at once; 
+		// where the chroma needs interpolating, the first call does it, and the others
+		// wait for it. Returns false if there is no image, no memory, or the cancel
+		// token was cancelled.
+		virtual bool populateOutputs(const struct pcdOutputDescriptor *outputs, unsigned int numOutputs);
+		
+		//////////////////////////////////////////////////////////////
+		//
+		// Render Rows
+		//
+		//////////////////////////////////////////////////////////////
+		// Converts output rows firstRow to firstRow+numRows-1 into outputs, whose 
+		// buffers only need to hold those rows; the read scanlines equivalent, except 
+		// that there is no current scanline, so several threads can each render their
+		// own band. Returns false if the rows are outside the image, or as for 
+		// populateOutputs.
+		virtual bool renderRows(const struct pcdOutputDescriptor *outputs, unsigned int numOutputs, size_t firstRow, size_t numRows);
+		
+	protected:
+		void *imageData;
+		
+		bool prepare(uint8_t **c1p, uint8_t **c2p, int *resFactor);
+		
+		friend class pcdDecode;
+		
+	private:
+		// Images own their planes, so can't be copied
+		pcdDecodedImage (const pcdDecodedImage &);
+		pcdDecodedImage &operator= (const pcdDecodedImage &);
 	};
 
 #endif
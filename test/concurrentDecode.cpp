@@ -0,0 +1,330 @@
+/* =======================================================
+ * concurrentDecode - a stress test for concurrent pcdDecode instances
+ * =======================================================
+ *
+ * Project Info:  http://sourceforge.net/projects/pcdtojpeg/
+ *
+ * This program is free software; you can redistribute it and/or modify it under the terms
+ * of the GNU General Public License as published by the Free Software Foundation;
+ * either version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * ---------------
+ * concurrentDecode.cpp
+ * ---------------
+ *
+ * Decodes each of the given files once on its own, with a single threaded pool, as a
+ * reference. Then starts a number of threads, each with its own pcdDecode, which all
+ * decode the files at the same time, in different orders, and checks every result
+ * against the reference - the RGB data, the size and the metadata, or for a file that
+ * can't be decoded, the error string.
+ * The even numbered threads' decoders use the shared pool, so that pool is used by
+ * several decoders at once; the odd numbered threads' decoders all use one foreign
+ * executor, a plain queue with threads of its own, as an application's scheduler
+ * would be. Mixing in truncated or otherwise broken files exercises the error paths.
+ * Returns 0 if everything matched. Running it under ThreadSanitizer (add
+ * -fsanitize=thread -g) also checks for data races.
+ */
+
+ /* Compiling under Linux, etc (this needs pthreads):
+ *    g++ -O2 -I../src concurrentDecode.cpp ../src/pcdDecode.cpp -lpthread -o concurrentDecode
+ *
+ * Usage:
+ *    concurrentDecode [-t threads] [-p passes] [-r resolution] file.pcd ...
+ */
+
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "pcdDecode.h"
+
+//////////////////////////////////////////////////////////////
+//
+// Foreign executor
+//
+//////////////////////////////////////////////////////////////
+// A first in, first out queue with its own threads, that knows nothing of the
+// decoder's pools. It doesn't implement runPendingTask, so a decoder waiting on it
+// can't help drain the queue.
+
+struct queuedTask {
+	void (*function)(void *);
+	void *argument;
+};
+
+class queueExecutor : public pcdExecutor
+	{
+	public:
+		queueExecutor (unsigned int numThreads);
+		virtual ~queueExecutor ();
+		virtual void execute(void (*function)(void *), void *argument);
+		virtual unsigned int getConcurrency();
+
+	private:
+		static void *worker(void *e);
+
+		std::vector<pthread_t> threads;
+		std::vector<queuedTask> queue;
+		size_t front;
+		pthread_mutex_t lock;
+		pthread_cond_t available;
+		bool shutdown;
+	};
+
+queueExecutor::queueExecutor(unsigned int numThreads)
+{
+	unsigned int i;
+	pthread_t thread;
+	front = 0;
+	shutdown = false;
+	pthread_mutex_init(&lock, NULL);
+	pthread_cond_init(&available, NULL);
+	for (i = 0; i < numThreads; i++) {
+		if (pthread_create(&thread, NULL, worker, (void *) this) == 0) {
+			threads.push_back(thread);
+		}
+	}
+}
+
+queueExecutor::~queueExecutor()
+{
+	size_t i;
+	pthread_mutex_lock(&lock);
+	shutdown = true;
+	pthread_cond_broadcast(&available);
+	pthread_mutex_unlock(&lock);
+	for (i = 0; i < threads.size(); i++) {
+		pthread_join(threads[i], NULL);
+	}
+	pthread_cond_destroy(&available);
+	pthread_mutex_destroy(&lock);
+}
+
+void queueExecutor::execute(void (*function)(void *), void *argument)
+{
+	queuedTask task;
+	if (threads.empty()) {
+		function(argument);
+		return;
+	}
+	task.function = function;
+	task.argument = argument;
+	pthread_mutex_lock(&lock);
+	queue.push_back(task);
+	pthread_cond_signal(&available);
+	pthread_mutex_unlock(&lock);
+}
+
+unsigned int queueExecutor::getConcurrency()
+{
+	return (unsigned int) threads.size() + 1;
+}
+
+// Tasks still queued at shutdown are run before the threads exit; a decoder's task
+// may start after the decode that submitted it has finished
+void *queueExecutor::worker(void *e)
+{
+	queueExecutor *executor = (queueExecutor *) e;
+	queuedTask task;
+	pthread_mutex_lock(&(executor->lock));
+	for (;;) {
+		if (executor->front < executor->queue.size()) {
+			task = executor->queue[executor->front++];
+			if (executor->front == executor->queue.size()) {
+				executor->queue.clear();
+				executor->front = 0;
+			}
+			pthread_mutex_unlock(&(executor->lock));
+			task.function(task.argument);
+			pthread_mutex_lock(&(executor->lock));
+		}
+		else if (executor->shutdown) {
+			break;
+		}
+		else {
+			pthread_cond_wait(&(executor->available), &(executor->lock));
+		}
+	}
+	pthread_mutex_unlock(&(executor->lock));
+	return NULL;
+}
+
+
+//////////////////////////////////////////////////////////////
+//
+// Decoding and checking
+//
+//////////////////////////////////////////////////////////////
+
+struct decodeResult {
+	bool success;
+	std::string error;
+	size_t width;
+	size_t height;
+	std::string metadata;
+	std::vector<uint8_t> rgb;
+};
+
+static void decodeFile(const char *file, unsigned int resolution, pcdExecutor *executor, struct decodeResult *result)
+{
+	pcdDecode *decoder = new pcdDecode();
+	char descrip[kPCDMaxStringLength], val[kPCDMaxStringLength];
+	unsigned int i;
+
+	decoder->setExecutor(executor);
+	decoder->setInterpolation(kUpResLumaIterpolate);
+	result->success = decoder->parseFile(file, NULL, resolution);
+	result->error = decoder->getErrorString();
+	result->width = 0;
+	result->height = 0;
+	result->metadata.clear();
+	result->rgb.clear();
+	if (result->success) {
+		for (i = 0; i < kMaxPCDMetadata; i++) {
+			decoder->getMetadata(i, descrip, val);
+			result->metadata.append(descrip).append(": ").append(val).append("\n");
+		}
+		decoder->postParse();
+		decoder->setColorSpace(kPCDsRGBColorSpace);
+		result->width = decoder->getWidth();
+		result->height = decoder->getHeight();
+		result->rgb.resize(result->width * result->height * 3);
+		if (!result->rgb.empty()) {
+			decoder->populateUInt8Buffers(&(result->rgb[0]), &(result->rgb[1]), &(result->rgb[2]), NULL, 3);
+		}
+		// Any error from the populate functions
+		result->error = decoder->getErrorString();
+	}
+	delete decoder;
+}
+
+static bool sameResult(const struct decodeResult *a, const struct decodeResult *b)
+{
+	return (a->success == b->success) && (a->error == b->error) && (a->width == b->width) &&
+		   (a->height == b->height) && (a->metadata == b->metadata) && (a->rgb == b->rgb);
+}
+
+struct decodeThread {
+	unsigned int index;
+	unsigned int passes;
+	unsigned int resolution;
+	pcdExecutor *executor;								// NULL for the shared pool
+	std::vector<const char *> *files;
+	std::vector<decodeResult> *references;
+	unsigned int decodes;
+	unsigned int failures;
+};
+
+static void *runDecodeThread(void *t)
+{
+	struct decodeThread *thread = (struct decodeThread *) t;
+	struct decodeResult result;
+	size_t numFiles = thread->files->size();
+	size_t i, file;
+
+	// Each thread starts on a different file, so different decodes overlap
+	for (i = 0; i < numFiles * thread->passes; i++) {
+		file = (thread->index + i) % numFiles;
+		decodeFile((*(thread->files))[file], thread->resolution, thread->executor, &result);
+		thread->decodes++;
+		if (!sameResult(&result, &((*(thread->references))[file]))) {
+			fprintf(stderr, "Thread %u: %s does not match the single threaded decode\n",
+					thread->index, (*(thread->files))[file]);
+			thread->failures++;
+		}
+	}
+	return NULL;
+}
+
+
+//////////////////////////////////////////////////////////////
+//
+// The main program
+//
+//////////////////////////////////////////////////////////////
+
+int main (int argc, char * const argv[]) {
+	unsigned int numThreads = 8;
+	unsigned int passes = 2;
+	unsigned int resolution = k16Base;
+	unsigned int decodes = 0, failures = 0;
+	std::vector<const char *> files;
+	int argIndex = 1;
+	size_t i;
+
+	while ((argIndex < argc) && (argv[argIndex][0] == '-')) {
+		if (argIndex > (argc - 2)) {
+			break;
+		}
+		if (strcmp(argv[argIndex], "-t") == 0) {
+			numThreads = (unsigned int) atoi(argv[argIndex+1]);
+		}
+		else if (strcmp(argv[argIndex], "-p") == 0) {
+			passes = (unsigned int) atoi(argv[argIndex+1]);
+		}
+		else if (strcmp(argv[argIndex], "-r") == 0) {
+			resolution = (unsigned int) atoi(argv[argIndex+1]);
+		}
+		else {
+			break;
+		}
+		argIndex += 2;
+	}
+	for (; argIndex < argc; argIndex++) {
+		files.push_back(argv[argIndex]);
+	}
+	if (files.empty() || (numThreads < 1) || (passes < 1) || (resolution > k16Base)) {
+		fprintf(stderr, "Usage: %s [-t threads] [-p passes] [-r resolution (0 to 4)] file.pcd ...\n", argv[0]);
+		return -1;
+	}
+
+	// The references are decoded one at a time, all on the calling thread
+	std::vector<decodeResult> references(files.size());
+	{
+		pcdThreadPool singleThreaded(1);
+		for (i = 0; i < files.size(); i++) {
+			decodeFile(files[i], resolution, &singleThreaded, &(references[i]));
+			if (!references[i].success) {
+				fprintf(stderr, "Note: %s can't be decoded: %s\n", files[i], references[i].error.c_str());
+			}
+		}
+	}
+
+	{
+		queueExecutor foreign(3);
+		std::vector<decodeThread> threads(numThreads);
+		std::vector<pthread_t> descriptors(numThreads);
+		for (i = 0; i < numThreads; i++) {
+			threads[i].index = (unsigned int) i;
+			threads[i].passes = passes;
+			threads[i].resolution = resolution;
+			threads[i].executor = ((i & 1) == 0) ? NULL : &foreign;
+			threads[i].files = &files;
+			threads[i].references = &references;
+			threads[i].decodes = 0;
+			threads[i].failures = 0;
+		}
+		for (i = 0; i < numThreads; i++) {
+			if (pthread_create(&(descriptors[i]), NULL, runDecodeThread, (void *) &(threads[i])) != 0) {
+				fprintf(stderr, "Could not start thread %u\n", (unsigned int) i);
+				return -1;
+			}
+		}
+		for (i = 0; i < numThreads; i++) {
+			pthread_join(descriptors[i], NULL);
+			decodes += threads[i].decodes;
+			failures += threads[i].failures;
+		}
+		// The foreign executor's threads finish any late tasks before it goes
+	}
+
+	printf("%u decodes on %u threads; %u did not match\n", decodes, numThreads, failures);
+	return (failures > 0) ? -1 : 0;
+}